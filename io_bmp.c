@@ -5,32 +5,96 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "io_bmp.h"
 #include "spiceweasel.h"
 
-int read_bmp(char *filename, TRawFrame *frame)
+/* Headers are little-endian, whatever the host */
+
+static unsigned int get_le(unsigned char *p, int n)
+{
+  unsigned int val = 0;
+  while(n--)
+    val = (val << 8) | p[n];
+  return(val);
+}
+
+static void put_le(unsigned char *p, int n, unsigned int val)
+{
+  int i;
+  for(i=0;i<n;i++) {
+    p[i] = val & 0xFF;
+    val >>= 8;
+  }
+}
+
+static void parse_headers(unsigned char *buf, BITMAPFILEHEADER *bmfh, BITMAPINFOHEADER *bmih)
 {
-  int i, j, padding, n;
+  bmfh->bfType          = get_le(buf, 2);
+  bmfh->bfSize          = get_le(buf+2, 4);
+  bmfh->bfReserved1     = get_le(buf+6, 2);
+  bmfh->bfReserved2     = get_le(buf+8, 2);
+  bmfh->bfOffBits       = get_le(buf+10, 4);
+
+  buf += BMP_FILEHEADER_SIZE;
+  bmih->biSize          = get_le(buf, 4);
+  bmih->biWidth         = (int) get_le(buf+4, 4);
+  bmih->biHeight        = (int) get_le(buf+8, 4);
+  bmih->biPlanes        = get_le(buf+12, 2);
+  bmih->biBitCount      = get_le(buf+14, 2);
+  bmih->biCompression   = get_le(buf+16, 4);
+  bmih->biSizeImage     = get_le(buf+20, 4);
+  bmih->biXPelsPerMeter = (int) get_le(buf+24, 4);
+  bmih->biYPelsPerMeter = (int) get_le(buf+28, 4);
+  bmih->biClrUsed       = get_le(buf+32, 4);
+  bmih->biClrImportant  = get_le(buf+36, 4);
+}
+
+static void store_headers(unsigned char *buf, BITMAPFILEHEADER *bmfh, BITMAPINFOHEADER *bmih)
+{
+  put_le(buf,    2, bmfh->bfType);
+  put_le(buf+2,  4, bmfh->bfSize);
+  put_le(buf+6,  2, bmfh->bfReserved1);
+  put_le(buf+8,  2, bmfh->bfReserved2);
+  put_le(buf+10, 4, bmfh->bfOffBits);
+
+  buf += BMP_FILEHEADER_SIZE;
+  put_le(buf,    4, bmih->biSize);
+  put_le(buf+4,  4, (unsigned int) bmih->biWidth);
+  put_le(buf+8,  4, (unsigned int) bmih->biHeight);
+  put_le(buf+12, 2, bmih->biPlanes);
+  put_le(buf+14, 2, bmih->biBitCount);
+  put_le(buf+16, 4, bmih->biCompression);
+  put_le(buf+20, 4, bmih->biSizeImage);
+  put_le(buf+24, 4, (unsigned int) bmih->biXPelsPerMeter);
+  put_le(buf+28, 4, (unsigned int) bmih->biYPelsPerMeter);
+  put_le(buf+32, 4, bmih->biClrUsed);
+  put_le(buf+36, 4, bmih->biClrImportant);
+}
+
+int read_bmp(char *filename, TFrame *frame)
+{
+  int n, pitch, nband, type, stride, topdown;
+  float factor;
+  int width, height, x0, y0, w, h, row, skip;
+  long offset;
+  unsigned char header[BMP_FILEHEADER_SIZE + BMP_INFOHEADER_SIZE];
+  unsigned char *band;
   BITMAPFILEHEADER        bmfh;
   BITMAPINFOHEADER        bmih;
   FILE *bitmap_file;
   
-  if((bitmap_file=fopen(filename,"rb"))==NULL) {
+  if((bitmap_file=input_open(filename))==NULL) {
     return(IO_ERROR_OPEN);
   } 
 
-  /* Read the bitmap file header */
-  if(fread(&bmfh,14,1,bitmap_file)!=1) {
-    fclose(bitmap_file);
-    return(IO_ERROR_FORMAT);
-  }
-
-  /* Read the bitmap information header */
-  if(fread(&bmih,40,1,bitmap_file)!=1) {
+  /* Read both headers in one go */
+  if(fread(header, sizeof(header), 1, bitmap_file)!=1) {
     fclose(bitmap_file);
     return(IO_ERROR_FORMAT);
   }
+  parse_headers(header, &bmfh, &bmih);
 
 #ifdef DEBUG
   /* Print out details of bitmap */
@@ -53,136 +117,206 @@ int read_bmp(char *filename, TRawFrame *frame)
   printf("\n");
 #endif
 
+  if((bmfh.bfType != 0x4D42) || (bmih.biSize < BMP_INFOHEADER_SIZE)) { /* "BM" */
+    fclose(bitmap_file);
+    return(IO_ERROR_FORMAT);
+  }
+
   if(bmih.biCompression!=0) {
     fclose(bitmap_file);
     return(IO_ERROR_FORMAT);
   }
 
-  if((bmih.biBitCount % 8) != 0) { /* Data must be in bytes */
+  if((bmih.biBitCount < 8) || ((bmih.biBitCount % 8) != 0)) { /* Data must be in bytes */
     fclose(bitmap_file);
     return(IO_ERROR_FORMAT);
   }
 
-  frame->bpp = bmih.biBitCount;
-  
-  n = frame->bpp / 8; /* Bytes per pixel */
+  n = bmih.biBitCount / 8; /* Bytes per pixel */
+  width = bmih.biWidth;
+  height = bmih.biHeight;
+  topdown = 0;
+  if(height < 0) {
+    /* Rows stored top to bottom */
+    height = -height;
+    topdown = 1;
+  }
 
-  if((frame->bpp % 8) != 0) {
+  /* Start of the pixel data. Older files (including ones written by
+     earlier versions of this code) may leave this zero, in which case
+     the data follows the headers and any palette */
+  offset = bmfh.bfOffBits;
+  if(offset < BMP_FILEHEADER_SIZE + BMP_INFOHEADER_SIZE) {
+    offset = BMP_FILEHEADER_SIZE + bmih.biSize;
+    if(bmih.biClrUsed)
+      offset += 4*bmih.biClrUsed;
+    else if(n == 1)
+      offset += 4*256;
+  }
+
+  /* Greyscale is 8 or 16-bit. For colour, just use the first channel.
+     8-bit images are assumed to have a greyscale palette */
+  type = CONVERT_UINT8;
+  stride = n;
+  factor = 255.0;
+  if(n == 2) {
+    type = CONVERT_UINT16;
+    stride = 1;
+    factor = 65535.0;
+  }
+
+  /* Scan lines always end on 32-bit boundaries */
+  pitch = (width * n + 3) & ~3;
+
+  /* Get the region to convert */
+  if(read_region(width, height, &x0, &y0, &w, &h)) {
+    fclose(bitmap_file);
+    return(IO_ERROR_REGION);
+  }
+
+  /* Check/allocate the frame */
+  if(allocate_output(w, h, frame)) {
+    fclose(bitmap_file);
+    return(IO_ERROR_SIZE);
+  }
+
+  /* Skip rows before the region. Normally rows are stored bottom to top */
+  skip = topdown ? y0 : height - y0 - h;
+  if(fseek(bitmap_file, offset + ((long) skip)*pitch, SEEK_SET)) {
+    fclose(bitmap_file);
     return(IO_ERROR_FORMAT);
   }
 
-  /* Check if the frame has been allocated */
-  if(frame->allocated) {
-    /* Data already allocated - check same size */
-    if((frame->width != bmih.biWidth) || (frame->height != bmih.biHeight)) {
-      return(IO_ERROR_SIZE);
-    }
-    
-  }else {
-    /* Allocate memory */
-    frame->data = (unsigned char**) malloc(sizeof(char*)*bmih.biHeight);
-    for(i=0;i!=bmih.biHeight;i++)
-      frame->data[i] = (unsigned char*) malloc(n*sizeof(unsigned char)*bmih.biWidth);
-    frame->width = bmih.biWidth;
-    frame->height = bmih.biHeight;
-    frame->allocated =  1;
-  }
-
-  /* Read n bytes per pixel */
-  for(j=0;j!=frame->height;j++) {
-    for(i=0;i!=frame->width;i++) {
-      if(fread(&(frame->data[frame->height-1-j][n*i]), 
-	       1, n, bitmap_file) != n) {
-	/* Premature end of file */
-	fclose(bitmap_file);
-	return(IO_ERROR_FORMAT);
-      }
+  /* Read in bands of rows, converting straight into the frame */
+  band = (unsigned char*) malloc(pitch*CONVERT_TILE);
+
+  for(row=0;row<h;row+=nband) {
+    nband = h - row;
+    if(nband > CONVERT_TILE)
+      nband = CONVERT_TILE;
+    if(fread(band, pitch, nband, bitmap_file) != nband) {
+      /* Premature end of file */
+      free(band);
+      fclose(bitmap_file);
+      return(IO_ERROR_FORMAT);
     }
-    /* Scan lines always end on 32-bit boundaries */
-    if((frame->width * n) % 4 != 0) {
-      /* Needs extra padding */
-      fread(&padding, 4 - ((frame->width * n) % 4), 1, bitmap_file);
+    if(topdown) {
+      convert_rows(band + x0*n, pitch, type, stride,
+		   nband, w, frame, row, factor);
+    }else {
+      /* Last row read is the top of this band. Fills frame rows from
+	 the bottom of the region upwards */
+      convert_rows(band + (nband-1)*pitch + x0*n, -pitch, type, stride,
+		   nband, w, frame, h - row - nband, factor);
     }
   }
 
-  frame->channels = bmih.biPlanes;
-
+  free(band);
   fclose(bitmap_file);
   return(0);
 }
 
-int write_bmp(char *filename, TFrame *frame)
+/* Writes out 8 or 16-bit greyscale, or 24-bit colour. The whole file is
+   assembled in memory and written with a single fwrite.
+   16-bit greyscale is stored as plain little-endian values, as read back
+   by read_bmp. There is no standard 16-bit greyscale BMP so other
+   programs will treat these as 5-5-5 colour. */
+int write_bmp(char *filename, TRawFrame *frame)
 {
-  int i, j, k, nbyte, padding;
+  int i, j, nbyte, pitch, offset;
+  unsigned char *buffer, *out, *in;
   BITMAPFILEHEADER        bmfh;
   BITMAPINFOHEADER        bmih;
   FILE *bitmap_file;
-  unsigned char pixel[3];
-  
-  padding = 0;
+  size_t size;
 
-  if((bitmap_file=fopen(filename,"wb"))==NULL) {
-    return(IO_ERROR_OPEN);
-  }
+  if((frame->bpp != 8) && !((frame->bpp == 16) && (frame->channels == 1)))
+    return(IO_ERROR_FORMAT);
+
+  nbyte = frame->channels * frame->bpp / 8; /* Bytes per pixel */
+
+  /* Scan lines always end on 32-bit boundaries */
+  pitch = (frame->width * nbyte + 3) & ~3;
+
+  offset = BMP_FILEHEADER_SIZE + BMP_INFOHEADER_SIZE;
+  if(nbyte == 1)
+    offset += 4*256; /* Greyscale palette */
+
+  size = offset + ((size_t) pitch)*frame->height;
 
   /* Set the bitmap file header */
-  bmfh.bfType = 'M';
-  bmfh.bfType = (bmfh.bfType << 8) + 'B';
-  
-  bmfh.bfSize = 0;
+  bmfh.bfType = 0x4D42; /* "BM" */
+  bmfh.bfSize = size;
   bmfh.bfReserved1 = 0;
-  bmfh.bfReserved2 = 54;
-  bmfh.bfOffBits = 0;
-  
+  bmfh.bfReserved2 = 0;
+  bmfh.bfOffBits = offset;
 
   /* Set the information header */
-  bmih.biSize = 40;
+  bmih.biSize = BMP_INFOHEADER_SIZE;
   bmih.biWidth = frame->width;
   bmih.biHeight = frame->height;
   bmih.biPlanes = 1;
-  bmih.biBitCount = 24;
+  bmih.biBitCount = 8*nbyte;
   bmih.biCompression = 0;
-  bmih.biSizeImage = frame->width * frame->height * 3;
+  bmih.biSizeImage = size - offset;
   bmih.biXPelsPerMeter = 0;
   bmih.biYPelsPerMeter = 0;
-  bmih.biClrUsed = 0;
+  bmih.biClrUsed = (nbyte == 1) ? 256 : 0;
   bmih.biClrImportant = 0;
-  
-  /* Write the headers */
-  if(fwrite(&bmfh, 14, 1, bitmap_file) != 1) {
-    fclose(bitmap_file);
-    return(IO_ERROR_WRITE);
-  }
 
-  if(fwrite(&bmih, 40, 1, bitmap_file) != 1) {
-    fclose(bitmap_file);
-    return(IO_ERROR_WRITE);
+  if((buffer = (unsigned char*) calloc(size, 1)) == NULL)
+    return(IO_ERROR_OTHER);
+
+  store_headers(buffer, &bmfh, &bmih);
+
+  if(nbyte == 1) {
+    out = buffer + BMP_FILEHEADER_SIZE + BMP_INFOHEADER_SIZE;
+    for(i=0;i<256;i++) {
+      out[4*i] = out[4*i+1] = out[4*i+2] = i;
+    }
   }
 
-  nbyte = 3;
-  /* Write the data */
-
-  for(j=0;j!=frame->height;j++) {
-    for(i=0;i!=frame->width;i++) {
-      if(frame->data[i][j] > 255.5)
-	frame->data[i][j] = 255.5;
-      pixel[0] = (unsigned char) frame->data[i][frame->height-1-j];
-      for(k=1;k<nbyte;k++)
-	pixel[k] = pixel[0];
-      
-      if(fwrite(pixel, 1, nbyte, bitmap_file) != nbyte) {
-	fclose(bitmap_file);
-	return(IO_ERROR_WRITE);
+  /* Copy in the rows, bottom to top. Padding is left zero */
+  for(j=0;j<frame->height;j++) {
+    in = frame->data[frame->height-1-j];
+    out = buffer + offset + ((size_t) j)*pitch;
+    switch(nbyte) {
+    case 2: {
+      /* Raw rows are big-endian, BMP is little-endian */
+      for(i=0;i<frame->width;i++) {
+	out[2*i]   = in[2*i+1];
+	out[2*i+1] = in[2*i];
       }
+      break;
     }
-    /* Scan lines always end on 32-bit boundaries */
-    if((frame->width * nbyte) % 4 != 0) {
-      /* Needs extra padding */
-      fwrite(&padding, 4 - ((frame->width * nbyte) % 4), 1, bitmap_file);
+    case 3: {
+      /* RGB -> BGR */
+      for(i=0;i<frame->width;i++) {
+	out[3*i]   = in[3*i+2];
+	out[3*i+1] = in[3*i+1];
+	out[3*i+2] = in[3*i];
+      }
+      break;
+    }
+    default:
+      memcpy(out, in, frame->width);
     }
   }
-  fclose(bitmap_file);
-  fflush(stdout);
+
+  if((bitmap_file=fopen(filename,"wb"))==NULL) {
+    free(buffer);
+    return(IO_ERROR_OPEN);
+  }
+
+  if(fwrite(buffer, size, 1, bitmap_file) != 1) {
+    free(buffer);
+    fclose(bitmap_file);
+    return(IO_ERROR_WRITE);
+  }
+  free(buffer);
+
+  if(fclose(bitmap_file))
+    return(IO_ERROR_WRITE);
 
   return(0);
 }
@@ -1,27 +1,32 @@
-
 #ifndef __READ_BMP_H__
 #define __READ_BMP_H__
 
+/* Headers are stored little-endian and packed, so they are read and
+   written a byte at a time (see io_bmp.c) rather than as structs */
+
+#define BMP_FILEHEADER_SIZE 14
+#define BMP_INFOHEADER_SIZE 40
+
 typedef struct {                    // Offset   Size
-  short   bfType;                 //      0      2
-  long    bfSize;                 //      2      4
-  short   bfReserved1;            //      6      2
-  short   bfReserved2;            //      8      2
-  long    bfOffBits;              //     10      4
+  unsigned short bfType;            //      0      2
+  unsigned int   bfSize;            //      2      4
+  unsigned short bfReserved1;       //      6      2
+  unsigned short bfReserved2;       //      8      2
+  unsigned int   bfOffBits;         //     10      4
 } BITMAPFILEHEADER;                 // Total size: 14
 
-typedef struct {  // Offset   Size
-    long    biSize;                 //      0      4
-    long    biWidth;                //      4      4
-    long    biHeight;               //      8      4
-    short   biPlanes;               //     12      2
-    short   biBitCount;             //     14      2
-    long    biCompression;          //     16      4
-    long    biSizeImage;            //     20      4
-    long    biXPelsPerMeter;        //     24      4
-    long    biYPelsPerMeter;        //     28      4
-    long    biClrUsed;              //     32      4
-    long    biClrImportant;         //     36      4
+typedef struct {                    // Offset   Size
+  unsigned int   biSize;            //      0      4
+  int            biWidth;           //      4      4
+  int            biHeight;          //      8      4  (< 0 if top-down)
+  unsigned short biPlanes;          //     12      2
+  unsigned short biBitCount;        //     14      2
+  unsigned int   biCompression;     //     16      4
+  unsigned int   biSizeImage;       //     20      4
+  int            biXPelsPerMeter;   //     24      4
+  int            biYPelsPerMeter;   //     28      4
+  unsigned int   biClrUsed;         //     32      4
+  unsigned int   biClrImportant;    //     36      4
 } BITMAPINFOHEADER;                 // Total size: 40
 
 #endif /* __READ_BMP_H__ */
@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "io_ipx.h"
 #include "spiceweasel.h"
@@ -15,6 +17,13 @@
 #include "openjpeg.h"
 #endif
 
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* Compression level for the ZSTD codec. Low levels are fastest */
+#define IPX_ZSTD_LEVEL 1
+
 /*********************** IPX HEADER ROUTINES *************************/
 
 /* Callback functions */
@@ -71,48 +80,309 @@ int ipx_read_header(FILE *fd, IPX_header *header)
 
 int ipx_write_header(FILE *fd, IPX_header *header)
 {
+  int err = 0;
+
   header->size = 286;
 
-  fwrite(&(header->id), 1, 8, fd);
-  fwrite(&(header->size), IPX_UINT, 1, fd);
-  fwrite(&(header->codec), 1, 8, fd);
-  fwrite(&(header->date_time), 1, 20, fd);
-  fwrite(&(header->shot), IPX_UINT, 1, fd);
-  fwrite(&(header->trigger), IPX_FLOAT, 1, fd);
-  fwrite(&(header->lens), 1, 24, fd);
-  fwrite(&(header->filter), 1, 24, fd);
-  fwrite(&(header->view), 1, 64, fd);
-  fwrite(&(header->numFrames), IPX_UINT, 1, fd);
-  fwrite(&(header->camera), 1, 64, fd);
-  fwrite(&(header->width), IPX_SHORT, 1, fd);
-  fwrite(&(header->height), IPX_SHORT, 1, fd);
-  fwrite(&(header->depth), IPX_SHORT, 1, fd);
-  fwrite(&(header->orient), IPX_UINT, 1, fd);
-  fwrite(&(header->taps), IPX_SHORT, 1, fd);
-  fwrite(&(header->color), IPX_SHORT, 1, fd);
-  fwrite(&(header->hBin), IPX_SHORT, 1, fd);
-  fwrite(&(header->left), IPX_SHORT, 1, fd);
-  fwrite(&(header->right), IPX_SHORT, 1, fd);
-  fwrite(&(header->vBin), IPX_SHORT, 1, fd);
-  fwrite(&(header->top), IPX_SHORT, 1, fd);
-  fwrite(&(header->bottom), IPX_SHORT, 1, fd);
-  fwrite(header->offset, IPX_SHORT, 2, fd);
-  fwrite(header->gain, IPX_FLOAT, 2, fd);
-  fwrite(&(header->preExp), IPX_UINT, 1, fd);
-  fwrite(&(header->exposure), IPX_UINT, 1, fd);
-  fwrite(&(header->strobe), IPX_UINT, 1, fd);
-  fwrite(&(header->board_temp), IPX_FLOAT, 1, fd);
-  fwrite(&(header->ccd_temp), IPX_FLOAT, 1, fd);
+  err |= (fwrite(&(header->id), 1, 8, fd) != 8);
+  err |= (fwrite(&(header->size), IPX_UINT, 1, fd) != 1);
+  err |= (fwrite(&(header->codec), 1, 8, fd) != 8);
+  err |= (fwrite(&(header->date_time), 1, 20, fd) != 20);
+  err |= (fwrite(&(header->shot), IPX_UINT, 1, fd) != 1);
+  err |= (fwrite(&(header->trigger), IPX_FLOAT, 1, fd) != 1);
+  err |= (fwrite(&(header->lens), 1, 24, fd) != 24);
+  err |= (fwrite(&(header->filter), 1, 24, fd) != 24);
+  err |= (fwrite(&(header->view), 1, 64, fd) != 64);
+  err |= (fwrite(&(header->numFrames), IPX_UINT, 1, fd) != 1);
+  err |= (fwrite(&(header->camera), 1, 64, fd) != 64);
+  err |= (fwrite(&(header->width), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->height), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->depth), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->orient), IPX_UINT, 1, fd) != 1);
+  err |= (fwrite(&(header->taps), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->color), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->hBin), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->left), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->right), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->vBin), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->top), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(&(header->bottom), IPX_SHORT, 1, fd) != 1);
+  err |= (fwrite(header->offset, IPX_SHORT, 2, fd) != 2);
+  err |= (fwrite(header->gain, IPX_FLOAT, 2, fd) != 2);
+  err |= (fwrite(&(header->preExp), IPX_UINT, 1, fd) != 1);
+  err |= (fwrite(&(header->exposure), IPX_UINT, 1, fd) != 1);
+  err |= (fwrite(&(header->strobe), IPX_UINT, 1, fd) != 1);
+  err |= (fwrite(&(header->board_temp), IPX_FLOAT, 1, fd) != 1);
+  err |= (fwrite(&(header->ccd_temp), IPX_FLOAT, 1, fd) != 1);
+
+  if(err)
+    return(1);
+  return(0);
+}
+
+/*********************** FAST LOSSLESS CODECS ************************
+ * RAW and ZSTD store pixels in rows, one byte per pixel if the depth
+ * is 8 bits or less, otherwise two bytes little-endian. ZSTD first
+ * replaces each pixel with the difference from the one to its left.
+ *********************************************************************/
+
+/* Get codec ID from a name. Returns IPX_CODEC_UNKNOWN if not supported */
+int IPX_codec(char *name)
+{
+  if(strncasecmp(name, "JP2", 8) == 0)
+    return(IPX_CODEC_JP2);
+  if(strncasecmp(name, "RAW", 8) == 0)
+    return(IPX_CODEC_RAW);
+#ifdef HAVE_LIBZSTD
+  if(strncasecmp(name, "ZSTD", 8) == 0)
+    return(IPX_CODEC_ZSTD);
+#endif
+  return(IPX_CODEC_UNKNOWN);
+}
+
+static int ipx_little_endian()
+{
+  short one = 1;
+  return(*((char*) &one));
+}
+
+/* Pack a frame into RAW or ZSTD format. Sets pointer to the data and length */
+static int ipx_pack_frame(TFrame *frame, IPX_status *status, unsigned char **out, uint *length)
+{
+  static unsigned char *raw = NULL;
+  static size_t raw_max = 0;
+#ifdef HAVE_LIBZSTD
+  static unsigned char *packed = NULL;
+  static size_t packed_max = 0;
+  size_t n;
+#endif
+  int nbytes, width, height;
+  int i, j, v, last, max;
+  float factor, f;
+  unsigned char *row;
+  size_t size;
+
+  width = frame->width;
+  height = frame->height;
+
+  nbytes = 1;
+  if(status->header.depth > 8)
+    nbytes = 2;
+  size = ((size_t) width)*height*nbytes;
+
+  if(raw_max < size) {
+    raw = (unsigned char*) realloc(raw, size);
+    raw_max = size;
+  }
+
+  max = (1 << status->header.depth) - 1;
+  factor = (float) max;
+
+  /* Transpose columns into rows, converting to integers */
+  for(j=0;j<height;j++) {
+    row = raw + ((size_t) j)*width*nbytes;
+    last = 0;
+    for(i=0;i<width;i++) {
+      /* Round to the nearest value, so reading back gives the same frame */
+      f = factor * frame->data[i][j];
+      if(f <= 0.0)
+	v = 0;
+      else if(f >= max)
+	v = max;
+      else
+	v = (int) (f + 0.5);
+      if(status->codec == IPX_CODEC_ZSTD) {
+	/* Store difference from previous pixel */
+	v -= last;
+	last += v;
+      }
+      if(nbytes == 1) {
+	row[i] = (unsigned char) v;
+      }else {
+	row[2*i]   = (unsigned char) (v & 0xFF);
+	row[2*i+1] = (unsigned char) ((v >> 8) & 0xFF);
+      }
+    }
+  }
+
+  if(status->codec == IPX_CODEC_RAW) {
+    *out = raw;
+    *length = size;
+    return(0);
+  }
+
+#ifdef HAVE_LIBZSTD
+  if(status->codec == IPX_CODEC_ZSTD) {
+    n = ZSTD_compressBound(size);
+    if(packed_max < n) {
+      packed = (unsigned char*) realloc(packed, n);
+      packed_max = n;
+    }
+    n = ZSTD_compress(packed, packed_max, raw, size, IPX_ZSTD_LEVEL);
+    if(ZSTD_isError(n)) {
+      printf("Error: zstd compression failed: %s\n", ZSTD_getErrorName(n));
+      return(1);
+    }
+    *out = packed;
+    *length = n;
+    return(0);
+  }
+#endif
+  return(1);
+}
 
+/* Unpack RAW or ZSTD data into a frame, converting only the region of interest */
+static int ipx_unpack_frame(unsigned char *data, uint size, TFrame *frame, IPX_status *status)
+{
+  static unsigned char *raw = NULL;
+  static size_t raw_max = 0;
+  int nbytes, width, height;
+  int x0, y0, w, h;
+  int i, j;
+  unsigned short *s16, v;
+  unsigned char *row, *src;
+  size_t rawsize;
+
+  width = status->header.width;
+  height = status->header.height;
+
+  nbytes = 1;
+  if(status->header.depth > 8)
+    nbytes = 2;
+  rawsize = ((size_t) width)*height*nbytes;
+
+  if(read_region(width, height, &x0, &y0, &w, &h))
+    return(4);
+
+  if(allocate_output(w, h, frame))
+    return(4);
+
+  if(status->codec == IPX_CODEC_RAW) {
+    if(size != rawsize)
+      return(3);
+    if((nbytes == 1) || ipx_little_endian()) {
+      /* Can convert straight from the file data */
+      src = data;
+    }else {
+      if(raw_max < rawsize) {
+	raw = (unsigned char*) realloc(raw, rawsize);
+	raw_max = rawsize;
+      }
+      s16 = (unsigned short*) raw;
+      for(i=0;i<width*height;i++)
+	s16[i] = data[2*i] | (data[2*i+1] << 8);
+      src = raw;
+    }
+  }else {
+#ifdef HAVE_LIBZSTD
+    if(raw_max < rawsize) {
+      raw = (unsigned char*) realloc(raw, rawsize);
+      raw_max = rawsize;
+    }
+    if(ZSTD_decompress(raw, rawsize, data, size) != rawsize)
+      return(3);
+    src = raw;
+
+    /* Undo the differences, only for rows in the region */
+    for(j=y0;j<y0+h;j++) {
+      row = raw + ((size_t) j)*width*nbytes;
+      if(nbytes == 1) {
+	for(i=1;i<x0+w;i++)
+	  row[i] += row[i-1];
+      }else {
+	s16 = (unsigned short*) row;
+	v = 0;
+	for(i=0;i<x0+w;i++) {
+	  v += row[2*i] | (row[2*i+1] << 8);
+	  s16[i] = v;
+	}
+      }
+    }
+#else
+    return(3);
+#endif
+  }
+
+  convert_rows(src + (((size_t) y0)*width + x0)*nbytes, ((long) width)*nbytes,
+	       (nbytes == 1) ? CONVERT_UINT8 : CONVERT_UINT16, 1,
+	       h, w, frame, 0, (float) ((1 << status->header.depth) - 1));
   return(0);
 }
 
 /*********************** IPX READING ROUTINES ************************/
 
+/* Read the frame headers after the first n already known. The header
+   gives the number of frames; these must all be complete */
+static int ipx_read_index(IPX_status *status, int n)
+{
+  int i;
+  long offset;
+
+  status->frames = (IPX_frame*) realloc(status->frames,
+					sizeof(IPX_frame)*(status->header.numFrames + 1));
+
+  offset = status->header.size;
+  if(n > 0)
+    offset = status->frames[n-1].offset + status->frames[n-1].size;
+  for(i=n;i<status->header.numFrames;i++) {
+    if(fseek(status->fd, offset, SEEK_SET)) {
+      /* Error reading */
+      return(1);
+    }
+    status->frames[i].offset = offset;
+    if((fread(&(status->frames[i].size), IPX_UINT, 1, status->fd) != 1) ||
+       (fread(&(status->frames[i].time), IPX_DOUBLE, 1, status->fd) != 1))
+      return(1);
+    offset += status->frames[i].size;
+  }
+  return(0);
+}
+
+/* Check for frames added since the file was opened. The writer
+   updates the header only once the frames it counts are complete */
+static int ipx_refresh(IPX_status *status)
+{
+  IPX_header header;
+  int n;
+
+  /* Drop buffered data, which may be out of date */
+  fflush(status->fd);
+  if(fseek(status->fd, 0L, SEEK_SET) || ipx_read_header(status->fd, &header))
+    return(1);
+  if(header.numFrames <= status->header.numFrames)
+    return(0);
+
+  n = status->header.numFrames;
+  memcpy(&(status->header), &header, sizeof(IPX_header));
+  if(ipx_read_index(status, n)) {
+    status->header.numFrames = n;
+    return(1);
+  }
+  return(0);
+}
+
+/* Make sure frame fnr is in the file, waiting for it if following a
+   file being written. Returns non-zero if it isn't there */
+static int ipx_wait_frame(int fnr, IPX_status *status)
+{
+  double waited;
+
+  waited = 0.0;
+  while(fnr >= status->header.numFrames) {
+    if(waited >= status->follow)
+      return(1);
+    usleep(100000);
+    waited += 0.1;
+    if(ipx_refresh(status))
+      return(1);
+  }
+  return(0);
+}
+
 /* Open an IPX file for reading */
 int IPX_read_open(char *filename, IPX_status *status)
 {
-  int i, offset;
+  status->frames = NULL;
 
   /* Open IPX file */
   if((status->fd = fopen(filename, "rb")) == (FILE*) NULL) {
@@ -127,35 +397,69 @@ int IPX_read_open(char *filename, IPX_status *status)
     return(2);
   }
 
-  /* Allocate memory for list of frames */
-  status->frames = (IPX_frame*) malloc(sizeof(IPX_frame)*status->header.numFrames);
-  
-  /* Read frame headers */
-  offset = status->header.size;
-  for(i=0;i<status->header.numFrames;i++) {
-    if(fseek(status->fd, offset, SEEK_SET)) {
-      /* Error reading */
+  /* Get the codec. Anything not recognised is assumed to be JPEG 2000 */
+  status->codec = IPX_CODEC_JP2;
+  if((strncasecmp(status->header.codec, "RAW", 8) == 0) ||
+     (strncasecmp(status->header.codec, "ZSTD", 8) == 0)) {
+    status->codec = IPX_codec(status->header.codec);
+    if(status->codec == IPX_CODEC_UNKNOWN) {
+      printf("Error: IPX codec %s not supported by this build\n", status->header.codec);
       fclose(status->fd);
-      free(status->frames);
       status->header.numFrames = 0;
       return(2);
     }
-    status->frames[i].offset = offset;
-    fread(&(status->frames[i].size), IPX_UINT, 1, status->fd);
-    fread(&(status->frames[i].time), IPX_DOUBLE, 1, status->fd);
-    offset += status->frames[i].size;
   }
+
+  /* Read frame headers */
+  if(ipx_read_index(status, 0)) {
+    fclose(status->fd);
+    free(status->frames);
+    status->header.numFrames = 0;
+    return(2);
+  }
+
+  /* A file still being written may not have any frames yet */
+  if((status->follow > 0.0) && ipx_wait_frame(0, status)) {
+    fclose(status->fd);
+    free(status->frames);
+    status->header.numFrames = 0;
+    return(2);
+  }
+
+  /* Frames are usually read in order */
+  posix_fadvise(fileno(status->fd), 0, 0, POSIX_FADV_SEQUENTIAL);
+
   /* Finished! */
   return(0);
 }
 
+/* Start reading the data of a frame in the background.
+   Returns non-zero if it can't be queued yet */
+int IPX_prefetch(int fnr, IPX_status *status)
+{
+  if((fnr < 0) || (fnr >= status->header.numFrames))
+    return(0);
+  return(prefetch_range(fnr, fileno(status->fd),
+			status->frames[fnr].offset + IPX_UINT + IPX_DOUBLE,
+			status->frames[fnr].size - IPX_UINT - IPX_DOUBLE));
+}
+
+/* Check whether there are any frames after fnr which will be read.
+   When following a file being written, waits to find out */
+static int ipx_last_frame(int fnr, IPX_status *status)
+{
+  if(status->follow <= 0.0)
+    return(fnr == (status->header.numFrames-1));
+  return(ipx_wait_frame(fnr + ((status->step > 0) ? status->step : 1), status));
+}
+
 /* Read a frame from an IPX file */
 int IPX_read_frame(int fnr, TFrame *frame, IPX_status *status)
 {
-  int offset, size;
-  int i, j, p;
-  static unsigned int data_max = 0;
-  static unsigned char *data;
+  int offset, size, errcode;
+  int x0, y0, w, h;
+  static TBuffer buffer = {NULL, 0};
+  unsigned char *data;
   float factor;
 
   /* JPEG 2000 variables */
@@ -166,30 +470,41 @@ int IPX_read_frame(int fnr, TFrame *frame, IPX_status *status)
   opj_cio_t *cio = NULL;
   opj_image_t *image = NULL;
 
-  if(fnr >= status->header.numFrames) {
+  if(ipx_wait_frame(fnr, status)) {
     return(1);
   }
   
   offset = status->frames[fnr].offset + IPX_UINT + IPX_DOUBLE; //sizeof(uint) + sizeof(double);
-  if(fseek(status->fd, offset, SEEK_SET)) {
-    return(2);
-  }
-
   size = status->frames[fnr].size - IPX_UINT - IPX_DOUBLE; //sizeof(uint) - sizeof(double);
-  
-  /* Allocate memory */
-  if(data_max < size) {
-    if(data_max == 0) {
-      data = (unsigned char*) malloc(size);
-    }else {
-      data = (unsigned char*) realloc(data, size);
+
+  /* Data may have been read in the background already. If that
+     failed, try again here so the error (if any) is the real one */
+  errcode = prefetch_take(fnr, &buffer);
+  data = (unsigned char*) buffer.data;
+
+  if(errcode != 0) {
+    if(fseek(status->fd, offset, SEEK_SET)) {
+      return(2);
+    }
+
+    /* Allocate memory */
+    data = (unsigned char*) reserve_buffer(&buffer, size);
+
+    /* Read data */
+    if(fread(data, size, 1, status->fd) != 1) {
+      return(2);
     }
-    data_max = size;
   }
-  
-  /* Read data */
-  if(fread(data, size, 1, status->fd) != 1) {
-    return(2);
+
+  if(status->codec != IPX_CODEC_JP2) {
+    /* Fast lossless codecs */
+    if((errcode = ipx_unpack_frame(data, size, frame, status)))
+      return(errcode);
+
+    if(ipx_last_frame(fnr, status))
+      frame->last = 1;
+    frame->time = status->frames[fnr].time;
+    return(0);
   }
   
   /* Decode JP2 image */
@@ -228,26 +543,29 @@ int IPX_read_frame(int fnr, TFrame *frame, IPX_status *status)
   /* close the byte stream */
   opj_cio_close(cio);
 
-  /* Copy image into TRawFrame structure */
+  /* Get the region of interest. OpenJPEG 1.x always decodes the
+     whole codestream, so only the region is converted to floats */
+  if(read_region(status->header.width, status->header.height, &x0, &y0, &w, &h)) {
+    opj_image_destroy(image);
+    return(4);
+  }
 
   /* Check frame data is allocated. If not, allocate it */
-  if(allocate_output(status->header.width, status->header.height, frame)) {
+  if(allocate_output(w, h, frame)) {
     /* Frame is wrong size */
+    opj_image_destroy(image);
     return(4);
   }
   
   factor = (float) ((1 << image->comps[0].prec) - 1);
   //factor = (float) ((1 << 16) - 1);
 
-  p = 0;
-  for(j=0;j<status->header.height;j++) {
-    for(i=0;i<status->header.width;i++) {
-      frame->data[i][j] = ((float) image->comps[0].data[p]) / factor;
-      p++;
-    }
-  }
+  /* Convert and transpose straight from the decoded component */
+  convert_rows(image->comps[0].data + y0*status->header.width + x0,
+	       sizeof(int)*status->header.width, CONVERT_INT, 1,
+	       h, w, frame, 0, factor);
 
-  if(fnr == (status->header.numFrames-1)) {
+  if(ipx_last_frame(fnr, status)) {
     /* This is the last frame */
     frame->last = 1;
   }
@@ -260,18 +578,149 @@ int IPX_read_frame(int fnr, TFrame *frame, IPX_status *status)
   return(0);
 }
 
+/* Binary search of frame times. Returns the index of the first frame with
+   time >= time, or > time if after is set. Assumes times are increasing */
+int IPX_find_time(IPX_status *status, double time, int after)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = status->header.numFrames;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if((status->frames[mid].time < time) || 
+       (after && (status->frames[mid].time == time))) {
+      lo = mid + 1;
+    }else {
+      hi = mid;
+    }
+  }
+  return(lo);
+}
+
 /* Close an IPX file opened for reading */
 int IPX_read_close(IPX_status *status)
 {
   fclose(status->fd);
 
-  if(status->header.numFrames > 0)
-    free(status->frames);
+  free(status->frames);
+  status->frames = NULL;
   status->header.numFrames = 0;
   
   return(0);
 }
 
+/*********************** JPEG 2000 OPTIONS ***************************
+ * Defaults are lossless, tuned for small greyscale fast-camera frames:
+ * 64x64 code-blocks (the largest allowed, so fewest blocks to code)
+ * and fewer resolution levels than OpenJPEG's default of 6.
+ *********************************************************************/
+
+static char *jp2_orders[] = {"LRCP", "RLCP", "RPCL", "PCRL", "CPRL"};
+
+void IPX_jp2_defaults(IPX_jp2_options *options)
+{
+  options->rate = 0.0;
+  options->psnr = 0.0;
+  options->levels = 4;
+  options->cblockw = 64;
+  options->cblockh = 64;
+  options->tilew = 0;
+  options->tileh = 0;
+  options->order = LRCP;
+}
+
+/* Checks a code-block dimension is a power of 2 between 4 and 1024 */
+static int jp2_check_cblock(int n)
+{
+  if((n < 4) || (n > 1024))
+    return(1);
+  return((n & (n-1)) != 0);
+}
+
+/* Set a JPEG 2000 option from its name and value. Returns non-zero on error */
+int IPX_jp2_set(IPX_jp2_options *options, char *name, char *value)
+{
+  int i;
+
+  if(strcasecmp(name, "rate") == 0) {
+    if((sscanf(value, "%f", &(options->rate)) != 1) || (options->rate < 0.0))
+      return(1);
+  }else if(strcasecmp(name, "psnr") == 0) {
+    if((sscanf(value, "%f", &(options->psnr)) != 1) || (options->psnr < 0.0))
+      return(1);
+  }else if(strcasecmp(name, "levels") == 0) {
+    if((sscanf(value, "%d", &(options->levels)) != 1) || 
+       (options->levels < 1) || (options->levels > 32))
+      return(1);
+  }else if(strcasecmp(name, "cblk") == 0) {
+    if(sscanf(value, "%dx%d", &(options->cblockw), &(options->cblockh)) != 2)
+      return(1);
+    if(jp2_check_cblock(options->cblockw) || jp2_check_cblock(options->cblockh) ||
+       (options->cblockw * options->cblockh > 4096))
+      return(1);
+  }else if(strcasecmp(name, "tile") == 0) {
+    if((sscanf(value, "%dx%d", &(options->tilew), &(options->tileh)) != 2) ||
+       (options->tilew < 1) || (options->tileh < 1))
+      return(1);
+  }else if(strcasecmp(name, "order") == 0) {
+    options->order = -1;
+    for(i=0;i<5;i++) {
+      if(strcasecmp(value, jp2_orders[i]) == 0)
+	options->order = i;
+    }
+    if(options->order < 0)
+      return(1);
+  }else {
+    return(1);
+  }
+  return(0);
+}
+
+/* Set OpenJPEG encoder parameters from the options */
+static void jp2_set_parameters(IPX_jp2_options *options, int width, int height,
+			       opj_cparameters_t *parameters)
+{
+  int size;
+
+  /* One quality layer */
+  parameters->tcp_numlayers = 1;
+  if(options->psnr > 0.0) {
+    /* Lossy, fixed quality */
+    parameters->tcp_distoratio[0] = options->psnr;
+    parameters->cp_fixed_quality = 1;
+    parameters->irreversible = 1;
+  }else if(options->rate > 1.0) {
+    /* Lossy, fixed compression ratio */
+    parameters->tcp_rates[0] = options->rate;
+    parameters->cp_disto_alloc = 1;
+    parameters->irreversible = 1;
+  }else {
+    /* Lossless */
+    parameters->tcp_rates[0] = 0;
+    parameters->cp_disto_alloc = 1;
+  }
+
+  /* Can't have more levels than the image (or tile) can be halved */
+  size = (width < height) ? width : height;
+  if(options->tilew > 0) {
+    parameters->tile_size_on = 1;
+    parameters->cp_tdx = options->tilew;
+    parameters->cp_tdy = options->tileh;
+    if(options->tilew < size)
+      size = options->tilew;
+    if(options->tileh < size)
+      size = options->tileh;
+  }
+  parameters->numresolution = options->levels;
+  while((parameters->numresolution > 1) && ((1 << (parameters->numresolution-1)) > size))
+    parameters->numresolution--;
+
+  parameters->cblockw_init = options->cblockw;
+  parameters->cblockh_init = options->cblockh;
+  parameters->prog_order = (OPJ_PROG_ORDER) options->order;
+}
+
 /*********************** IPX WRITING ROUTINES ************************
  * When writing, header fields should already be set except:
  * - id
@@ -306,8 +755,56 @@ void info_callback(const char *msg, void *client_data) {
 	//fprintf(stream, "[INFO] %s", msg);
 }
 
+/* Update the header so that readers (and the file left after a crash)
+   see all frames written so far. The frame data is flushed to disk
+   before the header which counts it, and the header goes in a single
+   write, so the file on disk is always complete up to its frame count */
+static int ipx_commit(IPX_status *status)
+{
+  long end;
+  int err;
+
+  /* Set right and bottom so consistent with width and height. These
+     are in sensor pixels, so binned pixels count several times */
+  status->header.right = status->header.left +
+    status->header.width*((status->header.hBin > 1) ? status->header.hBin : 1) - 1;
+  status->header.bottom = status->header.top +
+    status->header.height*((status->header.vBin > 1) ? status->header.vBin : 1) - 1;
+
+  if(fflush(status->fd) || fdatasync(fileno(status->fd)))
+    return(IO_ERROR_WRITE);
+  end = ftell(status->fd);
+
+  /* Go to start of file */
+  if(fseek(status->fd, 0L, SEEK_SET)) {
+    return(IO_ERROR_WRITE);
+  }
+
+  /* Write proper header. Even if this fails (e.g. ENOSPC), go back to
+     the end so that later frames don't overwrite the header */
+  err = ipx_write_header(status->fd, &(status->header)) ||
+    fflush(status->fd) || fdatasync(fileno(status->fd));
+
+  /* Back to the end for the next frame */
+  if(fseek(status->fd, end, SEEK_SET) || err) {
+    return(IO_ERROR_WRITE);
+  }
+  status->uncommitted = 0;
+  return(0);
+}
+
+/* A frame has been added */
+static int ipx_frame_added(IPX_status *status)
+{
+  status->header.numFrames++;
+  status->uncommitted++;
+  if((status->commit > 0) && (status->uncommitted >= status->commit))
+    return(ipx_commit(status));
+  return(0);
+}
+
 /* Open an IPX file for writing (overwrite) */
-int IPX_write_open(char *filename, int precision, IPX_status *status)
+int IPX_write_open(char *filename, int precision, int codec, IPX_status *status)
 {
   if((status->fd = fopen(filename, "wb")) == (FILE*) NULL) {
     return(1);
@@ -319,9 +816,26 @@ int IPX_write_open(char *filename, int precision, IPX_status *status)
   status->header.width = 0;
   status->header.height = 0;
   status->header.depth = precision;
+  status->uncommitted = 0;
 
   strcpy(status->header.id, "IPX 01");
-  strcpy(status->header.codec, "JP2");
+
+  memset(status->header.codec, 0, 8);
+  switch(codec) {
+  case IPX_CODEC_RAW: {
+    strcpy(status->header.codec, "RAW");
+    break;
+  }
+  case IPX_CODEC_ZSTD: {
+    strcpy(status->header.codec, "ZSTD");
+    break;
+  }
+  default: {
+    codec = IPX_CODEC_JP2;
+    strcpy(status->header.codec, "JP2");
+  }
+  }
+  status->codec = codec;
 
   if(ipx_write_header(status->fd, &(status->header))) {
     fclose(status->fd);
@@ -337,8 +851,9 @@ int IPX_write_frame(TFrame *frame, IPX_status *status)
   uint codestream_length, datasize;
   opj_cio_t *cio = NULL;
   opj_image_cmptparm_t cmptparm;
+  unsigned char *packed;
   
-  int i, j, p;
+  int i, j, p, err = 0;
   float factor;
 
   static int jp2_init = 1;
@@ -358,6 +873,20 @@ int IPX_write_frame(TFrame *frame, IPX_status *status)
     return(IO_ERROR_SIZE);
   }
 
+  if(status->codec != IPX_CODEC_JP2) {
+    /* Fast lossless codecs */
+    if(ipx_pack_frame(frame, status, &packed, &codestream_length))
+      return(IO_ERROR_OTHER);
+
+    datasize = codestream_length + IPX_UINT + IPX_DOUBLE;
+    if((fwrite(&datasize, IPX_UINT, 1, status->fd) != 1) ||
+       (fwrite(&(frame->time), IPX_DOUBLE, 1, status->fd) != 1) ||
+       (fwrite(packed, 1, codestream_length, status->fd) != codestream_length))
+      return(IO_ERROR_WRITE);
+
+    return(ipx_frame_added(status));
+  }
+
   if(jp2_init) {
     jp2_init = 0;
     /* Setup callbacks */
@@ -366,8 +895,9 @@ int IPX_write_frame(TFrame *frame, IPX_status *status)
     event_mgr.warning_handler = warning_callback;
     event_mgr.info_handler = info_callback;
     
-    /* Set default compression parameters */
+    /* Set default compression parameters, then the options */
     opj_set_default_encoder_parameters(&parameters);
+    jp2_set_parameters(&(status->jp2), frame->width, frame->height, &parameters);
     
     /* Get a compressor handle */
     cinfo = opj_create_compress(CODEC_JP2);
@@ -413,13 +943,6 @@ int IPX_write_frame(TFrame *frame, IPX_status *status)
   }
   image->comps[0].bpp = cmptparm.bpp;
 
-  /* if no rate entered, lossless by default */
-  if(parameters.tcp_numlayers == 0) {
-    parameters.tcp_rates[0] = 0;
-    parameters.tcp_numlayers++;
-    parameters.cp_disto_alloc = 1;
-  }
-
   /* setup the encoder parameters using the current image and using user parameters */
   opj_setup_encoder(cinfo, &parameters, image);
 
@@ -448,38 +971,33 @@ int IPX_write_frame(TFrame *frame, IPX_status *status)
   /* Write frame header */
   //printf("Writing header: %ld, %d ->", ftell(status->fd), sizeof(uint)+sizeof(double));
 
-  fwrite(&datasize, IPX_UINT, 1, status->fd);
-  fwrite(&(frame->time), IPX_DOUBLE, 1, status->fd);
+  if((fwrite(&datasize, IPX_UINT, 1, status->fd) != 1) ||
+     (fwrite(&(frame->time), IPX_DOUBLE, 1, status->fd) != 1))
+    err = IO_ERROR_WRITE;
   
   //printf(" %ld\n", ftell(status->fd));
 
   /* write the frame data */
-  fwrite(cio->buffer, 1, codestream_length, status->fd);
+  if(!err && (fwrite(cio->buffer, 1, codestream_length, status->fd) != codestream_length))
+    err = IO_ERROR_WRITE;
 
-  /* Update header */
-  status->header.numFrames++;
-  
   /* Free memory */
   opj_cio_close(cio);
   opj_image_destroy(image);
+
+  if(err)
+    return(err);
   
-  return(0);
+  /* Update header */
+  return(ipx_frame_added(status));
 }
 
 /* Close a file opened for writing */
 int IPX_write_close(IPX_status *status)
 {
-  /* Set right and bottom so consistent with width and height */
-  status->header.right = status->header.left + status->header.width - 1;
-  status->header.bottom = status->header.top + status->header.height - 1;
-
-  /* Go to start of file */
-  if(fseek(status->fd, 0L, SEEK_SET)) {
-    return(1);
-  }
-
-  /* Write proper header */
-  if(ipx_write_header(status->fd, &(status->header))) {
+  /* Write the final header */
+  if(ipx_commit(status)) {
+    fclose(status->fd);
     return(2);
   }
   
@@ -53,20 +53,49 @@ typedef struct {
   double time;
 }IPX_frame;
 
+/* Codecs used to store frame data. Name goes in the header codec field */
+#define IPX_CODEC_UNKNOWN -1
+#define IPX_CODEC_JP2      0  /* Lossless JPEG 2000 ("JP2") */
+#define IPX_CODEC_RAW      1  /* Uncompressed little-endian pixels ("RAW") */
+#define IPX_CODEC_ZSTD     2  /* Row differences compressed with zstd ("ZSTD") */
+
+/* JPEG 2000 encoding options */
+typedef struct {
+  float rate;        /* Compression ratio. 0 for lossless */
+  float psnr;        /* Target quality in dB. 0 for none */
+  int levels;        /* Number of resolution levels */
+  int cblockw, cblockh; /* Code-block size */
+  int tilew, tileh;  /* Tile size. 0 for one tile */
+  int order;         /* Progression order (0 to 4: LRCP RLCP RPCL PCRL CPRL) */
+}IPX_jp2_options;
+
 /* Status data for ipx read/write */
 typedef struct {
   FILE *fd;          /* Open file descriptor */
   IPX_header header; /* IPX file header */
   IPX_frame *frames; /* List of frames */
+  int codec;         /* Codec used for frame data */
+  IPX_jp2_options jp2; /* Options used when writing JP2 frames */
+
+  int commit;        /* Writing: frames between header updates. 0 only at the end */
+  int uncommitted;   /* Writing: frames added since the last update */
+  double follow;     /* Reading: seconds to wait for frames being added. 0 to not wait */
+  int step;          /* Reading: step between frames asked for */
 }IPX_status;
 
 /********* PROTOTYPES ************/
 
+int IPX_codec(char *name);
+void IPX_jp2_defaults(IPX_jp2_options *options);
+int IPX_jp2_set(IPX_jp2_options *options, char *name, char *value);
+
 int IPX_read_open(char *filename, IPX_status *status);
 int IPX_read_frame(int fnr, TFrame *frame, IPX_status *status);
+int IPX_prefetch(int fnr, IPX_status *status);
 int IPX_read_close(IPX_status *status);
+int IPX_find_time(IPX_status *status, double time, int after);
 
-int IPX_write_open(char *filename, int precision, IPX_status *status);
+int IPX_write_open(char *filename, int precision, int codec, IPX_status *status);
 int IPX_write_frame(TFrame *frame, IPX_status *status);
 int IPX_write_close(IPX_status *status);
 
@@ -0,0 +1,168 @@
+/**************************************************************
+ *  JPEG FILE I/O ROUTINES
+ *  Lossy 8-bit output for review frames and movies. Using
+ *  libjpeg-turbo gives SIMD encoding and decoding, and lets the
+ *  reader skip rows outside the region of interest.
+ *  Colour JPEGs are read as greyscale (brightness only).
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+
+#include "spiceweasel.h"
+
+#ifdef HAVE_LIBJPEG
+
+#include <jpeglib.h>
+
+/* libjpeg exits on errors by default. Jump back instead */
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+}jpeg_error;
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+  longjmp(((jpeg_error*) cinfo->err)->jump, 1);
+}
+
+int read_jpeg(char *filename, TFrame *frame, TBuffer *buffer)
+{
+  struct jpeg_decompress_struct cinfo;
+  jpeg_error jerr;
+  FILE *fp;
+  JSAMPROW rows[CONVERT_TILE];
+  unsigned char *band;
+  int x0, y0, w, h, row, n, i, errcode;
+
+  if(!(fp = input_open(filename)))
+    return(IO_ERROR_OPEN);
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  if(setjmp(jerr.jump)) {
+    /* Corrupt or not a JPEG */
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return(IO_ERROR_FORMAT);
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
+  jpeg_read_header(&cinfo, TRUE);
+
+  /* Only decode the brightness */
+  cinfo.out_color_space = JCS_GRAYSCALE;
+
+  errcode = 0;
+  if(read_region(cinfo.image_width, cinfo.image_height, &x0, &y0, &w, &h))
+    errcode = IO_ERROR_REGION;
+  else if(allocate_output(w, h, frame))
+    errcode = IO_ERROR_SIZE;
+  if(errcode) {
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return(errcode);
+  }
+
+  jpeg_start_decompress(&cinfo);
+
+  band = (unsigned char*) reserve_buffer(buffer, ((size_t) cinfo.output_width)*CONVERT_TILE);
+  for(i=0;i<CONVERT_TILE;i++)
+    rows[i] = band + i*cinfo.output_width;
+
+  /* Skip rows above the region */
+#ifdef LIBJPEG_TURBO_VERSION
+  if(y0 > 0)
+    jpeg_skip_scanlines(&cinfo, y0);
+#else
+  for(row=0;row<y0;row++)
+    jpeg_read_scanlines(&cinfo, rows, 1);
+#endif
+
+  /* Read bands of rows, converting straight into the frame */
+  for(row=0;row<h;row+=n) {
+    n = h - row;
+    if(n > CONVERT_TILE)
+      n = CONVERT_TILE;
+    for(i=0;i<n;)
+      i += jpeg_read_scanlines(&cinfo, rows+i, n-i);
+    convert_rows(band + x0, cinfo.output_width, CONVERT_UINT8, 1,
+		 n, w, frame, row, 255.0);
+  }
+
+  /* Don't need any more rows */
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(fp);
+
+  return(0);
+}
+
+/* Write an 8-bit greyscale or colour raw frame with given quality (1-100) */
+int write_jpeg(char *filename, TRawFrame *frame, int quality)
+{
+  struct jpeg_compress_struct cinfo;
+  jpeg_error jerr;
+  FILE *fp;
+
+  if(frame->bpp != 8)
+    return(IO_ERROR_FORMAT);
+
+  if(!(fp = fopen(filename, "wb")))
+    return(IO_ERROR_OPEN);
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  if(setjmp(jerr.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    fclose(fp);
+    return(IO_ERROR_WRITE);
+  }
+
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, fp);
+
+  cinfo.image_width = frame->width;
+  cinfo.image_height = frame->height;
+  if(frame->channels == 1) {
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+  }else {
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+  }
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+
+  /* All the rows in one call */
+  jpeg_start_compress(&cinfo, TRUE);
+  while(cinfo.next_scanline < cinfo.image_height) {
+    jpeg_write_scanlines(&cinfo, frame->data + cinfo.next_scanline,
+			 cinfo.image_height - cinfo.next_scanline);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  if(fclose(fp))
+    return(IO_ERROR_WRITE);
+
+  return(0);
+}
+
+#else /* HAVE_LIBJPEG */
+
+/* Built without the JPEG library */
+
+int read_jpeg(char *filename, TFrame *frame, TBuffer *buffer)
+{
+  return(IO_ERROR_FORMAT);
+}
+
+int write_jpeg(char *filename, TRawFrame *frame, int quality)
+{
+  return(IO_ERROR_FORMAT);
+}
+
+#endif /* HAVE_LIBJPEG */
@@ -0,0 +1,306 @@
+/**************************************************************
+ *  PHOTRON MRAW FILE READING ROUTINES
+ *
+ *  An MRAW file is just the frames, one after another:
+ *   -  8-bit: one byte per pixel
+ *   - 12-bit: two pixels in three bytes, most significant bits first
+ *   - 16-bit: two bytes per pixel, big-endian
+ *  Everything else is in the CIH file (lines "Key : Value") or the
+ *  newer CIHX file (XML), which has the same name as the MRAW file.
+ *  Either file can be given as input. Colour cameras store the raw
+ *  Bayer pattern, which is read as greyscale.
+ *
+ *  Values are scaled by the effective bit depth, so 12-bit data
+ *  stored in 16-bit pixels still covers the range 0 to 1.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "io_mraw.h"
+
+#define CIH_MAX_SIZE 1048576 /* Largest CIH(X) file read */
+
+/* Find a value in the CIH text. Tries the XML tag (CIHX), then a
+   line starting with the key (CIH). Returns NULL if not found */
+static char *cih_find(char *text, char *key, char *tag)
+{
+  char *p;
+  int n;
+
+  if((p = strstr(text, tag)) != NULL)
+    return(p + strlen(tag));
+
+  n = strlen(key);
+  for(p=text;p!=NULL;p=strchr(p, '\n')) {
+    while((*p == '\n') || (*p == '\r'))
+      p++;
+    if(strncmp(p, key, n) == 0) {
+      p += n;
+      while(*p == ' ')
+	p++;
+      if(*p == ':')
+	return(p+1);
+    }
+  }
+  return(NULL);
+}
+
+static int cih_int(char *text, char *key, char *tag, int def)
+{
+  char *p;
+  int val;
+
+  if(((p = cih_find(text, key, tag)) == NULL) || (sscanf(p, "%d", &val) != 1))
+    return(def);
+  return(val);
+}
+
+/* Read the CIH or CIHX file into the status */
+static int cih_read(char *filename, MRAW_status *status)
+{
+  FILE *fd;
+  char *text, *p;
+  size_t n;
+  int effective;
+
+  if((fd = fopen(filename, "rb")) == (FILE*) NULL)
+    return(IO_ERROR_OPEN);
+
+  text = (char*) malloc(CIH_MAX_SIZE + 1);
+  n = fread(text, 1, CIH_MAX_SIZE, fd);
+  fclose(fd);
+  /* CIHX files start with binary data: make it searchable */
+  for(p=text;p<text+n;p++) {
+    if(*p == 0)
+      *p = ' ';
+  }
+  text[n] = 0;
+
+  status->width = cih_int(text, "Image Width", "<width>", 0);
+  status->height = cih_int(text, "Image Height", "<height>", 0);
+  status->count = cih_int(text, "Total Frame", "<totalFrame>", 0);
+  status->start = cih_int(text, "Start Frame", "<startFrame>", 0);
+  status->depth = cih_int(text, "Color Bit", "<bit>", 0);
+  status->rate = cih_int(text, "Record Rate(fps)", "<recordRate>", 0);
+  effective = cih_int(text, "EffectiveBit Depth", "<depth>", status->depth);
+
+  /* Data stored in the high bits is already full range */
+  if(((p = cih_find(text, "EffectiveBit Side", "<side>")) != NULL) &&
+     (strncasecmp(p + strspn(p, " "), "Higher", 6) == 0))
+    effective = status->depth;
+
+  /* Frames may be in other formats, e.g. TIFF files */
+  if(((p = cih_find(text, "File Format", "<fileFormat>")) != NULL) &&
+     (strncasecmp(p + strspn(p, " "), "MRaw", 4) != 0)) {
+    free(text);
+    return(IO_ERROR_FORMAT);
+  }
+  free(text);
+
+  if((status->width < 1) || (status->height < 1) || (status->count < 0))
+    return(IO_ERROR_FORMAT);
+  if((status->depth != 8) && (status->depth != 12) && (status->depth != 16))
+    return(IO_ERROR_FORMAT); /* e.g. 24-bit colour */
+  if((status->depth == 12) && (status->width % 2))
+    return(IO_ERROR_FORMAT); /* Rows must start on a byte */
+  if((effective < 1) || (effective > status->depth))
+    effective = status->depth;
+  status->maxval = (1 << effective) - 1;
+
+  return(0);
+}
+
+int MRAW_read_open(char *filename, MRAW_status *status)
+{
+  char name[MAX_NAME_LEN+8], *ext;
+  struct stat st;
+  size_t framebytes;
+  int errcode;
+
+  status->map = NULL;
+  status->buffer.data = NULL;
+  status->buffer.size = 0;
+
+  /* Given either the MRAW or the CIH(X) file, find the other one */
+  strncpy(name, filename, MAX_NAME_LEN-1);
+  name[MAX_NAME_LEN-1] = 0;
+  if((ext = strrchr(name, '.')) == NULL)
+    return(IO_ERROR_FORMAT);
+
+  if(strcasecmp(ext, ".mraw") == 0) {
+    strcpy(ext, ".cih");
+    if((errcode = cih_read(name, status)) == IO_ERROR_OPEN) {
+      strcpy(ext, ".cihx");
+      errcode = cih_read(name, status);
+    }
+    if(errcode)
+      return(errcode);
+    strncpy(name, filename, MAX_NAME_LEN-1); /* Back to the MRAW name */
+  }else {
+    if((errcode = cih_read(name, status)))
+      return(errcode);
+    strcpy(ext, ".mraw");
+  }
+
+  if((status->fd = open(name, O_RDONLY)) < 0) {
+    printf("Error: Can't open MRAW file %s\n", name);
+    return(IO_ERROR_OPEN);
+  }
+  if(fstat(status->fd, &st) || (st.st_size == 0)) {
+    close(status->fd);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Map the whole file. Frames are then unpacked straight from the map */
+  status->map_size = st.st_size;
+  status->map = (unsigned char*) mmap(NULL, status->map_size, PROT_READ, MAP_SHARED,
+				      status->fd, 0);
+  if(status->map == MAP_FAILED) {
+    status->map = NULL;
+    close(status->fd);
+    return(IO_ERROR_OTHER);
+  }
+  /* Frames are usually read in order */
+  posix_madvise(status->map, status->map_size, POSIX_MADV_SEQUENTIAL);
+
+  /* Recording may have been cut short */
+  framebytes = ((size_t) status->width)*status->height*status->depth / 8;
+  if(status->count*framebytes > status->map_size)
+    status->count = status->map_size / framebytes;
+
+  return(0);
+}
+
+/* Unpack n big-endian 16-bit pixels into native order */
+static void mraw_unpack16(const unsigned char *src, unsigned short *dst, int n)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128i v;
+  /* x86 is little-endian: swap bytes */
+  for(;i+8<=n;i+=8) {
+    v = _mm_loadu_si128((const __m128i*) (src + 2*i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i*) (dst + i), v);
+  }
+#endif
+  for(;i<n;i++)
+    dst[i] = (src[2*i] << 8) | src[2*i+1];
+}
+
+/* Unpack n 12-bit pixels, two in three bytes. src must start on a
+   pixel pair. end is the end of the readable memory */
+static void mraw_unpack12(const unsigned char *src, unsigned short *dst, int n,
+			  const unsigned char *end)
+{
+  int i = 0;
+
+#ifdef __SSSE3__
+  /* Eight pixels from twelve bytes. Each pair of bytes holding a
+     pixel goes into a 16-bit lane, then even pixels are shifted
+     down and odd pixels masked */
+  __m128i v, shuffle, even, low12;
+  shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  even = _mm_setr_epi16(-1, 0, -1, 0, -1, 0, -1, 0);
+  low12 = _mm_set1_epi16(0x0FFF);
+  for(;(i+8<=n) && (src+16<=end);i+=8,src+=12) {
+    v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) src), shuffle);
+    v = _mm_or_si128(_mm_and_si128(even, _mm_srli_epi16(v, 4)),
+		     _mm_andnot_si128(even, _mm_and_si128(v, low12)));
+    _mm_storeu_si128((__m128i*) (dst + i), v);
+  }
+#endif
+  for(;i+1<n;i+=2,src+=3) {
+    dst[i] = (src[0] << 4) | (src[1] >> 4);
+    dst[i+1] = ((src[1] & 0x0F) << 8) | src[2];
+  }
+  if(i < n)
+    dst[i] = (src[0] << 4) | (src[1] >> 4);
+}
+
+int MRAW_read_frame(int fnr, TFrame *frame, MRAW_status *status)
+{
+  int x0, y0, w, h, xe, n, row, m, j;
+  size_t first, p;
+  unsigned short *band;
+  float factor;
+
+  if((fnr < 0) || (fnr >= status->count))
+    return(IO_ERROR_OTHER);
+
+  if(read_region(status->width, status->height, &x0, &y0, &w, &h))
+    return(IO_ERROR_REGION);
+
+  if(allocate_output(w, h, frame))
+    return(IO_ERROR_SIZE);
+
+  factor = (float) status->maxval;
+
+  /* Pixel index of the first row in the region */
+  first = (((size_t) fnr)*status->height + y0)*status->width;
+
+  if(status->depth == 8) {
+    /* Convert straight from the map */
+    convert_rows(status->map + first + x0, status->width, CONVERT_UINT8, 1,
+		 h, w, frame, 0, factor);
+  }else {
+    /* Unpack bands of rows into 16-bit pixels, then convert. 12-bit
+       rows are unpacked from the start of the pixel pair */
+    xe = (status->depth == 12) ? (x0 & ~1) : x0;
+    n = w + x0 - xe;
+    band = (unsigned short*) reserve_buffer(&(status->buffer),
+					    sizeof(unsigned short)*n*CONVERT_TILE);
+    for(row=0;row<h;row+=m) {
+      m = h - row;
+      if(m > CONVERT_TILE)
+	m = CONVERT_TILE;
+      for(j=0;j<m;j++) {
+	p = first + ((size_t) row + j)*status->width + xe;
+	if(status->depth == 16)
+	  mraw_unpack16(status->map + 2*p, band + j*n, n);
+	else
+	  mraw_unpack12(status->map + 3*p/2, band + j*n, n,
+			status->map + status->map_size);
+      }
+      convert_rows(band + x0 - xe, n*sizeof(unsigned short), CONVERT_UINT16, 1,
+		   m, w, frame, row, factor);
+    }
+  }
+
+  /* Time from the trigger */
+  frame->time = 0.0;
+  if(status->rate > 0.0)
+    frame->time = (status->start + fnr) / status->rate;
+
+  return(0);
+}
+
+int MRAW_read_close(MRAW_status *status)
+{
+  if(status->map != NULL)
+    munmap(status->map, status->map_size);
+  status->map = NULL;
+  close(status->fd);
+
+  free(status->buffer.data);
+  status->buffer.data = NULL;
+  status->buffer.size = 0;
+  status->count = 0;
+
+  return(0);
+}
@@ -0,0 +1,48 @@
+/*********************************************************************
+ * Header for reading Photron MRAW files. The frames are stored one
+ * after another without any headers or compression, so the file is
+ * memory-mapped and frames unpacked straight into the frame buffer.
+ * Frame size, bit depth and timing are in a CIH (text) or CIHX (XML)
+ * file with the same name.
+ *********************************************************************/
+
+#ifndef __IO_MRAW_H__
+#define __IO_MRAW_H__ 1
+
+#include "spiceweasel.h"
+
+/* Status data for MRAW reading */
+typedef struct {
+  int fd;            /* Open file descriptor of the MRAW file */
+  int width, height;
+  int count;         /* Number of frames */
+  int depth;         /* Bits per pixel stored: 8, 12 (packed) or 16 */
+  int maxval;        /* Largest value, from the effective bit depth */
+  int start;         /* Number of the first frame (negative if pre-trigger) */
+  double rate;       /* Frames per second */
+
+  unsigned char *map; /* Memory-mapped MRAW file */
+  size_t map_size;
+
+  TBuffer buffer;    /* Unpacked 16-bit rows */
+}MRAW_status;
+
+/********* PROTOTYPES ************/
+
+int MRAW_read_open(char *filename, MRAW_status *status);
+int MRAW_read_frame(int fnr, TFrame *frame, MRAW_status *status);
+int MRAW_read_close(MRAW_status *status);
+
+/************ GLOBAL VARIABLES **************/
+
+#ifndef MRAWGLOBALORIGIN
+#define GLOBAL extern
+#else
+#define GLOBAL
+#endif
+
+GLOBAL MRAW_status mraw_read_status; /* MRAW input file */
+
+#undef GLOBAL
+
+#endif
@@ -0,0 +1,365 @@
+/**************************************************************
+ *  FRAME CUBE (NumPy .npy) FILE I/O ROUTINES
+ *
+ *  File layout:
+ *   - npy version 1.0 header, padded to NPY_HEADER_SIZE bytes, with
+ *     shape (frames, height, width) and type uint8, uint16 or float32
+ *     in the byte order of the machine which wrote it
+ *   - frames, each height rows of width pixels
+ *   - frame times as doubles (same byte order), followed by the
+ *     8 bytes "SWTIMES" and a zero. numpy ignores these.
+ *  Integer frames are scaled to the full range like image files,
+ *  float frames hold the processed values unchanged.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "io_npy.h"
+
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_TIMES_MAGIC "SWTIMES"
+
+static int npy_bigendian()
+{
+  short one = 1;
+  return(*((char*) &one) == 0);
+}
+
+/* Bytes per pixel */
+static int npy_pixel_bytes(int depth)
+{
+  return(depth / 8);
+}
+
+/* Write the header. Frame count has a fixed width so that the
+   header can be rewritten in place when the file is closed */
+static int npy_write_header(NPY_status *status)
+{
+  char header[NPY_HEADER_SIZE];
+  char descr[4];
+  int n;
+
+  descr[0] = status->bigendian ? '>' : '<';
+  descr[1] = (status->depth == 32) ? 'f' : 'u';
+  descr[2] = '0' + npy_pixel_bytes(status->depth);
+  descr[3] = 0;
+  if(status->depth == 8)
+    descr[0] = '|'; /* Byte order doesn't apply */
+
+  memset(header, ' ', NPY_HEADER_SIZE);
+  memcpy(header, NPY_MAGIC, 6);
+  header[6] = 1; /* Version 1.0 */
+  header[7] = 0;
+  header[8] = (NPY_HEADER_SIZE - 10) & 0xFF; /* Little-endian length */
+  header[9] = (NPY_HEADER_SIZE - 10) >> 8;
+
+  n = sprintf(header+10, "{'descr': '%s', 'fortran_order': False, 'shape': (%10d, %d, %d), }",
+	      descr, status->count, status->height, status->width);
+  header[10+n] = ' '; /* Remove terminating zero */
+  header[NPY_HEADER_SIZE-1] = '\n';
+
+  if(fseek(status->fd, 0, SEEK_SET))
+    return(1);
+  if(fwrite(header, NPY_HEADER_SIZE, 1, status->fd) != 1)
+    return(1);
+  return(0);
+}
+
+/***************************** READING ********************************/
+
+/* Find the value of a key in the header dictionary */
+static char *npy_find_key(char *header, char *key)
+{
+  char *p;
+  if((p = strstr(header, key)) == NULL)
+    return(NULL);
+  p += strlen(key);
+  while((*p == ' ') || (*p == ':'))
+    p++;
+  return(p);
+}
+
+int NPY_read_open(char *filename, NPY_status *status)
+{
+  struct stat st;
+  char *header, *p;
+  long hlen, framebytes, end;
+  int shape[3], ndims;
+
+  status->count = 0;
+  status->map = NULL;
+  status->times = NULL;
+
+  if((status->fd = fopen(filename, "rb")) == (FILE*) NULL)
+    return(IO_ERROR_OPEN);
+
+  if(fstat(fileno(status->fd), &st) || (st.st_size < 10)) {
+    fclose(status->fd);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Map the whole file. Frames are then converted straight from the map */
+  status->map_size = st.st_size;
+  status->map = (unsigned char*) mmap(NULL, status->map_size, PROT_READ, MAP_SHARED,
+				      fileno(status->fd), 0);
+  if(status->map == MAP_FAILED) {
+    status->map = NULL;
+    fclose(status->fd);
+    return(IO_ERROR_OTHER);
+  }
+
+  if(memcmp(status->map, NPY_MAGIC, 6)) {
+    NPY_read_close(status);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Header length is 2 bytes in version 1, 4 bytes after */
+  if(status->map[6] == 1) {
+    hlen = status->map[8] | (status->map[9] << 8);
+    status->data_start = 10 + hlen;
+  }else {
+    hlen = status->map[8] | (status->map[9] << 8) |
+      (status->map[10] << 16) | (((long) status->map[11]) << 24);
+    status->data_start = 12 + hlen;
+  }
+  if(status->data_start > status->map_size) {
+    NPY_read_close(status);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Copy of the header as a string */
+  header = (char*) malloc(hlen + 1);
+  memcpy(header, status->map + status->data_start - hlen, hlen);
+  header[hlen] = 0;
+
+  /* Data type */
+  status->depth = 0;
+  if((p = npy_find_key(header, "'descr'")) != NULL) {
+    status->bigendian = (p[1] == '>');
+    if((p[1] == '<') || (p[1] == '>') || (p[1] == '|') || (p[1] == '=')) {
+      if(strncmp(p+2, "u1'", 3) == 0)
+	status->depth = 8;
+      else if(strncmp(p+2, "u2'", 3) == 0)
+	status->depth = 16;
+      else if(strncmp(p+2, "f4'", 3) == 0)
+	status->depth = 32;
+    }
+    if(p[1] == '=')
+      status->bigendian = npy_bigendian();
+  }
+  if((status->depth == 0) ||
+     ((status->depth > 8) && (status->bigendian != npy_bigendian()))) {
+    /* Unsupported type or byte order */
+    free(header);
+    NPY_read_close(status);
+    return(IO_ERROR_FORMAT);
+  }
+
+  if(((p = npy_find_key(header, "'fortran_order'")) == NULL) || strncmp(p, "False", 5)) {
+    free(header);
+    NPY_read_close(status);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Shape is (frames, height, width) or a single (height, width) frame */
+  ndims = 0;
+  if(((p = npy_find_key(header, "'shape'")) != NULL) && (*p == '(')) {
+    p++;
+    while((ndims < 3) && (sscanf(p, "%d", &shape[ndims]) == 1)) {
+      ndims++;
+      if((p = strchr(p, ',')) == NULL)
+	break;
+      p++;
+    }
+  }
+  free(header);
+
+  if(ndims == 2) {
+    status->count = 1;
+    status->height = shape[0];
+    status->width = shape[1];
+  }else if(ndims == 3) {
+    status->count = shape[0];
+    status->height = shape[1];
+    status->width = shape[2];
+  }else {
+    NPY_read_close(status);
+    return(IO_ERROR_FORMAT);
+  }
+
+  framebytes = ((long) status->width) * status->height * npy_pixel_bytes(status->depth);
+  end = status->data_start + framebytes*status->count;
+  if(end > status->map_size) {
+    /* File is truncated */
+    NPY_read_close(status);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Frame times, if written by spiceweasel */
+  status->ntimes = 0;
+  if((status->map_size == end + 8*((long) status->count) + 8) &&
+     (memcmp(status->map + status->map_size - 8, NPY_TIMES_MAGIC, 8) == 0)) {
+    status->times = (double*) malloc(sizeof(double)*status->count);
+    memcpy(status->times, status->map + end, sizeof(double)*status->count);
+    status->ntimes = status->count;
+  }
+
+  return(0);
+}
+
+int NPY_read_frame(int fnr, TFrame *frame, NPY_status *status)
+{
+  int x0, y0, w, h, n, type;
+  float factor;
+  unsigned char *data;
+
+  if((fnr < 0) || (fnr >= status->count))
+    return(IO_ERROR_OTHER);
+
+  if(read_region(status->width, status->height, &x0, &y0, &w, &h))
+    return(IO_ERROR_REGION);
+
+  if(allocate_output(w, h, frame))
+    return(IO_ERROR_SIZE);
+
+  n = npy_pixel_bytes(status->depth);
+  type = CONVERT_UINT8;
+  factor = 255.0;
+  if(status->depth == 16) {
+    type = CONVERT_UINT16;
+    factor = 65535.0;
+  }else if(status->depth == 32) {
+    type = CONVERT_FLOAT;
+    factor = 1.0;
+  }
+
+  data = status->map + status->data_start +
+    (((long) fnr)*status->height + y0)*status->width*n + x0*n;
+
+  convert_rows(data, ((long) status->width)*n, type, 1, h, w, frame, 0, factor);
+
+  frame->time = 0.0;
+  if(fnr < status->ntimes)
+    frame->time = status->times[fnr];
+
+  return(0);
+}
+
+int NPY_read_close(NPY_status *status)
+{
+  if(status->map != NULL)
+    munmap(status->map, status->map_size);
+  status->map = NULL;
+  fclose(status->fd);
+
+  if(status->times != NULL)
+    free(status->times);
+  status->times = NULL;
+  status->count = 0;
+
+  return(0);
+}
+
+/***************************** WRITING ********************************/
+
+int NPY_write_open(char *filename, int depth, NPY_status *status)
+{
+  if((depth != 8) && (depth != 16) && (depth != 32))
+    return(IO_ERROR_FORMAT);
+
+  if((status->fd = fopen(filename, "wb")) == (FILE*) NULL)
+    return(IO_ERROR_OPEN);
+
+  status->width = status->height = 0;
+  status->count = 0;
+  status->depth = depth;
+  status->bigendian = npy_bigendian();
+  status->data_start = NPY_HEADER_SIZE;
+  status->ntimes = 0;
+  status->times = NULL;
+  status->raw.allocated = 0;
+  status->rows = NULL;
+
+  /* Dummy header - rewritten when finished */
+  if(npy_write_header(status)) {
+    fclose(status->fd);
+    return(IO_ERROR_WRITE);
+  }
+  return(0);
+}
+
+/* Append a frame with a single write */
+int NPY_write_frame(TFrame *frame, NPY_status *status)
+{
+  size_t npix;
+  void *data;
+
+  if(status->count == 0) {
+    status->width = frame->width;
+    status->height = frame->height;
+  }
+  if((status->width != frame->width) || (status->height != frame->height))
+    return(IO_ERROR_SIZE);
+
+  npix = ((size_t) frame->width) * frame->height;
+
+  if(status->depth == 32) {
+    if(status->rows == NULL)
+      status->rows = (float*) malloc(sizeof(float)*npix);
+    pack_float(frame, status->rows);
+    data = status->rows;
+  }else {
+    /* Clamp and scale into integers */
+    if(!status->raw.allocated)
+      allocate_raw(frame->width, frame->height, status->depth, 1, &(status->raw));
+    pack_grey(frame, &(status->raw), status->bigendian);
+    data = status->raw.data[0];
+  }
+
+  if(fwrite(data, npy_pixel_bytes(status->depth), npix, status->fd) != npix)
+    return(IO_ERROR_WRITE);
+
+  /* Keep the time, written at the end */
+  if(status->count == status->ntimes) {
+    status->ntimes = 2*status->ntimes + 64;
+    status->times = (double*) realloc(status->times, sizeof(double)*status->ntimes);
+  }
+  status->times[status->count] = frame->time;
+  status->count++;
+
+  return(0);
+}
+
+int NPY_write_close(NPY_status *status)
+{
+  int errcode = 0;
+
+  /* Frame times */
+  if(status->count > 0) {
+    if((fwrite(status->times, sizeof(double), status->count, status->fd) != status->count) ||
+       (fwrite(NPY_TIMES_MAGIC, 8, 1, status->fd) != 1))
+      errcode = IO_ERROR_WRITE;
+  }
+
+  /* Header with the final frame count */
+  if(npy_write_header(status))
+    errcode = IO_ERROR_WRITE;
+
+  if(fclose(status->fd))
+    errcode = IO_ERROR_WRITE;
+
+  if(status->times != NULL)
+    free(status->times);
+  status->times = NULL;
+  free_raw(&(status->raw));
+  if(status->rows != NULL)
+    free(status->rows);
+  status->rows = NULL;
+
+  return(errcode);
+}
@@ -0,0 +1,58 @@
+/*********************************************************************
+ * Header for frame cube read/writing. Frames are stored one after
+ * another in a NumPy .npy file with shape (frames, height, width),
+ * so they can be memory-mapped by other programs, e.g.
+ *   numpy.load("file.npy", mmap_mode="r")
+ * Frame times are stored after the frames (see io_npy.c).
+ *********************************************************************/
+
+#ifndef __IO_NPY_H__
+#define __IO_NPY_H__ 1
+
+#include <stdio.h>
+
+#include "spiceweasel.h"
+
+#define NPY_HEADER_SIZE 128  /* Written header size, including magic */
+
+/* Status data for npy read/write */
+typedef struct {
+  FILE *fd;          /* Open file descriptor */
+  int width, height;
+  int count;         /* Number of frames */
+  int depth;         /* 8 or 16 bit unsigned, or 32 for float */
+  int bigendian;     /* Byte order of the data */
+  long data_start;   /* Offset of the first frame */
+  double *times;     /* Frame times */
+  int ntimes;        /* Size of times array */
+
+  unsigned char *map; /* Memory-mapped file when reading */
+  size_t map_size;
+
+  TRawFrame raw;     /* Packed integer frame when writing */
+  float *rows;       /* Float frame in rows when writing */
+}NPY_status;
+
+/********* PROTOTYPES ************/
+
+int NPY_read_open(char *filename, NPY_status *status);
+int NPY_read_frame(int fnr, TFrame *frame, NPY_status *status);
+int NPY_read_close(NPY_status *status);
+
+int NPY_write_open(char *filename, int depth, NPY_status *status);
+int NPY_write_frame(TFrame *frame, NPY_status *status);
+int NPY_write_close(NPY_status *status);
+
+/************ GLOBAL VARIABLES **************/
+
+#ifndef NPYGLOBALORIGIN
+#define GLOBAL extern
+#else
+#define GLOBAL 
+#endif
+
+GLOBAL NPY_status npy_read_status; /* npy input file */
+
+#undef GLOBAL
+
+#endif
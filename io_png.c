@@ -1,7 +1,7 @@
 /**************************************************************
  *  PNG FILE I/O ROUTINES. 
- *  Currently these allocates then frees memory but should
- *  optimise properly.
+ *  Reading uses a caller-supplied buffer so that memory is
+ *  reused between frames (and between read-ahead threads)
  **************************************************************/
 
 #include <png.h>
@@ -9,55 +9,66 @@
 #include <stdlib.h>
 #include "spiceweasel.h"
 
-int read_png(char *filename, TRawFrame *frame)
+int read_png(char *filename, TFrame *frame, TBuffer *buffer)
 {
   unsigned char header[8];
   FILE *fp;
   png_structp png_ptr;
   png_infop info_ptr;
   int channels, width, height, bit_depth, color_type, rowbytes;
-  int nbytes;
-  int i;
+  int nbytes, passes, nband, type;
+  int x0, y0, w, h;
+  int i, row, n;
+  short one;
+  unsigned char *band;
+  png_bytep *rows;
   
   /* OPEN FILE */
-  if(!(fp = fopen(filename, "rb")))
+  if(!(fp = input_open(filename)))
     return(IO_ERROR_OPEN);  /* Could not open */
 
   /* READ THE FILE HEADER */
-  fread(header, 1, 7, fp);
-  if(png_sig_cmp(header, 0, 7)) {
+  if((fread(header, 1, 8, fp) != 8) || png_sig_cmp(header, 0, 8)) {
+    fclose(fp);
     return(IO_ERROR_FORMAT); /* File not PNG */
   }
-  fclose(fp);
-  fp = fopen(filename, "rb");
   
   /* ALLOCATE MEMORY */
 
   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 
 				   NULL, NULL, NULL);
-  if(!png_ptr)
+  if(!png_ptr) {
+    fclose(fp);
     return(IO_ERROR_OTHER); /* PNG Error */
+  }
 
   info_ptr = png_create_info_struct(png_ptr);
   if (!info_ptr) {
     png_destroy_read_struct(&png_ptr,
 			    (png_infopp)NULL, (png_infopp)NULL);
+    fclose(fp);
     return(IO_ERROR_OTHER); /* PNG Error */
   }
 
-  /* READ PNG HEADER */
+  /* libpng jumps back here on a corrupt file */
+  if(setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* READ PNG HEADER. Signature has already been read */
   png_init_io(png_ptr, fp);
+  png_set_sig_bytes(png_ptr, 8);
 
   png_read_info(png_ptr, info_ptr);
 
   /* Extract header */
 
-  channels   = png_get_channels(png_ptr, info_ptr);
   width      = png_get_image_width(png_ptr, info_ptr);
   height     = png_get_image_height(png_ptr, info_ptr);
   bit_depth  = png_get_bit_depth(png_ptr, info_ptr);
   color_type = png_get_color_type(png_ptr, info_ptr);
-  rowbytes   = png_get_rowbytes(png_ptr, info_ptr);
   
   /* SET INPUT TRANSFORMATIONS */
 
@@ -71,35 +82,68 @@ int read_png(char *filename, TRawFrame *frame)
 
   /* Number of bytes per pixel */
   nbytes = 1;
-  if(bit_depth > 8)
+  type = CONVERT_UINT8;
+  if(bit_depth > 8) {
     nbytes = 2;
- 
-  frame->channels = channels;
-
-  /* Check if the frame has been allocated */
-  if(frame->allocated) {
-    /* Data already allocated - check same size */
-    if((frame->width != width) || 
-       (frame->height != height) || 
-       (frame->rowbytes != rowbytes)) {
-      return(IO_ERROR_SIZE);
-    }  
-  }else {
-    /* Allocate memory. Note organised in COLUMNS */
-    frame->data = (unsigned char**) malloc(sizeof(unsigned char*)*height);
-    for(i=0;i!=height;i++)
-      frame->data[i] = (unsigned char*) malloc(rowbytes*sizeof(unsigned char));
-    frame->width = width;
-    frame->height = height;
-    frame->allocated =  1;
-    frame->bpp = bit_depth;
-    frame->rowbytes = rowbytes;
+    type = CONVERT_UINT16;
+    /* PNG is big-endian. Swap if this machine isn't */
+    one = 1;
+    if(*((char*) &one))
+      png_set_swap(png_ptr);
   }
 
-  /* READ PNG DATA */
-  
-  png_read_image(png_ptr, frame->data);
+  passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  channels   = png_get_channels(png_ptr, info_ptr);
+  rowbytes   = png_get_rowbytes(png_ptr, info_ptr);
+
+  /* Get the region to convert */
+  if(read_region(width, height, &x0, &y0, &w, &h)) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    return(IO_ERROR_REGION);
+  }
+
+  /* Check/allocate the frame. Note organised in COLUMNS */
+  if(allocate_output(w, h, frame)) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    return(IO_ERROR_SIZE);
+  }
+
+  /* Rows are read in bands and converted straight into the frame.
+     Interlaced images have to be read all at once */
+  nband = CONVERT_TILE;
+  if(passes > 1)
+    nband = height;
   
+  rows = (png_bytep*) reserve_buffer(buffer, (sizeof(png_bytep) + rowbytes)*nband);
+  band = (unsigned char*) (rows + nband);
+  for(i=0;i<nband;i++)
+    rows[i] = band + i*rowbytes;
+
+  /* READ PNG DATA */
+
+  if(passes > 1) {
+    png_read_image(png_ptr, rows);
+    convert_rows(rows[y0] + x0*channels*nbytes, rowbytes, type, channels,
+		 h, w, frame, 0, (float) ((1 << bit_depth) - 1));
+  }else {
+    /* Skip rows above the region */
+    for(row=0;row<y0;row++)
+      png_read_row(png_ptr, rows[0], NULL);
+    
+    for(row=0;row<h;row+=nband) {
+      n = h - row;
+      if(n > nband)
+	n = nband;
+      png_read_rows(png_ptr, rows, NULL, n);
+      convert_rows(band + x0*channels*nbytes, rowbytes, type, channels,
+		   n, w, frame, row, (float) ((1 << bit_depth) - 1));
+    }
+  }
+
   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
   
   fclose(fp);
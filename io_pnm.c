@@ -0,0 +1,159 @@
+/**************************************************************
+ *  PGM/PPM (binary netpbm) FILE I/O ROUTINES
+ *  No compression, so these are the fastest formats for
+ *  exchanging frames with other programs.
+ *  PPM (colour) input just uses the first (red) channel.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "spiceweasel.h"
+
+/* Read the next number from a netpbm header, skipping whitespace and
+   comments. Returns -1 on error */
+static int pnm_number(FILE *fp)
+{
+  int c, val;
+
+  do {
+    c = getc(fp);
+    if(c == '#') {
+      /* Comment to end of line */
+      while((c != '\n') && (c != EOF))
+	c = getc(fp);
+    }
+  }while(isspace(c));
+
+  if(!isdigit(c))
+    return(-1);
+
+  val = 0;
+  while(isdigit(c)) {
+    val = 10*val + (c - '0');
+    c = getc(fp);
+  }
+  /* c is the single whitespace character ending the number */
+  if(!isspace(c))
+    return(-1);
+
+  return(val);
+}
+
+int read_pnm(char *filename, TFrame *frame)
+{
+  FILE *fp;
+  unsigned char magic[2];
+  unsigned char *band, t;
+  int channels, width, height, maxval, nbyte, pitch;
+  int type, x0, y0, w, h, row, nband, i;
+  long start;
+  short one;
+
+  if(!(fp = input_open(filename)))
+    return(IO_ERROR_OPEN);
+
+  if(fread(magic, 1, 2, fp) != 2) {
+    fclose(fp);
+    return(IO_ERROR_FORMAT);
+  }
+  if((magic[0] != 'P') || ((magic[1] != '5') && (magic[1] != '6'))) {
+    /* Not binary PGM or PPM */
+    fclose(fp);
+    return(IO_ERROR_FORMAT);
+  }
+  channels = (magic[1] == '5') ? 1 : 3;
+
+  width  = pnm_number(fp);
+  height = pnm_number(fp);
+  maxval = pnm_number(fp);
+  if((width <= 0) || (height <= 0) || (maxval <= 0) || (maxval > 65535)) {
+    fclose(fp);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Samples are one byte, or two bytes big-endian */
+  nbyte = (maxval > 255) ? 2 : 1;
+  type = (nbyte == 2) ? CONVERT_UINT16 : CONVERT_UINT8;
+  pitch = width * channels * nbyte;
+
+  /* Get the region to convert */
+  if(read_region(width, height, &x0, &y0, &w, &h)) {
+    fclose(fp);
+    return(IO_ERROR_REGION);
+  }
+
+  /* Check/allocate the frame */
+  if(allocate_output(w, h, frame)) {
+    fclose(fp);
+    return(IO_ERROR_SIZE);
+  }
+
+  /* Skip rows above the region */
+  start = ftell(fp);
+  if(fseek(fp, start + ((long) y0)*pitch, SEEK_SET)) {
+    fclose(fp);
+    return(IO_ERROR_FORMAT);
+  }
+
+  one = 1;
+
+  /* Read in bands of rows, converting straight into the frame */
+  band = (unsigned char*) malloc(pitch*CONVERT_TILE);
+
+  for(row=0;row<h;row+=nband) {
+    nband = h - row;
+    if(nband > CONVERT_TILE)
+      nband = CONVERT_TILE;
+    if(fread(band, pitch, nband, fp) != nband) {
+      /* Premature end of file */
+      free(band);
+      fclose(fp);
+      return(IO_ERROR_FORMAT);
+    }
+    if((nbyte == 2) && (*((char*) &one) == 1)) {
+      /* Little-endian host: swap to native order */
+      for(i=0;i<pitch*nband;i+=2) {
+	t = band[i];
+	band[i] = band[i+1];
+	band[i+1] = t;
+      }
+    }
+    convert_rows(band + x0*channels*nbyte, pitch, type, channels,
+		 nband, w, frame, row, (float) maxval);
+  }
+
+  free(band);
+  fclose(fp);
+  return(0);
+}
+
+/* Writes PGM for greyscale, PPM for colour. Raw frame rows are
+   already in netpbm order (16-bit samples big-endian) */
+int write_pnm(char *filename, TRawFrame *frame)
+{
+  FILE *fp;
+  int j, rowbytes;
+
+  if((frame->bpp != 8) && (frame->bpp != 16))
+    return(IO_ERROR_FORMAT);
+
+  if(!(fp = fopen(filename, "wb")))
+    return(IO_ERROR_OPEN);
+
+  fprintf(fp, "P%c\n%d %d\n%d\n", (frame->channels == 1) ? '5' : '6',
+	  frame->width, frame->height, (1 << frame->bpp) - 1);
+
+  rowbytes = frame->width * frame->channels * frame->bpp / 8;
+  for(j=0;j<frame->height;j++) {
+    if(fwrite(frame->data[j], rowbytes, 1, fp) != 1) {
+      fclose(fp);
+      return(IO_ERROR_WRITE);
+    }
+  }
+
+  if(fclose(fp))
+    return(IO_ERROR_WRITE);
+
+  return(0);
+}
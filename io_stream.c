@@ -0,0 +1,368 @@
+/**************************************************************
+ *  FRAME STREAM I/O ROUTINES
+ *  Reads frames from stdin and writes them to stdout, so that
+ *  spiceweasel can be used in a pipeline, e.g.
+ *
+ *  spiceweasel 0 10000 21 -i shot.ipx -o - --stream y4m | ffmpeg -i - movie.mp4
+ *
+ *  Streams can't seek, so frames are read in order and any which
+ *  aren't wanted are skipped. The end of an input stream is marked
+ *  by setting frame->last on the final frame.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io_stream.h"
+
+#define Y4M_MAGIC "YUV4MPEG2"
+#define Y4M_LINE 256  /* Longest header line accepted */
+
+static int stream_bigendian()
+{
+  short one = 1;
+  return(*((char*) &one) == 0);
+}
+
+/* Read a line of a Y4M stream, without the newline.
+   Returns the length, or -1 at end of file */
+static int y4m_line(FILE *fd, char *line)
+{
+  int c, n;
+
+  n = 0;
+  while(((c = getc(fd)) != EOF) && (c != '\n')) {
+    if(n < Y4M_LINE-1)
+      line[n++] = c;
+  }
+  line[n] = 0;
+  if((c == EOF) && (n == 0))
+    return(-1);
+  return(n);
+}
+
+/* Get the size and chroma layout from a Y4M stream header */
+static int y4m_parse_header(char *line, STREAM_status *status)
+{
+  char *tok, *colour;
+  int cw, ch, bits, bytes;
+
+  status->width = status->height = 0;
+  colour = "420jpeg"; /* Default */
+
+  for(tok=strtok(line, " ");tok!=NULL;tok=strtok(NULL, " ")) {
+    switch(tok[0]) {
+    case 'W': status->width = atoi(tok+1); break;
+    case 'H': status->height = atoi(tok+1); break;
+    case 'C': colour = tok+1; break;
+    }
+  }
+  if((status->width <= 0) || (status->height <= 0))
+    return(IO_ERROR_FORMAT);
+
+  /* Chroma subsampling, then optional bit depth e.g. 420p10 or mono16 */
+  bits = 8;
+  if(strncmp(colour, "mono", 4) == 0) {
+    cw = ch = 0;
+    if(colour[4] != 0)
+      bits = atoi(colour+4);
+  }else {
+    if(strncmp(colour, "420", 3) == 0) {
+      cw = (status->width + 1)/2;
+      ch = (status->height + 1)/2;
+    }else if(strncmp(colour, "422", 3) == 0) {
+      cw = (status->width + 1)/2;
+      ch = status->height;
+    }else if(strncmp(colour, "444", 3) == 0) {
+      cw = status->width;
+      ch = status->height;
+    }else
+      return(IO_ERROR_FORMAT);
+    if(colour[3] == 'p')
+      bits = atoi(colour+4);
+  }
+  if((bits < 8) || (bits > 16))
+    return(IO_ERROR_FORMAT);
+
+  bytes = (bits > 8) ? 2 : 1;
+  status->depth = 8*bytes;
+  status->maxval = (1 << bits) - 1;
+  status->chroma = 2*cw*ch*bytes;
+  if(strstr(colour, "alpha") != NULL)
+    status->chroma += status->width*status->height*bytes;
+
+  return(0);
+}
+
+/* Read the header of the next frame. Returns 0 if there is another
+   frame, 1 at the end of the stream, or an IO_ERROR code */
+static int stream_next_header(STREAM_status *status)
+{
+  char line[Y4M_LINE];
+  size_t n;
+
+  if(status->format == STREAM_Y4M) {
+    if(y4m_line(status->fd, line) < 0)
+      return(1);
+    if(strncmp(line, "FRAME", 5))
+      return(IO_ERROR_FORMAT);
+    return(0);
+  }
+
+  n = fread(&(status->header), 1, sizeof(STREAM_header), status->fd);
+  if(n == 0)
+    return(1);
+  if((n != sizeof(STREAM_header)) || memcmp(status->header.magic, STREAM_MAGIC, 4))
+    return(IO_ERROR_FORMAT);
+  if((status->header.depth != 8) && (status->header.depth != 16) &&
+     (status->header.depth != 32))
+    return(IO_ERROR_FORMAT);
+  return(0);
+}
+
+int STREAM_read_open(FILE *fd, STREAM_status *status)
+{
+  char line[Y4M_LINE];
+  int c, errcode;
+
+  status->fd = fd;
+  status->next = 0;
+  status->step = 1;
+  status->pending = 0;
+  status->buffer.data = NULL;
+  status->buffer.size = 0;
+  status->raw.allocated = 0;
+
+  /* Look at the first character to tell the formats apart */
+  if((c = getc(fd)) == EOF)
+    return(IO_ERROR_FORMAT);
+  ungetc(c, fd);
+
+  if(c == Y4M_MAGIC[0]) {
+    status->format = STREAM_Y4M;
+    if((y4m_line(fd, line) < 0) || strncmp(line, Y4M_MAGIC, 9))
+      return(IO_ERROR_FORMAT);
+    if((errcode = y4m_parse_header(line, status)))
+      return(errcode);
+  }else {
+    status->format = STREAM_RAW;
+    status->chroma = 0;
+  }
+
+  /* Header of the first frame */
+  if((errcode = stream_next_header(status)))
+    return((errcode == 1) ? IO_ERROR_FORMAT : errcode);
+  status->pending = 1;
+
+  if(status->format == STREAM_RAW) {
+    status->width = status->header.width;
+    status->height = status->header.height;
+    status->depth = status->header.depth;
+    status->maxval = (status->depth < 32) ? (1 << status->depth) - 1 : 1;
+  }
+
+  return(0);
+}
+
+/* Read the next frame into the buffer, then the header of the one after */
+static int stream_next_frame(STREAM_status *status, double *time)
+{
+  size_t framebytes;
+  int errcode;
+
+  if(!status->pending)
+    return(IO_ERROR_OTHER); /* Past the end of the stream */
+  
+  *time = 0.0;
+  if(status->format == STREAM_RAW) {
+    if((status->header.width != status->width) ||
+       (status->header.height != status->height) ||
+       (status->header.depth != status->depth))
+      return(IO_ERROR_SIZE);
+    *time = status->header.time;
+  }
+
+  /* Read the whole frame, including any chroma */
+  framebytes = ((size_t) status->width)*status->height*(status->depth / 8) + status->chroma;
+  reserve_buffer(&(status->buffer), framebytes);
+  if(fread(status->buffer.data, 1, framebytes, status->fd) != framebytes)
+    return(IO_ERROR_FORMAT);
+  status->next++;
+
+  /* See if there is another frame */
+  errcode = stream_next_header(status);
+  if(errcode > 1)
+    return(errcode);
+  status->pending = (errcode == 0);
+  return(0);
+}
+
+/* Read frame number fnr (counting from 0 at the start of the stream).
+   Frames before it are skipped; frames already passed can't be read */
+int STREAM_read_frame(int fnr, TFrame *frame, STREAM_status *status)
+{
+  int x0, y0, w, h, n, type, errcode;
+  size_t framebytes, i;
+  unsigned char t;
+  double time, skiptime;
+  float factor;
+  unsigned char *data;
+
+  if(fnr < status->next)
+    return(IO_ERROR_OTHER);
+
+  while(status->next <= fnr) {
+    if((errcode = stream_next_frame(status, &time)))
+      return(errcode);
+  }
+
+  n = status->depth / 8; /* Bytes per pixel */
+  framebytes = ((size_t) status->width)*status->height*n;
+  data = (unsigned char*) status->buffer.data;
+
+  if(read_region(status->width, status->height, &x0, &y0, &w, &h))
+    return(IO_ERROR_REGION);
+
+  if(allocate_output(w, h, frame))
+    return(IO_ERROR_SIZE);
+
+  type = CONVERT_UINT8;
+  factor = (float) status->maxval;
+  if(status->depth == 16) {
+    type = CONVERT_UINT16;
+    if((status->format == STREAM_Y4M) && stream_bigendian()) {
+      /* Y4M is little-endian: swap to native order */
+      for(i=0;i<framebytes;i+=2) {
+	t = data[i];
+	data[i] = data[i+1];
+	data[i+1] = t;
+      }
+    }
+  }else if(status->depth == 32) {
+    type = CONVERT_FLOAT;
+    factor = 1.0;
+  }
+
+  convert_rows(data + (((size_t) y0)*status->width + x0)*n, ((long) status->width)*n,
+	       type, 1, h, w, frame, 0, factor);
+
+  frame->time = time;
+
+  /* Skip frames which won't be asked for, to find out whether
+     this is the last one */
+  while(status->pending && (status->next < fnr + status->step)) {
+    if((errcode = stream_next_frame(status, &skiptime)))
+      return(errcode);
+  }
+  if(!status->pending)
+    frame->last = 1; /* End of the stream */
+
+  return(0);
+}
+
+int STREAM_read_close(STREAM_status *status)
+{
+  free(status->buffer.data);
+  status->buffer.data = NULL;
+  status->buffer.size = 0;
+  return(0);
+}
+
+/***************************** WRITING ********************************/
+
+int STREAM_write_open(FILE *fd, int format, int depth, STREAM_status *status)
+{
+  if((depth != 8) && (depth != 16) && (depth != 32))
+    return(IO_ERROR_FORMAT);
+  if((format == STREAM_Y4M) && (depth == 32))
+    return(IO_ERROR_FORMAT);
+
+  status->fd = fd;
+  status->format = format;
+  status->depth = depth;
+  status->width = status->height = 0;
+  status->next = 0;
+  status->buffer.data = NULL;
+  status->buffer.size = 0;
+  status->raw.allocated = 0;
+
+  return(0);
+}
+
+int STREAM_write_frame(TFrame *frame, STREAM_status *status)
+{
+  STREAM_header header;
+  size_t framebytes;
+  void *data;
+
+  if(status->next == 0) {
+    /* First frame sets the size */
+    status->width = frame->width;
+    status->height = frame->height;
+
+    if(status->format == STREAM_Y4M) {
+      /* Frame rate isn't known, so use 25 fps */
+      if(fprintf(status->fd, "%s W%d H%d F25:1 Ip A1:1 C%s\n", Y4M_MAGIC,
+		 status->width, status->height,
+		 (status->depth == 16) ? "mono16" : "mono") < 0)
+	return(IO_ERROR_WRITE);
+    }
+  }
+  if((status->width != frame->width) || (status->height != frame->height))
+    return(IO_ERROR_SIZE);
+
+  framebytes = ((size_t) frame->width)*frame->height*(status->depth / 8);
+
+  if(status->depth == 32) {
+    data = reserve_buffer(&(status->buffer), framebytes);
+    pack_float(frame, (float*) data);
+  }else {
+    if(!status->raw.allocated)
+      allocate_raw(frame->width, frame->height, status->depth, 1, &(status->raw));
+    /* Y4M is little-endian, raw frames native */
+    pack_grey(frame, &(status->raw),
+	      (status->format == STREAM_Y4M) ? 0 : stream_bigendian());
+    data = status->raw.data[0];
+  }
+
+  if(status->format == STREAM_Y4M) {
+    if(fputs("FRAME\n", status->fd) == EOF)
+      return(IO_ERROR_WRITE);
+  }else {
+    memset(&header, 0, sizeof(STREAM_header));
+    memcpy(header.magic, STREAM_MAGIC, 4);
+    header.width = frame->width;
+    header.height = frame->height;
+    header.depth = status->depth;
+    header.number = frame->number;
+    header.time = frame->time;
+    if(fwrite(&header, sizeof(STREAM_header), 1, status->fd) != 1)
+      return(IO_ERROR_WRITE);
+  }
+
+  if(fwrite(data, framebytes, 1, status->fd) != 1)
+    return(IO_ERROR_WRITE);
+
+  /* Pass each frame on as soon as it's ready */
+  if(fflush(status->fd))
+    return(IO_ERROR_WRITE);
+
+  status->next++;
+  return(0);
+}
+
+int STREAM_write_close(STREAM_status *status)
+{
+  int errcode = 0;
+
+  if(fclose(status->fd))
+    errcode = IO_ERROR_WRITE;
+
+  free_raw(&(status->raw));
+  free(status->buffer.data);
+  status->buffer.data = NULL;
+  status->buffer.size = 0;
+
+  return(errcode);
+}
@@ -0,0 +1,62 @@
+/*********************************************************************
+ * Header for reading and writing frames as a stream on stdin/stdout
+ * (-i - and -o -). Two stream formats are supported:
+ *
+ * Raw frames: each frame is a STREAM_header followed by height rows
+ * of width pixels, uint8, uint16 or float32 in native byte order.
+ *
+ * YUV4MPEG2 (Y4M), as used by video encoders. Only the luma (Y) plane
+ * is used. Written as 8-bit (Cmono) or 16-bit (Cmono16) greyscale.
+ *********************************************************************/
+
+#ifndef __IO_STREAM_H__
+#define __IO_STREAM_H__ 1
+
+#include <stdio.h>
+
+#include "spiceweasel.h"
+
+#define STREAM_RAW 0
+#define STREAM_Y4M 1
+
+#define STREAM_MAGIC "SWFR"
+
+/* Header before each raw frame. Native byte order */
+typedef struct {
+  char   magic[4];   /* "SWFR" */
+  int    width;
+  int    height;
+  int    depth;      /* 8 or 16 bit unsigned, or 32 for float */
+  int    number;     /* Frame number */
+  int    reserved;
+  double time;       /* Frame time */
+}STREAM_header;      /* 32 bytes */
+
+/* Status data for stream read/write */
+typedef struct {
+  FILE *fd;
+  int format;        /* STREAM_RAW or STREAM_Y4M */
+  int width, height;
+  int depth;         /* Bits per pixel: 8, 16 or 32 (float) */
+  int maxval;        /* Largest integer value (for Y4M 10 or 12-bit) */
+  int chroma;        /* Bytes of chroma after each Y4M frame */
+  int next;          /* Index of the next frame in the stream */
+  int step;          /* Frames between those read */
+  int pending;       /* Header for the next frame has been read */
+  STREAM_header header; /* Header of next raw frame */
+
+  TBuffer buffer;    /* One frame of data */
+  TRawFrame raw;     /* Packed frame when writing */
+}STREAM_status;
+
+/********* PROTOTYPES ************/
+
+int STREAM_read_open(FILE *fd, STREAM_status *status);
+int STREAM_read_frame(int fnr, TFrame *frame, STREAM_status *status);
+int STREAM_read_close(STREAM_status *status);
+
+int STREAM_write_open(FILE *fd, int format, int depth, STREAM_status *status);
+int STREAM_write_frame(TFrame *frame, STREAM_status *status);
+int STREAM_write_close(STREAM_status *status);
+
+#endif
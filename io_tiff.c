@@ -0,0 +1,411 @@
+/**************************************************************
+ *  MULTI-PAGE TIFF STACK I/O ROUTINES
+ *
+ *  Frames are written as pages of a single BigTIFF file (so stacks
+ *  can be larger than 4Gb), in strips of rows or in tiles, and
+ *  optionally compressed with LZW or zstd plus a predictor. Each
+ *  page has a description "spiceweasel frame=<n> time=<t>" giving
+ *  the frame number and time.
+ *
+ *  When reading, the offset of every page is found when the file is
+ *  opened, so frames can be read in any order. Only the strips or
+ *  tiles covering the region of interest are decoded. Colour images
+ *  only use the first sample.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io_tiff.h"
+
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
+
+#define TIFF_DESCRIPTION_LEN 128
+
+void TIFF_defaults(TIFF_options *options)
+{
+  options->compress = TIFF_COMPRESS_NONE;
+  options->tilew = options->tileh = 0;
+}
+
+/* Set an option from the command line (--tiff-<name> <value>). Returns
+   non-zero if not recognised or not valid */
+int TIFF_set(TIFF_options *options, char *name, char *value)
+{
+  if(strcasecmp(name, "compress") == 0) {
+    if(strcasecmp(value, "none") == 0) {
+      options->compress = TIFF_COMPRESS_NONE;
+    }else if(strcasecmp(value, "lzw") == 0) {
+      options->compress = TIFF_COMPRESS_LZW;
+    }else if(strcasecmp(value, "zstd") == 0) {
+#ifdef HAVE_LIBTIFF
+      if(!TIFFIsCODECConfigured(COMPRESSION_ZSTD))
+	return(1); /* libtiff built without zstd */
+#endif
+      options->compress = TIFF_COMPRESS_ZSTD;
+    }else
+      return(1);
+  }else if(strcasecmp(name, "tile") == 0) {
+    /* Tile sizes must be multiples of 16 */
+    if((sscanf(value, "%dx%d", &(options->tilew), &(options->tileh)) != 2) ||
+       (options->tilew < 16) || (options->tileh < 16) ||
+       (options->tilew % 16) || (options->tileh % 16))
+      return(1);
+  }else {
+    return(1);
+  }
+  return(0);
+}
+
+#ifdef HAVE_LIBTIFF
+
+static int tiff_bigendian()
+{
+  short one = 1;
+  return(*((char*) &one) == 0);
+}
+
+/***************************** READING ********************************/
+
+int TIFF_read_open(char *filename, TIFF_status *status)
+{
+  uint32_t w, h, subfile;
+  int nmax;
+
+  status->count = 0;
+  status->pages = NULL;
+  status->buffer.data = status->tile.data = NULL;
+  status->buffer.size = status->tile.size = 0;
+
+  /* Don't print warnings about unknown tags etc. */
+  TIFFSetWarningHandler(NULL);
+
+  if((status->tif = TIFFOpen(filename, "r")) == NULL)
+    return(IO_ERROR_OPEN);
+
+  /* Find the offset of every page, skipping thumbnails */
+  nmax = 0;
+  do {
+    if(TIFFGetField(status->tif, TIFFTAG_SUBFILETYPE, &subfile) && (subfile & FILETYPE_REDUCEDIMAGE))
+      continue;
+    if(status->count == nmax) {
+      nmax = 2*nmax + 64;
+      status->pages = (unsigned long long*) realloc(status->pages,
+						    sizeof(unsigned long long)*nmax);
+    }
+    status->pages[status->count++] = TIFFCurrentDirOffset(status->tif);
+  }while(TIFFReadDirectory(status->tif));
+
+  if((status->count == 0) || !TIFFSetSubDirectory(status->tif, status->pages[0])) {
+    TIFF_read_close(status);
+    return(IO_ERROR_FORMAT);
+  }
+
+  /* Size of the first page. Others must be the same */
+  TIFFGetField(status->tif, TIFFTAG_IMAGEWIDTH, &w);
+  TIFFGetField(status->tif, TIFFTAG_IMAGELENGTH, &h);
+  status->width = w;
+  status->height = h;
+
+  return(0);
+}
+
+int TIFF_read_frame(int fnr, TFrame *frame, TIFF_status *status)
+{
+  TIFF *tif = status->tif;
+  uint32_t w32, h32, tw, th, rps;
+  uint16_t bits, samples, format, planar;
+  int x0, y0, w, h, ya, yb, xa, xb, tx, ty, j;
+  int type, stride, pixbytes;
+  long pitch;
+  float factor;
+  unsigned char *buf, *band, *tile;
+  char *desc, *p;
+
+  if((fnr < 0) || (fnr >= status->count))
+    return(IO_ERROR_OTHER);
+
+  if(!TIFFSetSubDirectory(tif, status->pages[fnr]))
+    return(IO_ERROR_FORMAT);
+
+  TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w32);
+  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h32);
+  if((w32 != status->width) || (h32 != status->height))
+    return(IO_ERROR_SIZE);
+
+  TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+  TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+  TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &format);
+  TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+
+  /* libtiff decodes into native byte order */
+  if((bits == 8) && (format == SAMPLEFORMAT_UINT)) {
+    type = CONVERT_UINT8;
+    factor = 255.0;
+  }else if((bits == 16) && (format == SAMPLEFORMAT_UINT)) {
+    type = CONVERT_UINT16;
+    factor = 65535.0;
+  }else if((bits == 32) && (format == SAMPLEFORMAT_IEEEFP)) {
+    type = CONVERT_FLOAT;
+    factor = 1.0;
+  }else
+    return(IO_ERROR_FORMAT);
+
+  /* Only the first sample of colour images */
+  stride = (planar == PLANARCONFIG_CONTIG) ? samples : 1;
+  pixbytes = stride * bits / 8;
+
+  if(read_region(status->width, status->height, &x0, &y0, &w, &h))
+    return(IO_ERROR_REGION);
+
+  if(allocate_output(w, h, frame))
+    return(IO_ERROR_SIZE);
+
+  if(TIFFIsTiled(tif)) {
+    TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+    TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+
+    /* Decode a row of tiles into a band, then convert the band */
+    tile = (unsigned char*) reserve_buffer(&(status->tile), TIFFTileSize(tif));
+    pitch = ((long) w)*pixbytes;
+    band = (unsigned char*) reserve_buffer(&(status->buffer), pitch*th);
+
+    for(ty=(y0/th)*th;ty<y0+h;ty+=th) {
+      for(tx=(x0/tw)*tw;tx<x0+w;tx+=tw) {
+	if(TIFFReadEncodedTile(tif, TIFFComputeTile(tif, tx, ty, 0, 0), tile, -1) < 0)
+	  return(IO_ERROR_FORMAT);
+	/* Columns inside the region */
+	xa = (tx > x0) ? tx : x0;
+	xb = (tx + tw < x0 + w) ? tx + tw : x0 + w;
+	for(j=0;j<th;j++)
+	  memcpy(band + j*pitch + (xa - x0)*pixbytes,
+		 tile + (((long) j)*tw + xa - tx)*pixbytes, (xb - xa)*pixbytes);
+      }
+      ya = (ty > y0) ? ty : y0;
+      yb = (ty + th < y0 + h) ? ty + th : y0 + h;
+      convert_rows(band + (ya - ty)*pitch, pitch, type, stride,
+		   yb - ya, w, frame, ya - y0, factor);
+    }
+  }else {
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rps);
+    if(rps > status->height)
+      rps = status->height;
+
+    buf = (unsigned char*) reserve_buffer(&(status->buffer), TIFFStripSize(tif));
+    pitch = ((long) status->width)*pixbytes;
+
+    /* Only the strips covering the region */
+    for(ty=(y0/rps)*rps;ty<y0+h;ty+=rps) {
+      if(TIFFReadEncodedStrip(tif, TIFFComputeStrip(tif, ty, 0), buf, -1) < 0)
+	return(IO_ERROR_FORMAT);
+      ya = (ty > y0) ? ty : y0;
+      yb = (ty + (int) rps < y0 + h) ? ty + rps : y0 + h;
+      convert_rows(buf + (ya - ty)*pitch + x0*pixbytes, pitch, type, stride,
+		   yb - ya, w, frame, ya - y0, factor);
+    }
+  }
+
+  /* Frame time from the description */
+  frame->time = 0.0;
+  if(TIFFGetField(tif, TIFFTAG_IMAGEDESCRIPTION, &desc) &&
+     ((p = strstr(desc, "time=")) != NULL))
+    frame->time = atof(p+5);
+
+  return(0);
+}
+
+int TIFF_read_close(TIFF_status *status)
+{
+  TIFFClose(status->tif);
+  status->tif = NULL;
+
+  free(status->pages);
+  status->pages = NULL;
+  status->count = 0;
+  free(status->buffer.data);
+  free(status->tile.data);
+  status->buffer.data = status->tile.data = NULL;
+  status->buffer.size = status->tile.size = 0;
+
+  return(0);
+}
+
+/***************************** WRITING ********************************/
+
+int TIFF_write_open(char *filename, int depth, TIFF_options *options, TIFF_status *status)
+{
+  if((depth != 8) && (depth != 16) && (depth != 32))
+    return(IO_ERROR_FORMAT);
+
+  /* "8" makes a BigTIFF file */
+  if((status->tif = TIFFOpen(filename, "w8")) == NULL)
+    return(IO_ERROR_OPEN);
+
+  status->width = status->height = 0;
+  status->count = 0;
+  status->depth = depth;
+  status->options = *options;
+  status->pages = NULL;
+  status->buffer.data = status->tile.data = NULL;
+  status->buffer.size = status->tile.size = 0;
+  status->raw.allocated = 0;
+  status->rows = NULL;
+
+  return(0);
+}
+
+/* Append a frame as a new page */
+int TIFF_write_frame(TFrame *frame, TIFF_status *status)
+{
+  TIFF *tif = status->tif;
+  TIFF_options *opt = &(status->options);
+  char desc[TIFF_DESCRIPTION_LEN];
+  unsigned char *data, *tile;
+  long pitch, tilebytes;
+  uint32_t rps = 0;
+  int bytes, x, y, n, j;
+
+  if(status->count == 0) {
+    status->width = frame->width;
+    status->height = frame->height;
+  }
+  if((status->width != frame->width) || (status->height != frame->height))
+    return(IO_ERROR_SIZE);
+
+  TIFFSetField(tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+  TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, status->width);
+  TIFFSetField(tif, TIFFTAG_IMAGELENGTH, status->height);
+  TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, status->depth);
+  TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT,
+	       (status->depth == 32) ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT);
+  TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+  if(opt->compress == TIFF_COMPRESS_NONE) {
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  }else {
+    TIFFSetField(tif, TIFFTAG_COMPRESSION,
+		 (opt->compress == TIFF_COMPRESS_ZSTD) ? COMPRESSION_ZSTD : COMPRESSION_LZW);
+    /* Differences between neighbouring pixels compress better */
+    TIFFSetField(tif, TIFFTAG_PREDICTOR,
+		 (status->depth == 32) ? PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL);
+  }
+
+  /* Total number of pages isn't known yet */
+  TIFFSetField(tif, TIFFTAG_PAGENUMBER, status->count, 0);
+  sprintf(desc, "spiceweasel frame=%d time=%.9g", frame->number, frame->time);
+  TIFFSetField(tif, TIFFTAG_IMAGEDESCRIPTION, desc);
+  TIFFSetField(tif, TIFFTAG_SOFTWARE, "spiceweasel " VERSION);
+
+  if(opt->tilew > 0) {
+    TIFFSetField(tif, TIFFTAG_TILEWIDTH, opt->tilew);
+    TIFFSetField(tif, TIFFTAG_TILELENGTH, opt->tileh);
+  }else {
+    rps = TIFFDefaultStripSize(tif, 0);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rps);
+  }
+
+  /* Pack into rows in native byte order */
+  bytes = status->depth / 8;
+  if(status->depth == 32) {
+    if(status->rows == NULL)
+      status->rows = (float*) malloc(sizeof(float)*frame->width*frame->height);
+    pack_float(frame, status->rows);
+    data = (unsigned char*) status->rows;
+  }else {
+    if(!status->raw.allocated)
+      allocate_raw(frame->width, frame->height, status->depth, 1, &(status->raw));
+    pack_grey(frame, &(status->raw), tiff_bigendian());
+    data = status->raw.data[0];
+  }
+  pitch = ((long) status->width)*bytes;
+
+  if(opt->tilew > 0) {
+    /* Copy each tile out of the frame. Edge tiles are padded with zeros */
+    tilebytes = ((long) opt->tilew)*opt->tileh*bytes;
+    tile = (unsigned char*) reserve_buffer(&(status->tile), tilebytes);
+    for(y=0;y<status->height;y+=opt->tileh) {
+      for(x=0;x<status->width;x+=opt->tilew) {
+	n = (x + opt->tilew < status->width) ? opt->tilew : status->width - x;
+	memset(tile, 0, tilebytes);
+	for(j=0;(j<opt->tileh) && (y+j<status->height);j++)
+	  memcpy(tile + ((long) j)*opt->tilew*bytes, data + (y+j)*pitch + x*bytes, n*bytes);
+	if(TIFFWriteEncodedTile(tif, TIFFComputeTile(tif, x, y, 0, 0), tile, tilebytes) < 0)
+	  return(IO_ERROR_WRITE);
+      }
+    }
+  }else {
+    /* Strips straight from the packed frame */
+    for(y=0;y<status->height;y+=rps) {
+      n = (y + (int) rps < status->height) ? rps : status->height - y;
+      if(TIFFWriteEncodedStrip(tif, TIFFComputeStrip(tif, y, 0), data + y*pitch, n*pitch) < 0)
+	return(IO_ERROR_WRITE);
+    }
+  }
+
+  if(!TIFFWriteDirectory(tif))
+    return(IO_ERROR_WRITE);
+
+  status->count++;
+  return(0);
+}
+
+int TIFF_write_close(TIFF_status *status)
+{
+  int errcode = 0;
+
+  if(!TIFFFlush(status->tif))
+    errcode = IO_ERROR_WRITE;
+  TIFFClose(status->tif);
+  status->tif = NULL;
+
+  free_raw(&(status->raw));
+  if(status->rows != NULL)
+    free(status->rows);
+  status->rows = NULL;
+  free(status->tile.data);
+  status->tile.data = NULL;
+  status->tile.size = 0;
+
+  return(errcode);
+}
+
+#else /* HAVE_LIBTIFF */
+
+/* Built without the TIFF library */
+
+int TIFF_read_open(char *filename, TIFF_status *status)
+{
+  return(IO_ERROR_FORMAT);
+}
+
+int TIFF_read_frame(int fnr, TFrame *frame, TIFF_status *status)
+{
+  return(IO_ERROR_FORMAT);
+}
+
+int TIFF_read_close(TIFF_status *status)
+{
+  return(0);
+}
+
+int TIFF_write_open(char *filename, int depth, TIFF_options *options, TIFF_status *status)
+{
+  return(IO_ERROR_FORMAT);
+}
+
+int TIFF_write_frame(TFrame *frame, TIFF_status *status)
+{
+  return(IO_ERROR_FORMAT);
+}
+
+int TIFF_write_close(TIFF_status *status)
+{
+  return(0);
+}
+
+#endif /* HAVE_LIBTIFF */
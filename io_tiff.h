@@ -0,0 +1,65 @@
+/*********************************************************************
+ * Header for multi-page TIFF stack read/writing. Each frame is one
+ * page of a BigTIFF file, as 8 or 16-bit unsigned integers or 32-bit
+ * floats, so the whole sequence can be opened by image-analysis
+ * programs such as ImageJ. Frame times go in the page descriptions.
+ *********************************************************************/
+
+#ifndef __IO_TIFF_H__
+#define __IO_TIFF_H__ 1
+
+#include "spiceweasel.h"
+
+/* Compression of pages when writing */
+#define TIFF_COMPRESS_UNKNOWN -1
+#define TIFF_COMPRESS_NONE     0
+#define TIFF_COMPRESS_LZW      1  /* With a predictor, lossless */
+#define TIFF_COMPRESS_ZSTD     2  /* With a predictor, if libtiff supports it */
+
+/* TIFF encoding options */
+typedef struct {
+  int compress;      /* One of the TIFF_COMPRESS values */
+  int tilew, tileh;  /* Tile size. 0 for strips of rows */
+}TIFF_options;
+
+/* Status data for tiff read/write */
+typedef struct {
+  struct tiff *tif;  /* libtiff handle */
+  int width, height;
+  int count;         /* Number of pages (frames) */
+  int depth;         /* 8 or 16 bit unsigned, or 32 for float */
+  unsigned long long *pages; /* Offset of each page, for random access */
+  TIFF_options options;
+
+  TBuffer buffer;    /* Strip or band of tiles */
+  TBuffer tile;      /* One tile */
+  TRawFrame raw;     /* Packed integer frame when writing */
+  float *rows;       /* Float frame in rows when writing */
+}TIFF_status;
+
+/********* PROTOTYPES ************/
+
+void TIFF_defaults(TIFF_options *options);
+int TIFF_set(TIFF_options *options, char *name, char *value);
+
+int TIFF_read_open(char *filename, TIFF_status *status);
+int TIFF_read_frame(int fnr, TFrame *frame, TIFF_status *status);
+int TIFF_read_close(TIFF_status *status);
+
+int TIFF_write_open(char *filename, int depth, TIFF_options *options, TIFF_status *status);
+int TIFF_write_frame(TFrame *frame, TIFF_status *status);
+int TIFF_write_close(TIFF_status *status);
+
+/************ GLOBAL VARIABLES **************/
+
+#ifndef TIFFGLOBALORIGIN
+#define GLOBAL extern
+#else
+#define GLOBAL
+#endif
+
+GLOBAL TIFF_status tiff_read_status; /* tiff input file */
+
+#undef GLOBAL
+
+#endif
@@ -30,8 +30,10 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <math.h>
 #include "spiceweasel.h"
+#include "script.h"
 
 int allocate_output(int width, int height, TFrame *output)
 {
@@ -128,6 +130,105 @@ int minimum_frames(TFrame **framebuffer, int nframes, TFrame *output, int width)
   return(0);
 }
 
+/* Backgrounds over a window of half frames either side of the centre
+   of the circular buffer. The window moves on by one frame each call,
+   so only the newest frame is added. The oldest frame has been
+   replaced in the buffer by the next call, so it is taken out at the
+   end of each call instead. If start is set the whole window is read */
+
+#define WINDOW_FRAME(k) framebuffer[(centreframe + (k) + nframes) % nframes]
+
+/* Running average, using a sum of the window in double precision.
+   Only the region x0, y0, width, height of the frames is used */
+int window_average(TFrame **framebuffer, int nframes, int centreframe, int half,
+		   int x0, int y0, int width, int height,
+		   double *sum, int start, TFrame *output)
+{
+  int i, j, f;
+  double scale, *s;
+  float *ptr;
+
+  clip_region(WINDOW_FRAME(0)->width, WINDOW_FRAME(0)->height, &x0, &y0, &width, &height);
+
+  if(allocate_output(width, height, output)) {
+    return(1);
+  }
+
+  for(i=0;i<width;i++) {
+    s = sum + i*height;
+    if(start) {
+      for(j=0;j<height;j++)
+	s[j] = 0.0;
+      for(f=-half;f<half;f++) {
+	ptr = WINDOW_FRAME(f)->data[i+x0] + y0;
+	for(j=0;j<height;j++)
+	  s[j] += ptr[j];
+      }
+    }
+    /* Add the newest frame */
+    ptr = WINDOW_FRAME(half)->data[i+x0] + y0;
+    for(j=0;j<height;j++)
+      s[j] += ptr[j];
+  }
+
+  scale = 1.0 / ((double) (2*half + 1));
+  for(i=0;i<width;i++) {
+    s = sum + i*height;
+    for(j=0;j<height;j++)
+      output->data[i][j] = s[j] * scale;
+    /* Take out the oldest frame */
+    ptr = WINDOW_FRAME(-half)->data[i+x0] + y0;
+    for(j=0;j<height;j++)
+      s[j] -= ptr[j];
+  }
+  return(0);
+}
+
+/* Running minimum. The minimum only goes down as frames are added, so
+   is only found again where the frame leaving the window held it.
+   Those pixels are marked in rescan. output must keep its values
+   between calls. Only the region x0, y0, width, height is used */
+int window_minimum(TFrame **framebuffer, int nframes, int centreframe, int half,
+		   int x0, int y0, int width, int height,
+		   char *rescan, int start, TFrame *output)
+{
+  int i, j, f, k;
+  float v, *newest, *oldest;
+  char *r;
+
+  clip_region(WINDOW_FRAME(0)->width, WINDOW_FRAME(0)->height, &x0, &y0, &width, &height);
+
+  if(allocate_output(width, height, output)) {
+    return(1);
+  }
+
+  for(i=0;i<width;i++) {
+    r = rescan + i*height;
+    newest = WINDOW_FRAME(half)->data[i+x0] + y0;
+    oldest = WINDOW_FRAME(-half)->data[i+x0] + y0;
+    for(j=0;j<height;j++) {
+      if(start || r[j]) {
+	v = oldest[j];
+	k = (centreframe - half + nframes) % nframes;
+	for(f=1;f<=2*half;f++) {
+	  if(++k == nframes)
+	    k = 0;
+	  if(framebuffer[k]->data[i+x0][j+y0] < v)
+	    v = framebuffer[k]->data[i+x0][j+y0];
+	}
+      }else {
+	v = output->data[i][j];
+	if(newest[j] < v)
+	  v = newest[j];
+      }
+      output->data[i][j] = v;
+      /* Find it again next time if the minimum leaves the window */
+      r[j] = (oldest[j] <= v);
+    }
+  }
+  return(0);
+}
+
 float *median_buffer;
 int median_allocated = 0;
 
@@ -377,6 +478,239 @@ int offset_frame(TFrame *input, TFrame *output, float midpoint)
   return(0);
 }
 
+/* Evaluate a compiled expression (EXPR). list[0] is the input of the
+   step and list[k+1] frame argument k. The operations are run on a
+   block of a column at a time, so each frame is read once and the
+   result written once, and the loops over a block vectorise */
+#define EXPR_BLOCK 256
+
+int expr_frame(TFrame **list, int nframes, TProcArg *code, int ncode, TFrame *output)
+{
+  float stack[EXPR_STACK][EXPR_BLOCK];
+  float *top[EXPR_STACK]; /* Values, either in the stack or in a frame */
+  float *a, *b, *c, *d, v;
+  int width, height;
+  int i, j, k, n, op, sp;
+
+  width = list[0]->width;
+  height = list[0]->height;
+  for(k=1;k<=nframes;k++) {
+    if(list[k]->width < width)
+      width = list[k]->width;
+    if(list[k]->height < height)
+      height = list[k]->height;
+  }
+
+  if(allocate_output(width, height, output)) {
+    return(1);
+  }
+
+  for(i=0;i<width;i++) {
+    for(j=0;j<height;j+=EXPR_BLOCK) {
+      n = height - j;
+      if(n > EXPR_BLOCK)
+	n = EXPR_BLOCK;
+      sp = 0;
+      for(op=0;op<ncode;op++) {
+	switch(code[op].ival) {
+	case EXPR_CONST: {
+	  d = top[sp] = stack[sp];
+	  v = code[op].fval;
+	  for(k=0;k<n;k++)
+	    d[k] = v;
+	  sp++;
+	  break;
+	}
+	case EXPR_INPUT: {
+	  top[sp++] = list[0]->data[i] + j;
+	  break;
+	}
+	case EXPR_FRAME: {
+	  top[sp++] = list[code[op].frame+1]->data[i] + j;
+	  break;
+	}
+	case EXPR_NEG: {
+	  a = top[sp-1];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = -a[k];
+	  break;
+	}
+	case EXPR_ABS: {
+	  a = top[sp-1];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = fabsf(a[k]);
+	  break;
+	}
+	case EXPR_LOG: {
+	  a = top[sp-1];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = logf(a[k]);
+	  break;
+	}
+	case EXPR_EXP: {
+	  a = top[sp-1];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = expf(a[k]);
+	  break;
+	}
+	case EXPR_ADD: {
+	  sp--;
+	  a = top[sp-1]; b = top[sp];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = a[k] + b[k];
+	  break;
+	}
+	case EXPR_SUB: {
+	  sp--;
+	  a = top[sp-1]; b = top[sp];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = a[k] - b[k];
+	  break;
+	}
+	case EXPR_MUL: {
+	  sp--;
+	  a = top[sp-1]; b = top[sp];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = a[k] * b[k];
+	  break;
+	}
+	case EXPR_DIV: {
+	  sp--;
+	  a = top[sp-1]; b = top[sp];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = a[k] / b[k];
+	  break;
+	}
+	case EXPR_MIN: {
+	  sp--;
+	  a = top[sp-1]; b = top[sp];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = (b[k] < a[k]) ? b[k] : a[k];
+	  break;
+	}
+	case EXPR_MAX: {
+	  sp--;
+	  a = top[sp-1]; b = top[sp];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = (b[k] > a[k]) ? b[k] : a[k];
+	  break;
+	}
+	case EXPR_POW: {
+	  sp--;
+	  a = top[sp-1]; b = top[sp];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++)
+	    d[k] = powf(a[k], b[k]);
+	  break;
+	}
+	case EXPR_CLAMP: {
+	  sp -= 2;
+	  a = top[sp-1]; b = top[sp]; c = top[sp+1];
+	  d = top[sp-1] = stack[sp-1];
+	  for(k=0;k<n;k++) {
+	    v = (a[k] > b[k]) ? a[k] : b[k];
+	    d[k] = (v < c[k]) ? v : c[k];
+	  }
+	  break;
+	}
+	}
+      }
+      /* Result may already be in the output (e.g. EXPR X) */
+      if(top[0] != output->data[i] + j)
+	memmove(output->data[i] + j, top[0], sizeof(float)*n);
+    }
+  }
+  return(0);
+}
+
+/* Keep a region inside a width by height frame. A width or height of
+   zero (or too large) goes to the edge. At least one pixel is kept */
+void clip_region(int width, int height, int *x, int *y, int *w, int *h)
+{
+  if(*x >= width)
+    *x = width - 1;
+  if(*x < 0)
+    *x = 0;
+  if(*y >= height)
+    *y = height - 1;
+  if(*y < 0)
+    *y = 0;
+  if((*w <= 0) || (*x + *w > width))
+    *w = width - *x;
+  if((*h <= 0) || (*y + *h > height))
+    *h = height - *y;
+}
+
+/* Cut out a region of a frame */
+int crop_frame(TFrame *input, TFrame *output, int x, int y, int w, int h)
+{
+  int i;
+
+  clip_region(input->width, input->height, &x, &y, &w, &h);
+
+  if(allocate_output(w, h, output)) {
+    return(1);
+  }
+
+  for(i=0;i<w;i++)
+    memcpy(output->data[i], input->data[i+x] + y, sizeof(float)*h);
+  return(0);
+}
+
+/* Add up (sum) or average n by n blocks of pixels. Pixels left over
+   at the right and bottom are dropped */
+int bin_frame(TFrame *input, TFrame *output, int n, int sum)
+{
+  int width, height;
+  int i, j, k, l;
+  float scale, *out, *in;
+
+  if(n < 1)
+    n = 1;
+  width = input->width / n;
+  height = input->height / n;
+  if(width < 1)
+    width = 1;
+  if(height < 1)
+    height = 1;
+  if(n > input->width)
+    n = input->width;
+  if(n > input->height)
+    n = input->height;
+
+  if(allocate_output(width, height, output)) {
+    return(1);
+  }
+
+  scale = sum ? 1.0 : 1.0 / ((float) (n*n));
+  for(i=0;i<width;i++) {
+    out = output->data[i];
+    for(j=0;j<height;j++)
+      out[j] = 0.0;
+    /* Add columns of the block, then rows */
+    for(k=0;k<n;k++) {
+      in = input->data[i*n + k];
+      for(j=0;j<height;j++) {
+	for(l=0;l<n;l++)
+	  out[j] += in[j*n + l];
+      }
+    }
+    for(j=0;j<height;j++)
+      out[j] *= scale;
+  }
+  return(0);
+}
+
 /************************ SMOOTHING ALGORITHMS *******************/
 
 // Use a median filter to despeckle an image
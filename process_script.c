@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 
 #include "spiceweasel.h"
 #define SPSORIGIN 1
@@ -63,10 +64,28 @@ typedef struct {
   /* Flags used when resolving/"compiling" script */
   int resolving;
   int calculated;
+
+  /* Where a named output is written (WRITE) */
+  char *file;
+  int depth;
 }TTarget;
 
+/* An argument given several values, e.g. {1,2,4}. The script is
+   compiled once for each combination of values (variant) */
+typedef struct {
+  int n;      /* Number of values */
+  float *val;
+  int cur;    /* Value used in the variant being compiled */
+}TSweep;
+
+#define MAX_VARIANTS 256
+
 int parse_script(FILE *script);
 int resolve_script();
+void optimise_script(TCommands *cmd);
+void crop_backgrounds(TCommands *cmd);
+void share_frames(TCommands *cmd);
+void find_dependencies(TCommands *cmd);
 void dummy_script(TCommands *cmd);
 
 /* Utility routines (at end of file) */
@@ -77,13 +96,19 @@ int add_arg(TProcess *process);                     /* Add an argument to a proc
 int add_framearg(TProcess *process, char *name);    /* Add a frame argument */
 int add_floatarg(TProcess *process, char *arg);     /* Add a float argument */
 int add_intarg(TProcess *proces, char *arg);        /* Add an integer argument */
+int add_sweep(char *arg);                           /* Add a list or range of values */
+int add_expr(TProcess *process, TTarget *targ, char *expr, int linenr); /* Compile an expression */
 int add_process(TCommands *cmd, int nargs); /* Add a processing step to a command list */
+int add_background(int method, int width);  /* Find or add a background frame */
 int append_processes(TCommands *cmd, int nproc, TProcess **proc);
 
 /***** GLOBAL VARIABLES ******/
 /* List of defined targets */
 TTarget **target;
 int ntargets;
+/* Arguments with several values */
+TSweep *sweep;
+int nsweeps;
 
 /* Open a processing script */
 int process_script(char *exe_cmd, char *file)
@@ -251,10 +276,12 @@ int parse_script(FILE *script)
   TProcess **tmpproc;
 
   int nprocargs;
-  char **procarg;
+  char **procarg = (char**) NULL;
+  char *end;
 
   curtarget = (TTarget*) NULL;
   ntargets = 0;
+  nsweeps = 0;
   next_id = 0;
   got_output = 0;
 
@@ -293,6 +320,8 @@ int parse_script(FILE *script)
       ntargets++;
 
       curtarget->nprocess = 0;
+      curtarget->file = (char*) NULL;
+      curtarget->depth = 0;
 
       /* Get name of target */
       buffer[p] = 0; /* Terminate at colon */
@@ -327,7 +356,10 @@ int parse_script(FILE *script)
 
       }else if( (strcmp(buffer, "MINIMUM") == 0) ||
 		(strcmp(buffer, "AVERAGE") == 0) ||
-		(strcmp(buffer, "INPUT") == 0) ) {
+		(strcmp(buffer, "INPUT") == 0) ||
+		(strncmp(buffer, "INPUT[", 6) == 0) ||
+		(strncmp(buffer, "MINIMUM(", 8) == 0) ||
+		(strncmp(buffer, "AVERAGE(", 8) == 0) ) {
 	/* These are reserved frame names - cannot have a target called this */
 	printf("Error line %d: Cannot use %s as a target - it is a predefined frame\n", linenr, buffer);
 	return(1);
@@ -415,6 +447,29 @@ int parse_script(FILE *script)
       }
       /* buffer now contains command, str contains arguments */
 
+      if(strcmp(buffer, "WRITE") == 0) {
+	/* File for a named output. Quotes keep the case */
+	if(strncmp(curtarget->name, "OUTPUT.", 7) != 0) {
+	  printf("Error line %d: Write is only used in OUTPUT.<name> targets\n", linenr);
+	  return(1);
+	}
+	if(((str[0] != '"') && (str[0] != '\'')) || ((end = strchr(str+1, str[0])) == NULL)) {
+	  printf("Error line %d: Write takes a file name in quotes\n", linenr);
+	  return(1);
+	}
+	*end = 0;
+	curtarget->file = (char*) malloc(strlen(str+1)+1);
+	strcpy(curtarget->file, str+1);
+	end++;
+	if((end[strspn(end, " ")] != 0) &&
+	   ((sscanf(end, "%d", &(curtarget->depth)) != 1) ||
+	    ((curtarget->depth != 8) && (curtarget->depth != 16) && (curtarget->depth != 32)))) {
+	  printf("Error line %d: Bits per pixel for write are 8, 16 or 32\n", linenr);
+	  return(1);
+	}
+	continue;
+      }
+
       /* Add a processing step to the current target */
       tmpproc = curtarget->process;
       curtarget->process = (TProcess**) malloc(sizeof(TProcess*)*(curtarget->nprocess + 1));
@@ -448,14 +503,14 @@ int parse_script(FILE *script)
 	procarg = (char**) malloc(sizeof(char*)*(nprocargs+1));
 	procarg[0] = (char*) malloc(strlen(str)+1);
 	strcpy(procarg[0], str);
-	p = 1;
+	p = 0;
 	q = 0;
 	for(i=0;i<strlen(str);i++) {
 	  if(isspace(str[i]) == 0) {
-	    /* Not a space */
+	    /* Not a space: start of the next argument */
 	    if(q == 0) {
 	      q = 1;
-	      procarg[p] = &(procarg[0][i]);
+	      procarg[p++] = &(procarg[0][i]);
 	    }
 	  }else {
 	    q = 0;
@@ -568,6 +623,48 @@ int parse_script(FILE *script)
 	  printf("Error line %d: Second argument to unsharp_mask is a floating point number\n", linenr);
 	  return(1);
 	}
+      }else if(strcmp(buffer, "EXPR") == 0) {
+	curproc->method = PROC_EXPR;
+	if(nprocargs == 0) {
+	  printf("Error line %d: Expr needs an expression\n", linenr);
+	  return(1);
+	}
+	/* Spaces don't separate arguments here: use the whole string */
+	if(add_expr(curproc, curtarget, str, linenr))
+	  return(1);
+      }else if(strcmp(buffer, "CROP") == 0) {
+	curproc->method = PROC_CROP;
+	/* Corner, width and height. 0 goes to the edge of the frame */
+	if(nprocargs != 4) {
+	  printf("Error line %d: Crop has 4 arguments (x y width height)\n", linenr);
+	  return(1);
+	}
+	for(i=0;i<4;i++) {
+	  if(add_intarg(curproc, procarg[i]) || (curproc->args[i].ival < 0)) {
+	    printf("Error line %d: Arguments to crop are integers, 0 or more\n", linenr);
+	    return(1);
+	  }
+	}
+      }else if(strcmp(buffer, "BIN") == 0) {
+	curproc->method = PROC_BIN;
+	/* Block size, then whether to add up the pixels or average them */
+	if((nprocargs < 1) || (nprocargs > 2)) {
+	  printf("Error line %d: Bin has one or two arguments\n", linenr);
+	  return(1);
+	}
+	if(add_intarg(curproc, procarg[0]) || (curproc->args[0].ival < 1)) {
+	  printf("Error line %d: First argument to bin is an integer, 1 or more\n", linenr);
+	  return(1);
+	}
+	p = add_arg(curproc);
+	if(nprocargs == 2) {
+	  if(strcmp(procarg[1], "SUM") == 0)
+	    curproc->args[p].ival = 1;
+	  else if(strcmp(procarg[1], "MEAN") != 0) {
+	    printf("Error line %d: Second argument to bin is SUM or MEAN\n", linenr);
+	    return(1);
+	  }
+	}
       }else if(strcmp(buffer, "GAUSS_BLUR") == 0) {
 	curproc->method = PROC_GAUSSBLUR;
 	if(nprocargs != 1) {
@@ -596,43 +693,151 @@ int parse_script(FILE *script)
  **************************************************************/
 
 int resolve_script_rec(char *name);
+static int frame_args(TProcess *proc);
 
-int resolve_script()
+/* Replace a frame with another in all the steps */
+static void replace_frame(int id, int new)
 {
   int i, j;
-  int n;
 
-  /* Clear flags in targets */
-  for(i=0;i<ntargets;i++) {
-    target[i]->resolving = 0;   /* 1 if currently being resolved (prevent loops) */
-    target[i]->calculated = UNKNOWN_FRAME; /* The ID of the frame for this target */
+  for(i=0;i<command.nsteps;i++) {
+    if(command.step[i].input == id)
+      command.step[i].input = new;
+    if(command.step[i].result == id)
+      command.step[i].result = new;
+    /* Go through arguments */
+    for(j=0;j<frame_args(&(command.step[i]));j++) {
+      if(command.step[i].args[j].frame == id) {
+	command.step[i].args[j].frame = new;
+      }
+    }
+  }
+}
+
+/* Mark the sweeps which a target uses, directly or through the
+   frames it depends on */
+static void target_sweeps(char *name, char *used)
+{
+  TTarget *targ;
+  int i, j;
+
+  for(i=0;(i<ntargets) && (strcmp(target[i]->name, name) != 0);i++);
+  if((i == ntargets) || target[i]->resolving)
+    return; /* Pre-defined frame, or already done */
+  targ = target[i];
+  targ->resolving = 1;
+  for(i=0;i<targ->nprocess;i++) {
+    for(j=0;j<targ->process[i]->nargs;j++) {
+      if(targ->process[i]->args[j].sweep >= 0)
+	used[targ->process[i]->args[j].sweep] = 1;
+    }
   }
+  for(i=0;i<targ->ndep;i++)
+    target_sweeps(targ->dep[i], used);
+}
+
+int resolve_script()
+{
+  int i, j, k, v;
+  int n, nvariants;
+  char *suffix, *used;
 
   command.ntemp = 0;      /* No intermediate frames */
-  command.minimum_frame = UNKNOWN_FRAME; /* No minimum frame */
-  command.average_frame = UNKNOWN_FRAME; /* No average frame */
+  command.nbackground = 0; /* No background frames */
+  command.background = (TBackground*) NULL;
   command.nsteps = 0;     /* No processing steps */
 
-  n = resolve_script_rec("OUTPUT"); /* Resolve the output target */
-
-  if((n != command.ntemp-1) || (n == UNKNOWN_FRAME)) { /* If worked properly, output should be last frame allocated */
-    printf("Could not compile script\n");
-    return(-1);
+  /* Each variant has OUTPUT and the named outputs, OUTPUT.<name> */
+  nvariants = 1;
+  for(i=0;i<nsweeps;i++) {
+    nvariants *= sweep[i].n;
+    if(nvariants > MAX_VARIANTS) {
+      printf("Error: Script has more than %d combinations of argument values\n", MAX_VARIANTS);
+      return(-1);
+    }
   }
-  /* Need to replace last frame with output in all commands */
-  for(i=0;i<command.nsteps;i++) {
-    if(command.step[i].input == n)
-      command.step[i].input = OUTPUT_FRAME;
-    if(command.step[i].result == n)
-      command.step[i].result = OUTPUT_FRAME;
-    /* Go through arguments */
-    for(j=0;j<command.step[i].nargs;j++) {
-      if(command.step[i].args[j].frame == n) {
-	command.step[i].args[j].frame = OUTPUT_FRAME;
+  command.noutputs = 0;
+  command.output = (TOutput*) malloc(sizeof(TOutput)*(ntargets+1)*nvariants);
+
+  used = (char*) malloc(nsweeps+1);
+
+  for(v=0;v<nvariants;v++) {
+    /* Pick the values for this variant, first sweep changing slowest */
+    k = v;
+    for(i=nsweeps-1;i>=0;i--) {
+      sweep[i].cur = k % sweep[i].n;
+      k /= sweep[i].n;
+    }
+    for(i=0;i<ntargets;i++)
+      target[i]->calculated = UNKNOWN_FRAME; /* The ID of the frame for this target */
+
+    /* OUTPUT is target[0], then the named outputs */
+    for(i=0;i<ntargets;i++) {
+      if((i > 0) && (strncmp(target[i]->name, "OUTPUT.", 7) != 0))
+	continue;
+
+      /* Only the sweeps an output uses give new variants of it */
+      for(j=0;j<ntargets;j++)
+	target[j]->resolving = 0;
+      memset(used, 0, nsweeps+1);
+      target_sweeps(target[i]->name, used);
+      suffix = (char*) NULL;
+      for(j=0;j<nsweeps;j++) {
+	if(!used[j] && (sweep[j].cur > 0))
+	  break;
+	if(!used[j])
+	  continue;
+	if(suffix == NULL) {
+	  suffix = (char*) malloc(16*nsweeps+1);
+	  suffix[0] = 0;
+	}
+	sprintf(suffix + strlen(suffix), "_%g", sweep[j].val[sweep[j].cur]);
       }
+      if(j < nsweeps) {
+	free(suffix);
+	continue; /* Same as an earlier variant */
+      }
+
+      for(j=0;j<ntargets;j++)
+	target[j]->resolving = 0;   /* 1 if currently being resolved (prevent loops) */
+
+      if((n = resolve_script_rec((i == 0) ? "OUTPUT" : target[i]->name)) == UNKNOWN_FRAME) {
+	printf("Could not compile script\n");
+	return(-1);
+      }
+      j = command.noutputs++;
+      if(j == 0) {
+	if(n != command.ntemp-1) { /* If worked properly, output should be last frame allocated */
+	  printf("Could not compile script\n");
+	  return(-1);
+	}
+	command.ntemp--; /* Don't need last intermediate frame */
+      }
+      /* Need to replace the frame with the output in all commands */
+      replace_frame(n, OUTPUT_ID(j));
+      target[i]->calculated = OUTPUT_ID(j);
+      command.output[j].name = (i > 0) ? target[i]->name + 7 : (char*) NULL;
+      command.output[j].file = target[i]->file;
+      command.output[j].depth = target[i]->depth;
+      command.output[j].suffix = suffix;
     }
   }
-  command.ntemp--; /* Don't need last intermediate frame */
+  free(used);
+  if(nvariants > 1)
+    printf("Script has %d combinations of argument values, giving %d outputs\n",
+	   nvariants, command.noutputs);
+
+  /* Only calculate backgrounds over the part of the input used */
+  crop_backgrounds(&command);
+
+  /* Remove repeated and unused steps */
+  optimise_script(&command);
+
+  /* Re-use intermediate frames once they are finished with */
+  share_frames(&command);
+
+  /* Find which steps can run at the same time */
+  find_dependencies(&command);
   return(0);
 }
 
@@ -651,22 +856,31 @@ int resolve_script_rec(char *name)
   if(strcmp(name, "INPUT") == 0) {
     /* Just the input frame */
     return(INPUT_FRAME);
-  }else if(strcmp(name, "MINIMUM") == 0) {
-    if(command.minimum_frame == UNKNOWN_FRAME) {
-      /* Calculate minimum and put into temporary frame */
-      command.minimum_frame = command.ntemp;
-      command.ntemp++;
-      //printf("Assigning minimum frame to %d\n", command.minimum_frame);
+  }else if(strncmp(name, "INPUT[", 6) == 0) {
+    /* A neighbouring frame in the buffer */
+    if((sscanf(name+6, "%d%n", &i, &p) != 1) || (strcmp(name+6+p, "]") != 0) ||
+       (i < -MAX_INPUT_OFFSET) || (i > MAX_INPUT_OFFSET)) {
+      printf("Error: %s should be INPUT[k], with k from %d to %d\n",
+	     name, -MAX_INPUT_OFFSET, MAX_INPUT_OFFSET);
+      return(UNKNOWN_FRAME);
     }
-
-    return(command.minimum_frame);
-  }else if(strcmp(name, "AVERAGE") == 0) {
-    if(command.average_frame == UNKNOWN_FRAME) {
-      /* Calculate average and put into temporary frame */
-      command.average_frame = command.ntemp;
-      command.ntemp++;
+    return(INPUT_OFFSET_FRAME(i));
+  }else if((strcmp(name, "MINIMUM") == 0) || (strcmp(name, "AVERAGE") == 0) ||
+	   (strncmp(name, "MINIMUM(", 8) == 0) || (strncmp(name, "AVERAGE(", 8) == 0)) {
+    /* Background over the whole buffer, or MINIMUM(n) over n frames */
+    i = 0;
+    if((name[7] != 0) &&
+       ((sscanf(name+7, "(%d%n", &i, &p) != 1) || (strcmp(name+7+p, ")") != 0) ||
+	(i < 1) || (i > 2*MAX_INPUT_OFFSET+1))) {
+      printf("Error: %s should be %.7s(n), with n from 1 to %d frames\n",
+	     name, name, 2*MAX_INPUT_OFFSET+1);
+      return(UNKNOWN_FRAME);
+    }
+    if((i > 0) && ((i & 1) == 0)) {
+      i++;
+      printf("---Background window must be odd: changing %s to %.7s(%d)\n", name, name, i);
     }
-    return(command.average_frame);
+    return(add_background((name[0] == 'M') ? BG_MINIMUM : BG_AVERAGE, i));
   }
 
   /* Find the name in the list of targets */
@@ -756,6 +970,15 @@ int resolve_script_rec(char *name)
     for(i=q;i<(curtarget->nprocess+q);i++) {
       curproc = &(command.step[i]);
 
+      /* Arguments with several values take the one for this variant */
+      for(j=0;j<curproc->nargs;j++) {
+	if((p = curproc->args[j].sweep) >= 0) {
+	  curproc->args[j].fval = sweep[p].val[sweep[p].cur];
+	  if(curproc->method != PROC_EXPR) /* There ival is the operation */
+	    curproc->args[j].ival = (int) floor(curproc->args[j].fval + 0.5);
+	}
+      }
+
       /* Set input and output */
       curproc->input = next_input;
       curproc->result = curtarget->calculated;
@@ -764,25 +987,26 @@ int resolve_script_rec(char *name)
       if(curproc->method == PROC_SUBTRACT) {
 	/* One argument - a frame */
 	curproc->args[0].frame = find_dependency(curtarget, curproc->args[0].name);
+      }else if(curproc->method == PROC_EXPR) {
+	/* The frames used in the expression */
+	for(j=0;j<frame_args(curproc);j++)
+	  curproc->args[j].frame = find_dependency(curtarget, curproc->args[j].name);
       }
 
       /* Some processing cannot have the same input as output - check array */
-      if(proc_noio[0] != PROC_NULL) { /* If there are any such commands */
-	j = 0;
-	do {
-	  if(curproc->method == proc_noio[j]) {
-	    /* This processing step is one of these
-	     * Check that the input and output are different */
-	    if(curproc->input == curproc->result) {
-	      /* Grab a new frame number */
-	      curproc->result = command.ntemp;
-	      command.ntemp++;
-	      curtarget->calculated = curproc->result; /* Change the target frame */
-	      //printf("Changed %s to frame %d\n", curtarget->name, curtarget->calculated);
-	    }
-	    j = -1;
+      for(j=0;proc_noio[j] != PROC_NULL;j++) {
+	if(curproc->method == proc_noio[j]) {
+	  /* This processing step is one of these
+	   * Check that the input and output are different */
+	  if(curproc->input == curproc->result) {
+	    /* Grab a new frame number */
+	    curproc->result = command.ntemp;
+	    command.ntemp++;
+	    curtarget->calculated = curproc->result; /* Change the target frame */
+	    //printf("Changed %s to frame %d\n", curtarget->name, curtarget->calculated);
 	  }
-	}while((proc_noio[j+1] != PROC_NULL) && (j > 0));
+	  break;
+	}
       }
 
       next_input = curproc->result; /* Set the next input to be the result of this step */
@@ -799,20 +1023,916 @@ int resolve_script_rec(char *name)
   return(UNKNOWN_FRAME); /* Should never reach here */
 }
 
+/*********************** SHARE FRAMES *************************
+ * Each target gets its own intermediate frame when compiled, *
+ * but most are only needed by a few steps. Frames which are  *
+ * never needed at the same time share a buffer.              *
+ **************************************************************/
+
+/* Number of arguments to a step which are frames. For expressions
+   these are the arguments with names, before the operations */
+static int frame_args(TProcess *proc)
+{
+  int j;
+
+  if(proc->method == PROC_CONCATENATE)
+    return(proc->nargs);
+  if(proc->method == PROC_SUBTRACT)
+    return(1);
+  if(proc->method == PROC_EXPR) {
+    for(j=0;(j<proc->nargs) && (proc->args[j].name != NULL);j++);
+    return(j);
+  }
+  return(0);
+}
+
+/* Check if a step can write its result over its input */
+static int in_place(TProcess *proc)
+{
+  int j;
+
+  if(proc->method == PROC_CONCATENATE)
+    return(0);
+  for(j=0;proc_noio[j] != PROC_NULL;j++) {
+    if(proc->method == proc_noio[j])
+      return(0);
+  }
+  return(1);
+}
+
+/* Check whether a step reads a frame */
+static int step_reads(TProcess *proc, int id)
+{
+  int j;
+
+  if((proc->method != PROC_CONCATENATE) && (proc->input == id))
+    return(1);
+  for(j=0;j<frame_args(proc);j++) {
+    if(proc->args[j].frame == id)
+      return(1);
+  }
+  return(0);
+}
+
+/* Index of a frame in a list of the frames and then the outputs, as
+   used for versions of frames and shapes */
+static int opt_slot(int id, int n)
+{
+  if(IS_OUTPUT_FRAME(id))
+    return(n + OUTPUT_NUMBER(id));
+  return(id);
+}
+
+/* Backgrounds which are only cropped need only be calculated over
+   the part of the input the crops use. The region of the background
+   is the box around all the crops, which then start from its corner.
+   Crops of the whole region become copies */
+void crop_backgrounds(TCommands *cmd)
+{
+  int i, j, x0, y0, x1, y1;
+  TBackground *bg;
+  TProcess *proc;
+
+  for(i=0;i<cmd->nbackground;i++) {
+    bg = &(cmd->background[i]);
+    x0 = y0 = -1;
+    x1 = y1 = 0; /* Right and bottom edges. -1 is the edge of the frame */
+    for(j=0;j<cmd->nsteps;j++) {
+      proc = &(cmd->step[j]);
+      if(!step_reads(proc, bg->frame))
+	continue;
+      if(proc->method != PROC_CROP)
+	break;
+      if((x0 < 0) || (proc->args[0].ival < x0))
+	x0 = proc->args[0].ival;
+      if((y0 < 0) || (proc->args[1].ival < y0))
+	y0 = proc->args[1].ival;
+      if((proc->args[2].ival == 0) || (x1 == -1))
+	x1 = -1;
+      else if(proc->args[0].ival + proc->args[2].ival > x1)
+	x1 = proc->args[0].ival + proc->args[2].ival;
+      if((proc->args[3].ival == 0) || (y1 == -1))
+	y1 = -1;
+      else if(proc->args[1].ival + proc->args[3].ival > y1)
+	y1 = proc->args[1].ival + proc->args[3].ival;
+    }
+    if((j < cmd->nsteps) || (x0 < 0))
+      continue; /* Used whole, or not at all */
+    if((x0 == 0) && (y0 == 0) && (x1 == -1) && (y1 == -1))
+      continue; /* Crops reach all the edges */
+
+    bg->x = x0;
+    bg->y = y0;
+    bg->w = (x1 > 0) ? x1 - x0 : 0;
+    bg->h = (y1 > 0) ? y1 - y0 : 0;
+    for(j=0;j<cmd->nsteps;j++) {
+      proc = &(cmd->step[j]);
+      if(!step_reads(proc, bg->frame))
+	continue;
+      proc->args[0].ival -= x0;
+      proc->args[1].ival -= y0;
+      if((proc->args[0].ival == 0) && (proc->args[1].ival == 0) &&
+	 (proc->args[2].ival == bg->w) && (proc->args[3].ival == bg->h)) {
+	proc->method = PROC_COPY;
+	proc->nargs = 0;
+      }
+    }
+  }
+}
+
+/* Shapes of frames. The size of the input isn't known when the
+   script is compiled, so a shape is the step which makes it from
+   other shapes: shape 0 is the input, then CROP and BIN of a shape,
+   CONCATENATE of two shapes, and SUBTRACT for the overlap of two
+   shapes (from SUBTRACT or EXPR of frames of different sizes).
+   Frames with the same shape always have the same size */
+typedef struct {
+  int method;   /* PROC_NULL for the input */
+  int a, b;     /* Shapes this is made from */
+  int p[4];     /* CROP region or BIN size */
+}TShape;
+
+static TShape *shape_list = (TShape*) NULL;
+static int nshapes = 0;
+
+/* Find a shape, adding it if it's new */
+static int add_shape(int method, int a, int b, int *p)
+{
+  TShape *tmp;
+  int i, j;
+
+  if(nshapes == 0) {
+    /* The input */
+    shape_list = (TShape*) calloc(1, sizeof(TShape));
+    shape_list[0].method = PROC_NULL;
+    shape_list[0].a = shape_list[0].b = -1;
+    nshapes = 1;
+  }
+  if((method == PROC_SUBTRACT) && (a > b)) {
+    /* The overlap is the same either way round */
+    i = a;
+    a = b;
+    b = i;
+  }
+  for(i=0;i<nshapes;i++) {
+    if((shape_list[i].method != method) || (shape_list[i].a != a) || (shape_list[i].b != b))
+      continue;
+    for(j=0;(j<4) && (shape_list[i].p[j] == ((p != NULL) ? p[j] : 0));j++);
+    if(j == 4)
+      return(i);
+  }
+
+  tmp = shape_list;
+  shape_list = (TShape*) malloc(sizeof(TShape)*(nshapes+1));
+  memcpy(shape_list, tmp, sizeof(TShape)*nshapes);
+  free(tmp);
+  shape_list[i].method = method;
+  shape_list[i].a = a;
+  shape_list[i].b = b;
+  for(j=0;j<4;j++)
+    shape_list[i].p[j] = (p != NULL) ? p[j] : 0;
+  nshapes++;
+  return(i);
+}
+
+/* Shape of a frame. shape holds the frames below n, then the outputs */
+static int frame_shape(int id, int n, int *shape)
+{
+  if((id >= 0) || IS_OUTPUT_FRAME(id))
+    return(shape[opt_slot(id, n)]);
+  return(0); /* INPUT */
+}
+
+/* Work out the shape of each frame from the steps writing it */
+static void frame_shapes(TCommands *cmd, int n, int *shape)
+{
+  int i, j, s, p[4];
+  TBackground *bg;
+  TProcess *proc;
+
+  for(i=0;i<n+cmd->noutputs;i++)
+    shape[i] = 0;
+  for(i=0;i<cmd->nbackground;i++) {
+    bg = &(cmd->background[i]);
+    if(BACKGROUND_REGION(bg)) {
+      p[0] = bg->x;
+      p[1] = bg->y;
+      p[2] = bg->w;
+      p[3] = bg->h;
+      shape[bg->frame] = add_shape(PROC_CROP, 0, -1, p);
+    }
+  }
+
+  for(i=0;i<cmd->nsteps;i++) {
+    proc = &(cmd->step[i]);
+    if(proc->result == UNKNOWN_FRAME)
+      continue;
+    if(proc->method == PROC_CONCATENATE) {
+      /* Frames side by side, from the left */
+      s = frame_shape(proc->args[0].frame, n, shape);
+      for(j=1;j<proc->nargs;j++)
+	s = add_shape(PROC_CONCATENATE, s, frame_shape(proc->args[j].frame, n, shape), NULL);
+    }else {
+      s = frame_shape(proc->input, n, shape);
+      if((proc->method == PROC_CROP) || (proc->method == PROC_BIN)) {
+	for(j=0;j<4;j++)
+	  p[j] = (j < proc->nargs) ? proc->args[j].ival : 0;
+	if(proc->method == PROC_BIN)
+	  p[1] = 0; /* Sum or mean gives the same size */
+	s = add_shape(proc->method, s, -1, p);
+      }
+      /* Subtract and expressions use the overlap of their frames */
+      for(j=0;j<frame_args(proc);j++) {
+	if(frame_shape(proc->args[j].frame, n, shape) != s)
+	  s = add_shape(PROC_SUBTRACT, s, frame_shape(proc->args[j].frame, n, shape), NULL);
+      }
+    }
+    shape[opt_slot(proc->result, n)] = s;
+  }
+}
+
+/* Check if step b (after a) must wait for step a to finish,
+   because one of them writes a frame which the other uses */
+static int steps_conflict(TProcess *a, TProcess *b)
+{
+  return(step_reads(b, a->result) || step_reads(a, b->result) ||
+	 (a->result == b->result));
+}
+
+#ifndef SINGLE_THREAD
+/* Find which steps must finish before each step can start, either
+   directly or through other steps. Returns an nsteps by nsteps array,
+   set at [i*nsteps + j] if step i comes before step j */
+static char *step_order(TCommands *cmd)
+{
+  char *before;
+  int n, i, j, k;
+
+  n = cmd->nsteps;
+  before = (char*) calloc(n*n + 1, 1);
+  for(j=0;j<n;j++) {
+    for(i=j-1;i>=0;i--) {
+      if(before[i*n + j] || !steps_conflict(&(cmd->step[i]), &(cmd->step[j])))
+	continue;
+      before[i*n + j] = 1;
+      for(k=0;k<i;k++) {
+	if(before[k*n + i])
+	  before[k*n + j] = 1;
+      }
+    }
+  }
+  return(before);
+}
+#endif
+
+/* Check that every step using frame id comes before step d, apart
+   from d itself. Then d can write over the frame even when steps run
+   at the same time */
+static int frame_finished(TCommands *cmd, int id, int d, char *before)
+{
+  int i;
+
+  if(d < 0)
+    return(0);
+  for(i=0;i<cmd->nsteps;i++) {
+    if((i == d) || (!step_reads(&(cmd->step[i]), id) && (cmd->step[i].result != id)))
+      continue;
+    if((i > d) || !before[i*cmd->nsteps + d])
+      return(0);
+  }
+  return(1);
+}
+
+static void share_map(int *id, int *map)
+{
+  if(*id >= 0)
+    *id = map[*id];
+}
+
+/* Work out when each frame is needed, then give frames buffers by
+   interval colouring. Step i writes its result at time 2i+1 and reads
+   its arguments at the same time. Steps which can work in place read
+   their input at 2i, so the result can go in the same buffer. The
+   background frames are calculated at time 0. Buffers are only shared
+   between frames of the same shape, so each buffer keeps its size.
+   When independent steps run on several threads, a buffer is only
+   re-used by a step which has to wait for all users of the old frame */
+void share_frames(TCommands *cmd)
+{
+  int *first, *last, *shape, *order, *map, *bufend, *bufshape, *bufframe;
+  int n, nbuf, i, j, k, t, id;
+  TProcess *proc;
+  char *before;
+
+  n = cmd->nlogical = cmd->ntemp;
+  if(n < 2)
+    return;
+
+  first = (int*) malloc(sizeof(int)*n);
+  last = (int*) malloc(sizeof(int)*n);
+  shape = (int*) malloc(sizeof(int)*(n+cmd->noutputs));
+  order = (int*) malloc(sizeof(int)*n);
+  map = (int*) malloc(sizeof(int)*n);
+  bufend = (int*) malloc(sizeof(int)*n);
+  bufshape = (int*) malloc(sizeof(int)*n);
+  bufframe = (int*) malloc(sizeof(int)*n);
+
+  before = NULL;
+#ifndef SINGLE_THREAD
+  if(script_threads > 1)
+    before = step_order(cmd);
+#endif
+
+  for(i=0;i<n;i++) {
+    first[i] = 2*cmd->nsteps + 1;
+    last[i] = 0;
+  }
+  for(i=0;i<cmd->nbackground;i++)
+    first[cmd->background[i].frame] = 0;
+  frame_shapes(cmd, n, shape);
+
+  for(i=0;i<cmd->nsteps;i++) {
+    proc = &(cmd->step[i]);
+    t = 2*i + 1;
+
+    if((proc->method != PROC_CONCATENATE) && ((id = proc->input) >= 0)) {
+      /* The result can only go over an input of the same size */
+      if(in_place(proc) &&
+	 (shape[id] == frame_shape(proc->result, n, shape))) {
+	if(last[id] < t-1)
+	  last[id] = t-1;
+      }else
+	last[id] = t;
+    }
+
+    for(j=0;j<frame_args(proc);j++) {
+      if((id = proc->args[j].frame) >= 0)
+	last[id] = t;
+    }
+
+    if((id = proc->result) >= 0) {
+      if(first[id] > t)
+	first[id] = t;
+      last[id] = t;
+    }
+  }
+
+  /* Backgrounds are updated from one frame to the next, so keep
+     their own buffers */
+  for(i=0;i<cmd->nbackground;i++)
+    last[cmd->background[i].frame] = 2*cmd->nsteps + 1;
+
+  /* Order frames by the time they are first written */
+  for(i=0;i<n;i++) {
+    for(k=i;(k>0) && (first[order[k-1]] > first[i]);k--)
+      order[k] = order[k-1];
+    order[k] = i;
+  }
+
+  /* Give each frame the first free buffer of the right shape. For
+     intervals this uses as few buffers as possible */
+  nbuf = 0;
+  for(k=0;k<n;k++) {
+    i = order[k];
+    for(j=0;j<nbuf;j++) {
+      if((bufshape[j] == shape[i]) && (bufend[j] < first[i]) &&
+	 ((before == NULL) || frame_finished(cmd, bufframe[j], (first[i]-1)/2, before)))
+	break;
+    }
+    if(j == nbuf) {
+      bufshape[j] = shape[i];
+      nbuf++;
+    }
+    bufend[j] = last[i];
+    bufframe[j] = i;
+    map[i] = j;
+  }
+
+  /* Replace frame IDs with buffers */
+  for(i=0;i<cmd->nsteps;i++) {
+    proc = &(cmd->step[i]);
+    share_map(&(proc->input), map);
+    share_map(&(proc->result), map);
+    for(j=0;j<frame_args(proc);j++)
+      share_map(&(proc->args[j].frame), map);
+  }
+  for(i=0;i<cmd->nbackground;i++)
+    share_map(&(cmd->background[i].frame), map);
+  cmd->ntemp = nbuf;
+
+  free(first);
+  free(last);
+  free(shape);
+  free(order);
+  free(map);
+  free(bufend);
+  free(bufshape);
+  free(bufframe);
+  free(before);
+}
+
+/* Note the earlier steps which each step has to wait for. Steps
+   which don't depend on each other can run at the same time */
+void find_dependencies(TCommands *cmd)
+{
+  int i, j;
+  TProcess *proc;
+
+  cmd->parallel = 0;
+  for(j=0;j<cmd->nsteps;j++) {
+    proc = &(cmd->step[j]);
+    proc->ndep = 0;
+    proc->dep = (int*) malloc(sizeof(int)*(j+1));
+    for(i=0;i<j;i++) {
+      if(steps_conflict(&(cmd->step[i]), proc))
+	proc->dep[proc->ndep++] = i;
+    }
+    /* Not a simple chain if this doesn't need the step before */
+    if((j > 0) && ((proc->ndep == 0) || (proc->dep[proc->ndep-1] != j-1)))
+      cmd->parallel = 1;
+  }
+}
+
+/* Find how far from the centre of the buffer the script reads input
+   frames (INPUT[k] and backgrounds over n frames). The buffer has to hold this many frames either
+   side of the centre */
+int script_window()
+{
+  int i, j, id, k, w;
+  TProcess *proc;
+
+  w = 0;
+  for(i=0;i<command.nbackground;i++) {
+    k = (command.background[i].width-1)/2;
+    if(k > w)
+      w = k;
+  }
+  for(i=0;i<command.nsteps;i++) {
+    proc = &(command.step[i]);
+    for(j=-1;j<frame_args(proc);j++) {
+      if(j < 0)
+	id = (proc->method != PROC_CONCATENATE) ? proc->input : UNKNOWN_FRAME;
+      else
+	id = proc->args[j].frame;
+      if(IS_INPUT_FRAME(id)) {
+	k = abs(INPUT_FRAME_OFFSET(id));
+	if(k > w)
+	  w = k;
+      }
+    }
+  }
+  return(w);
+}
+
+/* MINIMUM and AVERAGE without a window use the buffer size given on
+   the command line. Called before the buffer is made bigger for
+   script_window(), so these backgrounds don't change with it */
+void script_buffer(int nframes)
+{
+  int i;
+
+  for(i=0;i<command.nbackground;i++) {
+    if(command.background[i].width == 0)
+      command.background[i].width = nframes;
+  }
+}
+
+/* Number of outputs: OUTPUT, then any named outputs */
+int script_outputs()
+{
+  return(command.noutputs);
+}
+
+/* Name of output k (NULL for OUTPUT). Sets the file and bit depth
+   given in the script with WRITE, or NULL and 0, and the suffix for
+   the file names of this variant of the script, or NULL */
+char *script_output(int k, char **file, int *depth, char **suffix)
+{
+  *file = command.output[k].file;
+  *depth = command.output[k].depth;
+  *suffix = command.output[k].suffix;
+  return(command.output[k].name);
+}
+
+/* Where output k comes from in the input: the corner of the region
+   in input pixels, and the size of the bins (1 if not binned).
+   Returns 0 if this isn't known, e.g. for concatenated frames */
+int script_geometry(int k, int *left, int *top, int *bin)
+{
+  int *x, *y, *b;
+  int n, i, j, s, t, known;
+  TProcess *proc;
+
+  if((k < 0) || (k >= command.noutputs))
+    return(0);
+  n = command.ntemp;
+  x = (int*) malloc(sizeof(int)*3*(n+command.noutputs));
+  y = x + n + command.noutputs;
+  b = y + n + command.noutputs;
+  for(i=0;i<n+command.noutputs;i++) {
+    x[i] = y[i] = 0;
+    b[i] = 1;
+  }
+  for(i=0;i<command.nbackground;i++) {
+    x[command.background[i].frame] = command.background[i].x;
+    y[command.background[i].frame] = command.background[i].y;
+  }
+
+  /* Follow the steps, with b = 0 once the position is lost */
+  for(i=0;i<command.nsteps;i++) {
+    proc = &(command.step[i]);
+    if(proc->result == UNKNOWN_FRAME)
+      continue;
+    t = opt_slot(proc->result, n);
+    if(proc->method == PROC_CONCATENATE) {
+      b[t] = 0;
+      continue;
+    }
+    s = ((proc->input >= 0) || IS_OUTPUT_FRAME(proc->input)) ? opt_slot(proc->input, n) : -1;
+    x[t] = (s < 0) ? 0 : x[s];
+    y[t] = (s < 0) ? 0 : y[s];
+    b[t] = (s < 0) ? 1 : b[s];
+    for(j=0;j<frame_args(proc);j++) {
+      /* Frames must line up */
+      s = ((proc->args[j].frame >= 0) || IS_OUTPUT_FRAME(proc->args[j].frame)) ?
+	opt_slot(proc->args[j].frame, n) : -1;
+      if(((s < 0) && ((x[t] != 0) || (y[t] != 0) || (b[t] != 1))) ||
+	 ((s >= 0) && ((x[s] != x[t]) || (y[s] != y[t]) || (b[s] != b[t]))))
+	b[t] = 0;
+    }
+    if(proc->method == PROC_CROP) {
+      x[t] += proc->args[0].ival*b[t];
+      y[t] += proc->args[1].ival*b[t];
+    }else if(proc->method == PROC_BIN)
+      b[t] *= proc->args[0].ival;
+  }
+
+  t = opt_slot(OUTPUT_ID(k), n);
+  *left = x[t];
+  *top = y[t];
+  *bin = b[t];
+  known = (b[t] > 0);
+  free(x);
+  return(known);
+}
+
+/********************** OPTIMISE SCRIPT ***********************
+ * Scripts often calculate the same thing more than once, e.g *
+ * when targets are copied between scripts. Steps which repeat *
+ * an earlier step, copies, and steps which OUTPUT doesn't     *
+ * need are removed.                                          *
+ **************************************************************/
+
+static int opt_map(int id, int *map)
+{
+  if(id >= 0)
+    return(map[id]);
+  return(id);
+}
+
+/* Check if two steps calculate the same thing from the same frames */
+static int same_step(TProcess *a, TProcess *b)
+{
+  int j;
+
+  if((a->method != b->method) || (a->nargs != b->nargs))
+    return(0);
+  if((a->method != PROC_CONCATENATE) && (a->input != b->input))
+    return(0);
+  for(j=0;j<a->nargs;j++) {
+    if(j < frame_args(a)) {
+      if(a->args[j].frame != b->args[j].frame)
+	return(0);
+    }else if((a->args[j].fval != b->args[j].fval) || (a->args[j].ival != b->args[j].ival) ||
+	     (a->args[j].frame != b->args[j].frame))
+      return(0);
+  }
+  return(1);
+}
+
+/* First every step is given a new frame for its result, so a frame
+   always holds the same thing. Then steps which repeat an earlier
+   one are removed, and their results replaced with the earlier
+   ones. Finally working back from the outputs finds the steps needed.
+   Frames are shared again afterwards by share_frames */
+void optimise_script(TCommands *cmd)
+{
+  int *version, *map, *def, *live, *nread, *out, *shape;
+  int n, nids, i, j, k, id;
+  TProcess *proc;
+
+  cmd->nmerged = cmd->nunused = 0;
+  if(cmd->nsteps == 0)
+    return;
+
+  n = cmd->ntemp;
+  nids = n + cmd->nsteps;
+  version = (int*) malloc(sizeof(int)*(n+cmd->noutputs)); /* Then the outputs */
+  out = (int*) malloc(sizeof(int)*cmd->noutputs);
+  map = (int*) malloc(sizeof(int)*nids);
+  def = (int*) malloc(sizeof(int)*nids);
+  live = (int*) malloc(sizeof(int)*nids);
+  nread = (int*) malloc(sizeof(int)*nids);
+
+  for(i=0;i<n+cmd->noutputs;i++)
+    version[i] = UNKNOWN_FRAME;
+  for(i=0;i<nids;i++) {
+    map[i] = i;
+    def[i] = -1;
+    live[i] = 0;
+    nread[i] = 0;
+  }
+  /* Backgrounds are calculated before the steps */
+  for(i=0;i<cmd->nbackground;i++)
+    version[cmd->background[i].frame] = cmd->background[i].frame;
+
+  /* New frame for each result, merging repeated steps */
+  k = 0;
+  for(i=0;i<cmd->nsteps;i++) {
+    proc = &(cmd->step[i]);
+
+    if((proc->method != PROC_CONCATENATE) && !IS_INPUT_FRAME(proc->input))
+      proc->input = opt_map(version[opt_slot(proc->input, n)], map);
+    for(j=0;j<frame_args(proc);j++) {
+      id = proc->args[j].frame;
+      if(!IS_INPUT_FRAME(id))
+	proc->args[j].frame = opt_map(version[opt_slot(id, n)], map);
+    }
+
+    id = n + i; /* New frame */
+    version[opt_slot(proc->result, n)] = id;
+    proc->result = id;
+
+    if(proc->method == PROC_COPY) {
+      /* Use the input instead */
+      map[id] = proc->input;
+      cmd->nmerged++;
+      continue;
+    }
+    for(j=0;j<k;j++) {
+      if(same_step(&(cmd->step[j]), proc))
+	break;
+    }
+    if(j < k) {
+      map[id] = cmd->step[j].result;
+      cmd->nmerged++;
+      continue;
+    }
+    cmd->step[k] = *proc;
+    def[id] = k;
+    k++;
+  }
+  cmd->nsteps = k;
+
+  /* Work back from the outputs, keeping the steps needed. Outputs
+     count as reads, so they aren't used in place for other outputs */
+  for(i=0;i<cmd->noutputs;i++) {
+    out[i] = opt_map(version[n+i], map);
+    if(out[i] >= 0) {
+      live[out[i]] = 1;
+      nread[out[i]]++;
+    }
+  }
+  k = cmd->nsteps;
+  for(i=cmd->nsteps-1;i>=0;i--) {
+    proc = &(cmd->step[i]);
+    if(!live[proc->result]) {
+      proc->method = PROC_NULL;
+      cmd->nunused++;
+      k--;
+      continue;
+    }
+    if((proc->method != PROC_CONCATENATE) && (proc->input >= 0)) {
+      live[proc->input] = 1;
+      nread[proc->input]++;
+    }
+    for(j=0;j<frame_args(proc);j++) {
+      if((id = proc->args[j].frame) >= 0) {
+	live[id] = 1;
+	nread[id]++;
+      }
+    }
+  }
+  for(i=0,k=0;i<cmd->nsteps;i++) {
+    if(cmd->step[i].method != PROC_NULL) {
+      cmd->step[k] = cmd->step[i];
+      def[cmd->step[k].result] = k;
+      k++;
+    }
+  }
+  cmd->nsteps = k;
+  for(i=0,k=0;i<cmd->nbackground;i++) {
+    if(live[cmd->background[i].frame])
+      cmd->background[k++] = cmd->background[i];
+  }
+  cmd->nbackground = k;
+
+  /* The step giving each output writes it directly, and steps
+     before it work in place on the output where they can */
+  shape = (int*) malloc(sizeof(int)*(nids+cmd->noutputs));
+  frame_shapes(cmd, nids, shape);
+  for(k=0;k<cmd->noutputs;k++) {
+    for(j=0;(j<k) && (out[j] != out[k]);j++);
+    if((out[k] < n) || (j < k)) {
+      /* INPUT, a background, or the same as another output: copy it */
+      i = add_process(cmd, 0);
+      cmd->step[i].method = PROC_COPY;
+      cmd->step[i].input = (j < k) ? OUTPUT_ID(j) : out[k];
+      cmd->step[i].result = OUTPUT_ID(k);
+      cmd->nmerged--;
+      continue;
+    }
+    for(i=0;i<cmd->nsteps;i++) {
+      proc = &(cmd->step[i]);
+      if(proc->input == out[k])
+	proc->input = OUTPUT_ID(k);
+      for(j=0;j<frame_args(proc);j++) {
+	if(proc->args[j].frame == out[k])
+	  proc->args[j].frame = OUTPUT_ID(k);
+      }
+    }
+    i = def[out[k]];
+    cmd->step[i].result = OUTPUT_ID(k);
+    while(in_place(&(cmd->step[i])) && ((id = cmd->step[i].input) >= n) &&
+	  (nread[id] == 1) && (shape[id] == shape[out[k]])) {
+      cmd->step[i].input = OUTPUT_ID(k);
+      i = def[id];
+      cmd->step[i].result = OUTPUT_ID(k);
+    }
+  }
+
+  /* Number the frames used from zero */
+  for(i=0;i<nids;i++)
+    map[i] = UNKNOWN_FRAME;
+  k = 0;
+  for(i=0;i<cmd->nbackground;i++) {
+    map[cmd->background[i].frame] = k++;
+    cmd->background[i].frame = map[cmd->background[i].frame];
+  }
+  for(i=0;i<cmd->nsteps;i++) {
+    proc = &(cmd->step[i]);
+    if(proc->result >= 0) {
+      map[proc->result] = k++;
+      proc->result = map[proc->result];
+    }
+    proc->input = opt_map(proc->input, map);
+    for(j=0;j<frame_args(proc);j++)
+      proc->args[j].frame = opt_map(proc->args[j].frame, map);
+  }
+  cmd->ntemp = k;
+
+  free(version);
+  free(out);
+  free(map);
+  free(def);
+  free(live);
+  free(nread);
+  free(shape);
+}
+
 /********************** DUMMY-RUN SCRIPT **********************
  * Goes through the command list printing out steps           *
  **************************************************************/
 
-void targ_str(int id)
+/* Name of a frame, in str (at least MAX_NAME_LEN long) */
+static char *frame_str(int id, char *str)
 {
+  TOutput *out;
+
   if(id == UNKNOWN_FRAME) {
-    printf("UNKNOWN");
-  }else if(id == OUTPUT_FRAME) {
-    printf("OUTPUT");
+    strcpy(str, "UNKNOWN");
+  }else if(IS_OUTPUT_FRAME(id)) {
+    out = &(command.output[OUTPUT_NUMBER(id)]);
+    snprintf(str, MAX_NAME_LEN, "OUTPUT%s%s%s", (out->name != NULL) ? "." : "",
+	     (out->name != NULL) ? out->name : "", (out->suffix != NULL) ? out->suffix : "");
   }else if(id == INPUT_FRAME) {
-    printf("INPUT");
+    strcpy(str, "INPUT");
+  }else if(IS_INPUT_FRAME(id)) {
+    sprintf(str, "INPUT[%+d]", INPUT_FRAME_OFFSET(id));
   }else {
-    printf("<%d>", id);
+    sprintf(str, "<%d>", id);
+  }
+  return(str);
+}
+
+void targ_str(int id)
+{
+  char str[MAX_NAME_LEN];
+
+  printf("%s", frame_str(id, str));
+}
+
+/* Short description of step i for the profiler: the command, then
+   its input and result */
+void step_name(int i, char *name, int n)
+{
+  static char *proc_name[] = {"SUBTRACT", "NORMALIZE", "AMPLIFY", "GAMMA", "OFFSET",
+			      "DESPECKLE_MEDIAN", "KUWAHARA", "SHARPEN", "UNSHARP_MASK",
+			      "CONCATENATE", "COPY", "GAUSS_BLUR", "EXPR", "CROP", "BIN"};
+  char in[MAX_NAME_LEN], out[MAX_NAME_LEN];
+  TProcess *proc;
+
+  proc = &(command.step[i]);
+  frame_str(proc->result, out);
+  if(proc->method == PROC_CONCATENATE)
+    snprintf(name, n, "%s => %s", proc_name[proc->method], out);
+  else
+    snprintf(name, n, "%s %s => %s", proc_name[proc->method],
+	     frame_str(proc->input, in), out);
+}
+
+/* Short description of background frame i for the profiler */
+void background_name(int i, char *name, int n)
+{
+  char out[MAX_NAME_LEN];
+  TBackground *bg;
+
+  bg = &(command.background[i]);
+  frame_str(bg->frame, out);
+  if(bg->width > 0)
+    snprintf(name, n, "%s(%d) => %s", (bg->method == BG_MINIMUM) ? "MINIMUM" : "AVERAGE",
+	     bg->width, out);
+  else
+    snprintf(name, n, "%s => %s", (bg->method == BG_MINIMUM) ? "MINIMUM" : "AVERAGE", out);
+  if(BACKGROUND_REGION(bg))
+    snprintf(name + strlen(name), n - strlen(name), " in %d %d %d %d",
+	     bg->x, bg->y, bg->w, bg->h);
+}
+
+/* Number of values an expression operation takes off the stack */
+static int expr_pops(int op)
+{
+  if(op <= EXPR_FRAME)
+    return(0);
+  if(op < EXPR_ADD)
+    return(1);
+  if(op == EXPR_CLAMP)
+    return(3);
+  return(2);
+}
+
+/* Find the first operation of the value calculated by operation k */
+static int expr_start(TProcess *proc, int k)
+{
+  int need;
+
+  for(need=1;;k--) {
+    need += expr_pops(proc->args[k].ival) - 1;
+    if(need == 0)
+      return(k);
+  }
+}
+
+/* Print the value calculated by operation k of an expression */
+static void expr_str(TProcess *proc, int k)
+{
+  static char *binop[] = {"+", "-", "*", "/", "min", "max", "pow"};
+  static char *unop[] = {"-", "abs", "log", "exp"};
+  int op, a, b;
+
+  op = proc->args[k].ival;
+  switch(expr_pops(op)) {
+  case 0: {
+    if(op == EXPR_CONST)
+      printf("%g", proc->args[k].fval);
+    else if(op == EXPR_INPUT)
+      targ_str(proc->input);
+    else
+      targ_str(proc->args[proc->args[k].frame].frame);
+    break;
+  }
+  case 1: {
+    printf("%s(", unop[op - EXPR_NEG]);
+    expr_str(proc, k-1);
+    printf(")");
+    break;
+  }
+  case 2: {
+    a = expr_start(proc, k-1) - 1;
+    if(op <= EXPR_DIV) {
+      printf("(");
+      expr_str(proc, a);
+      printf(" %s ", binop[op - EXPR_ADD]);
+    }else {
+      printf("%s(", binop[op - EXPR_ADD]);
+      expr_str(proc, a);
+      printf(", ");
+    }
+    expr_str(proc, k-1);
+    printf(")");
+    break;
+  }
+  default: {
+    b = expr_start(proc, k-1) - 1;
+    a = expr_start(proc, b) - 1;
+    printf("clamp(");
+    expr_str(proc, a);
+    printf(", ");
+    expr_str(proc, b);
+    printf(", ");
+    expr_str(proc, k-1);
+    printf(")");
+  }
   }
 }
 
@@ -821,16 +1941,24 @@ void dummy_script(TCommands *cmd)
   int i, j;
   TProcess *proc;
   printf("\n======== SCRIPT OPERATIONS =========\n");
-  printf("Number of intermediate frames: %d\n", cmd->ntemp);
+  printf("Number of intermediate frames: %d", cmd->ntemp);
+  if(cmd->nlogical > cmd->ntemp)
+    printf(" (%d before sharing)", cmd->nlogical);
+  printf("\n");
+  if(cmd->nmerged > 0)
+    printf("Removed %d repeated steps and copies\n", cmd->nmerged);
+  if(cmd->nunused > 0)
+    printf("Removed %d steps not needed for OUTPUT\n", cmd->nunused);
   /* Calculate background frames */
-  if(cmd->minimum_frame != UNKNOWN_FRAME) {
-    printf("Calculate minimum => ");
-    targ_str(cmd->minimum_frame);
-    printf("\n");
-  }
-  if(cmd->average_frame != UNKNOWN_FRAME) {
-    printf("Calculate average => ");
-    targ_str(cmd->average_frame);
+  for(i=0;i<cmd->nbackground;i++) {
+    printf("Calculate %s", (cmd->background[i].method == BG_MINIMUM) ? "minimum" : "average");
+    if(cmd->background[i].width > 0)
+      printf(" over %d frames", cmd->background[i].width);
+    if(BACKGROUND_REGION(&(cmd->background[i])))
+      printf(" in %d %d %d %d", cmd->background[i].x, cmd->background[i].y,
+	     cmd->background[i].w, cmd->background[i].h);
+    printf(" => ");
+    targ_str(cmd->background[i].frame);
     printf("\n");
   }
   /* Go through commands */
@@ -925,6 +2053,28 @@ void dummy_script(TCommands *cmd)
       targ_str(proc->result);
       break;
     }
+    case PROC_EXPR: {
+      printf("Expr ");
+      expr_str(proc, proc->nargs-1);
+      printf(" => ");
+      targ_str(proc->result);
+      break;
+    }
+    case PROC_CROP: {
+      printf("Crop(");
+      targ_str(proc->input);
+      printf(", %d, %d, %d, %d) => ", proc->args[0].ival, proc->args[1].ival,
+	     proc->args[2].ival, proc->args[3].ival);
+      targ_str(proc->result);
+      break;
+    }
+    case PROC_BIN: {
+      printf("Bin(");
+      targ_str(proc->input);
+      printf(", %d%s) => ", proc->args[0].ival, proc->args[1].ival ? ", sum" : "");
+      targ_str(proc->result);
+      break;
+    }
     default: {
       printf("Error! Unrecognised command %d", cmd->step[i].method);
     }
@@ -1013,6 +2163,7 @@ int add_arg(TProcess *process)
     free(tmp);
   }
   memset(&(process->args[process->nargs]), 0, sizeof(TProcArg));
+  process->args[process->nargs].sweep = -1;
   process->nargs++;
   return(process->nargs-1);
 }
@@ -1038,14 +2189,21 @@ int add_framearg(TProcess *process, char *name)
 int add_floatarg(TProcess *process, char *arg)
 {
   float val;
-  int p;
+  int p, s;
 
-  if(sscanf(arg, "%f", &val) != 1) {
+  s = -1;
+  if(arg[0] == '{') {
+    /* Several values */
+    if((s = add_sweep(arg)) < 0)
+      return(1);
+    val = sweep[s].val[0];
+  }else if(sscanf(arg, "%f", &val) != 1) {
     return(1);
   }
 
   p = add_arg(process);
   process->args[p].fval = val;
+  process->args[p].sweep = s;
 
   return(0);
 }
@@ -1054,15 +2212,377 @@ int add_floatarg(TProcess *process, char *arg)
 int add_intarg(TProcess *process, char *arg)
 {
   int val;
-  int p;
+  int p, s;
 
-  if(sscanf(arg, "%d", &val) != 1) {
+  s = -1;
+  if(arg[0] == '{') {
+    /* Several values */
+    if((s = add_sweep(arg)) < 0)
+      return(1);
+    val = (int) floor(sweep[s].val[0] + 0.5);
+  }else if(sscanf(arg, "%d", &val) != 1) {
     return(1);
   }
 
   p = add_arg(process);
   process->args[p].ival = val;
+  process->args[p].sweep = s;
+
+  return(0);
+}
+
+/* Add an argument with several values: a list {a,b,c}, or a range
+   {first..last} or {first..last..step}. Returns the index of the
+   sweep, or -1 if the argument isn't valid */
+int add_sweep(char *arg)
+{
+  TSweep *s, *tmp;
+  char *str, *p, *q;
+  float first, last, step;
+  int n, i;
+
+  n = strlen(arg);
+  if((n < 3) || (arg[n-1] != '}'))
+    return(-1);
+  str = (char*) malloc(n);
+  strncpy(str, arg+1, n-2);
+  str[n-2] = 0;
+
+  tmp = sweep;
+  sweep = (TSweep*) malloc(sizeof(TSweep)*(nsweeps+1));
+  if(nsweeps > 0) {
+    memcpy(sweep, tmp, sizeof(TSweep)*nsweeps);
+    free(tmp);
+  }
+  s = &(sweep[nsweeps]);
+
+  if((p = strstr(str, "..")) != NULL) {
+    /* Range of values */
+    *p = 0;
+    p += 2;
+    step = 1.0;
+    if((q = strstr(p, "..")) != NULL) {
+      *q = 0;
+      if(sscanf(q+2, "%f", &step) != 1)
+	step = 0.0;
+    }
+    if((sscanf(str, "%f", &first) != 1) || (sscanf(p, "%f", &last) != 1) ||
+       (step <= 0.0) || (last < first)) {
+      printf("Error: Range %s should be {first..last} or {first..last..step}\n", arg);
+      free(str);
+      return(-1);
+    }
+    /* Allow for rounding in the last value */
+    n = (int) ((last - first)/step + 1.0e-4) + 1;
+    if(n > MAX_VARIANTS) {
+      printf("Error: Range %s has more than %d values\n", arg, MAX_VARIANTS);
+      free(str);
+      return(-1);
+    }
+    s->val = (float*) malloc(sizeof(float)*n);
+    for(i=0;i<n;i++)
+      s->val[i] = first + i*step;
+  }else {
+    /* List of values */
+    n = 1;
+    for(p=str;*p != 0;p++) {
+      if(*p == ',')
+	n++;
+    }
+    s->val = (float*) malloc(sizeof(float)*n);
+    p = str;
+    for(i=0;i<n;i++) {
+      if(sscanf(p, "%f", &(s->val[i])) != 1) {
+	printf("Error: List %s should be numbers separated by commas\n", arg);
+	free(s->val);
+	free(str);
+	return(-1);
+      }
+      if(i < n-1)
+	p = strchr(p, ',') + 1;
+    }
+  }
+  free(str);
+
+  s->n = n;
+  s->cur = 0;
+  nsweeps++;
+  return(nsweeps-1);
+}
+
+/* Compiling an expression (EXPR). Frames are added to the step as
+   they are found, and the operations to a separate list which goes
+   after them */
+static TProcess *expr_proc;
+static TTarget *expr_targ;
+static TProcess expr_code; /* Operations */
+static char *expr_pos;     /* Next character */
+static char *expr_msg;     /* What went wrong */
+static int expr_depth;     /* Values on the stack */
+
+static struct {
+  char *name;
+  int op;
+  int nargs; /* 0 for two or more */
+}expr_func[] = {{"MIN", EXPR_MIN, 0}, {"MAX", EXPR_MAX, 0}, {"ABS", EXPR_ABS, 1},
+		{"POW", EXPR_POW, 2}, {"LOG", EXPR_LOG, 1}, {"EXP", EXPR_EXP, 1},
+		{"CLAMP", EXPR_CLAMP, 3}, {NULL, 0, 0}};
+
+static int expr_sum();
+
+static void expr_space()
+{
+  while(*expr_pos == ' ')
+    expr_pos++;
+}
+
+/* Add an operation. Returns its index, or -1 if the stack is too deep */
+static int expr_op(int op, float val)
+{
+  TProcArg *last;
+  int p;
+
+  /* Minus a number is just a number */
+  if((op == EXPR_NEG) && (expr_code.nargs > 0)) {
+    last = &(expr_code.args[expr_code.nargs-1]);
+    if((last->ival == EXPR_CONST) && (last->sweep < 0)) {
+      last->fval = -last->fval;
+      return(expr_code.nargs-1);
+    }
+  }
+
+  expr_depth += 1 - expr_pops(op);
+  if(expr_depth > EXPR_STACK) {
+    expr_msg = "Expression too complicated";
+    return(-1);
+  }
+  p = add_arg(&expr_code);
+  expr_code.args[p].ival = op;
+  expr_code.args[p].fval = val;
+  return(p);
+}
+
+/* A number, list of values, bracket, function or frame */
+static int expr_primary()
+{
+  char name[MAX_LINE_LEN], *end;
+  float val;
+  int i, n, p, s;
+
+  expr_space();
+  if(*expr_pos == '(') {
+    expr_pos++;
+    if(expr_sum())
+      return(1);
+    expr_space();
+    if(*expr_pos != ')') {
+      expr_msg = "Expected )";
+      return(1);
+    }
+    expr_pos++;
+    return(0);
+  }
+  if(*expr_pos == '{') {
+    /* Several values, one for each variant */
+    if((end = strchr(expr_pos, '}')) == NULL) {
+      expr_msg = "Expected }";
+      return(1);
+    }
+    n = end - expr_pos + 1;
+    strncpy(name, expr_pos, n);
+    name[n] = 0;
+    if((s = add_sweep(name)) < 0) {
+      expr_msg = "Expected a list or range of values";
+      return(1);
+    }
+    expr_pos = end + 1;
+    if((p = expr_op(EXPR_CONST, sweep[s].val[0])) < 0)
+      return(1);
+    expr_code.args[p].sweep = s;
+    return(0);
+  }
+  if(isdigit(*expr_pos) || (*expr_pos == '.')) {
+    val = strtod(expr_pos, &end);
+    if(end == expr_pos) {
+      expr_msg = "Expected a number";
+      return(1);
+    }
+    expr_pos = end;
+    return(expr_op(EXPR_CONST, val) < 0);
+  }
+
+  /* Names of functions and frames */
+  n = strspn(expr_pos, "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.");
+  if(n == 0) {
+    expr_msg = "Expected a number, frame or function";
+    return(1);
+  }
+  strncpy(name, expr_pos, n);
+  name[n] = 0;
+  expr_pos += n;
+
+  for(i=0;(expr_func[i].name != NULL) && (strcmp(name, expr_func[i].name) != 0);i++);
+  if(expr_func[i].name != NULL) {
+    expr_space();
+    if(*expr_pos != '(') {
+      expr_msg = "Expected ( after function";
+      return(1);
+    }
+    n = 0;
+    do {
+      expr_pos++;
+      if(expr_sum())
+	return(1);
+      n++;
+      /* min and max of several values */
+      if((expr_func[i].nargs == 0) && (n > 1) && (expr_op(expr_func[i].op, 0.0) < 0))
+	return(1);
+      expr_space();
+    }while(*expr_pos == ',');
+    if(*expr_pos != ')') {
+      expr_msg = "Expected )";
+      return(1);
+    }
+    expr_pos++;
+    if(expr_func[i].nargs == 0) {
+      if(n < 2) {
+	expr_msg = "Min and max need at least two values";
+	return(1);
+      }
+      return(0);
+    }
+    if(n != expr_func[i].nargs) {
+      expr_msg = "Wrong number of values for function";
+      return(1);
+    }
+    return(expr_op(expr_func[i].op, 0.0) < 0);
+  }
+
+  /* The input of the step */
+  if(strcmp(name, "X") == 0)
+    return(expr_op(EXPR_INPUT, 0.0) < 0);
+
+  /* INPUT[k], MINIMUM(n) and AVERAGE(n) */
+  end = NULL;
+  if((strcmp(name, "INPUT") == 0) && (*expr_pos == '['))
+    end = strchr(expr_pos, ']');
+  else if(((strcmp(name, "MINIMUM") == 0) || (strcmp(name, "AVERAGE") == 0)) &&
+	  (*expr_pos == '('))
+    end = strchr(expr_pos, ')');
+  if(end != NULL) {
+    strncat(name, expr_pos, end - expr_pos + 1);
+    expr_pos = end + 1;
+  }else if(*expr_pos == '(') {
+    expr_msg = "Unknown function";
+    return(1);
+  }
 
+  /* Frame argument, added if not already used */
+  for(i=0;(i<expr_proc->nargs) && (strcmp(name, expr_proc->args[i].name) != 0);i++);
+  if(i == expr_proc->nargs) {
+    add_framearg(expr_proc, name);
+    add_dependency(expr_targ, expr_proc->args[i].name);
+  }
+  if((p = expr_op(EXPR_FRAME, 0.0)) < 0)
+    return(1);
+  expr_code.args[p].frame = i;
+  return(0);
+}
+
+/* Signs */
+static int expr_unary()
+{
+  expr_space();
+  if(*expr_pos == '+') {
+    expr_pos++;
+    return(expr_unary());
+  }
+  if(*expr_pos == '-') {
+    expr_pos++;
+    if(expr_unary())
+      return(1);
+    return(expr_op(EXPR_NEG, 0.0) < 0);
+  }
+  return(expr_primary());
+}
+
+/* Multiplication and division */
+static int expr_product()
+{
+  int op;
+
+  if(expr_unary())
+    return(1);
+  for(;;) {
+    expr_space();
+    if(*expr_pos == '*')
+      op = EXPR_MUL;
+    else if(*expr_pos == '/')
+      op = EXPR_DIV;
+    else
+      return(0);
+    expr_pos++;
+    if(expr_unary() || (expr_op(op, 0.0) < 0))
+      return(1);
+  }
+}
+
+/* Addition and subtraction */
+static int expr_sum()
+{
+  int op;
+
+  if(expr_product())
+    return(1);
+  for(;;) {
+    expr_space();
+    if(*expr_pos == '+')
+      op = EXPR_ADD;
+    else if(*expr_pos == '-')
+      op = EXPR_SUB;
+    else
+      return(0);
+    expr_pos++;
+    if(expr_product() || (expr_op(op, 0.0) < 0))
+      return(1);
+  }
+}
+
+/* Compile an arithmetic expression into a list of operations. Frame
+   names are added as frame arguments and dependencies of the target,
+   and X is the input of the step */
+int add_expr(TProcess *process, TTarget *targ, char *expr, int linenr)
+{
+  int i, p, err;
+
+  expr_proc = process;
+  expr_targ = targ;
+  expr_pos = expr;
+  expr_depth = 0;
+  expr_code.nargs = 0;
+  expr_code.args = (TProcArg*) NULL;
+
+  err = expr_sum();
+  expr_space();
+  if(!err && (*expr_pos != 0)) {
+    expr_msg = "Expected an operator";
+    err = 1;
+  }
+  if(err) {
+    if(*expr_pos == 0)
+      printf("Error line %d: %s at end of expression\n", linenr, expr_msg);
+    else
+      printf("Error line %d: %s at '%s' in expression\n", linenr, expr_msg, expr_pos);
+    free(expr_code.args);
+    return(1);
+  }
+
+  /* Operations go after the frames */
+  for(i=0;i<expr_code.nargs;i++) {
+    p = add_arg(process);
+    process->args[p] = expr_code.args[i];
+  }
+  free(expr_code.args);
   return(0);
 }
 
@@ -1090,11 +2610,40 @@ int add_process(TCommands *cmd, int nargs)
     for(i=0;i<nargs;i++) {
       cmd->step[n].args[i].name = (char*) NULL;
       cmd->step[n].args[i].frame = UNKNOWN_FRAME;
+      cmd->step[n].args[i].sweep = -1;
     }
   }
   return(n);
 }
 
+/* Find a background frame, adding it if it's not already calculated.
+   Returns the ID of the frame */
+int add_background(int method, int width)
+{
+  TBackground *tmp;
+  int i;
+
+  for(i=0;i<command.nbackground;i++) {
+    if((command.background[i].method == method) && (command.background[i].width == width))
+      return(command.background[i].frame);
+  }
+
+  tmp = command.background;
+  command.background = (TBackground*) malloc(sizeof(TBackground)*(command.nbackground+1));
+  if(command.nbackground > 0) {
+    memcpy(command.background, tmp, sizeof(TBackground)*command.nbackground);
+    free(tmp);
+  }
+  command.background[i].method = method;
+  command.background[i].width = width;
+  command.background[i].x = command.background[i].y = 0; /* Whole frame */
+  command.background[i].w = command.background[i].h = 0;
+  command.background[i].frame = command.ntemp;
+  command.ntemp++;
+  command.nbackground++;
+  return(command.background[i].frame);
+}
+
 /* Append a set of processes onto the end of the list */
 int append_processes(TCommands *cmd, int nproc, TProcess **proc)
 {
@@ -1109,9 +2658,14 @@ int append_processes(TCommands *cmd, int nproc, TProcess **proc)
     /* Free old data */
     free(tmp);
   }
-  /* Append new processing steps */
+  /* Append new processing steps. Arguments are copied, as a target
+     is compiled again for each variant of the script */
   for(i=0;i<nproc;i++) {
     memcpy(&(cmd->step[cmd->nsteps+i]), proc[i], sizeof(TProcess));
+    if(proc[i]->nargs > 0) {
+      cmd->step[cmd->nsteps+i].args = (TProcArg*) malloc(sizeof(TProcArg)*proc[i]->nargs);
+      memcpy(cmd->step[cmd->nsteps+i].args, proc[i]->args, sizeof(TProcArg)*proc[i]->nargs);
+    }
   }
   n = cmd->nsteps;
   cmd->nsteps += nproc;
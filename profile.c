@@ -0,0 +1,140 @@
+/**************************************************************
+ *  PROFILER
+ *
+ *  Each entry adds up the wall time taken by one thing (reading,
+ *  a background frame, a script step or an output) over the run.
+ *  An entry is only added to by one thread at a time: steps which
+ *  run at the same time are different entries, and reading and
+ *  writing have their own threads. All entries are made before
+ *  any threads start.
+ **************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROFILEGLOBALORIGIN
+#include "profile.h"
+
+static TProfile *profile;
+static int nprofile = 0;
+static double profile_started;
+
+/* Time in seconds from some fixed point */
+double profile_clock()
+{
+  struct timespec ts;
+
+  if(!profiling)
+    return(0.0);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + 1.0e-9*ts.tv_nsec);
+}
+
+void profile_start()
+{
+  profiling = 1;
+  profile_started = profile_clock();
+  profile_entry("Read input");
+}
+
+/* Add something to be timed. Returns the number of the entry */
+int profile_entry(char *name)
+{
+  TProfile *tmp;
+
+  if(!profiling)
+    return(-1);
+
+  tmp = profile;
+  profile = (TProfile*) malloc(sizeof(TProfile)*(nprofile+1));
+  if(nprofile > 0) {
+    memcpy(profile, tmp, sizeof(TProfile)*nprofile);
+    free(tmp);
+  }
+  strncpy(profile[nprofile].name, name, PROFILE_NAME_LEN-1);
+  profile[nprofile].name[PROFILE_NAME_LEN-1] = 0;
+  profile[nprofile].seconds = 0.0;
+  profile[nprofile].frames = 0;
+  profile[nprofile].bytes = 0.0;
+  nprofile++;
+  return(nprofile-1);
+}
+
+/* Add the time since start (from profile_clock) to an entry */
+void profile_add(int entry, double start, double bytes)
+{
+  if(!profiling || (entry < 0))
+    return;
+  profile[entry].seconds += profile_clock() - start;
+  profile[entry].frames++;
+  profile[entry].bytes += bytes;
+}
+
+/* Write a string in JSON, escaping quotes */
+static void json_string(FILE *fd, char *str)
+{
+  fputc('"', fd);
+  for(;*str != 0;str++) {
+    if((*str == '"') || (*str == '\\'))
+      fputc('\\', fd);
+    fputc(*str, fd);
+  }
+  fputc('"', fd);
+}
+
+/* Print the entries, most time first, and write them to a JSON file
+   if json isn't NULL. Steps on different threads overlap, so the
+   times can add up to more than the run */
+int profile_report(char *json)
+{
+  int *order;
+  int i, k;
+  double total;
+  TProfile *p;
+  FILE *fd;
+
+  if(!profiling)
+    return(0);
+  total = profile_clock() - profile_started;
+
+  order = (int*) malloc(sizeof(int)*(nprofile+1));
+  for(i=0;i<nprofile;i++) {
+    for(k=i;(k>0) && (profile[order[k-1]].seconds < profile[i].seconds);k--)
+      order[k] = order[k-1];
+    order[k] = i;
+  }
+
+  printf("\n=========== PROFILE (%.3f seconds) ===========\n", total);
+  printf("   Seconds  %% time  ms/frame      MB/s   Frames  What\n");
+  for(k=0;k<nprofile;k++) {
+    p = &(profile[order[k]]);
+    printf("%10.3f  %6.1f  %8.3f  %8.1f  %7ld  %s\n", p->seconds,
+	   (total > 0.0) ? 100.0*p->seconds/total : 0.0,
+	   (p->frames > 0) ? 1.0e3*p->seconds/p->frames : 0.0,
+	   (p->seconds > 0.0) ? 1.0e-6*p->bytes/p->seconds : 0.0,
+	   p->frames, p->name);
+  }
+
+  if(json != NULL) {
+    if((fd = fopen(json, "w")) == (FILE*) NULL) {
+      printf("Error: Could not write profile to %s\n", json);
+      free(order);
+      return(1);
+    }
+    fprintf(fd, "{\n  \"seconds\": %.6f,\n  \"entries\": [\n", total);
+    for(k=0;k<nprofile;k++) {
+      p = &(profile[order[k]]);
+      fprintf(fd, "    {\"name\": ");
+      json_string(fd, p->name);
+      fprintf(fd, ", \"seconds\": %.6f, \"frames\": %ld, \"bytes\": %.0f}%s\n",
+	      p->seconds, p->frames, p->bytes, (k < nprofile-1) ? "," : "");
+    }
+    fprintf(fd, "  ]\n}\n");
+    fclose(fd);
+    printf("Profile written to %s\n", json);
+  }
+  free(order);
+  return(0);
+}
@@ -0,0 +1,46 @@
+/*********************************************************************
+ * Header for the profiler (--profile). Records the wall time, number
+ * of frames and pixel data touched by reading, each background frame,
+ * each script step and each output, then prints them ranked by time
+ * at the end of the run, and optionally writes them as JSON.
+ *********************************************************************/
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__ 1
+
+#define PROFILE_NAME_LEN 280
+
+/* Entry for reading the input, made by profile_start */
+#define PROFILE_READ 0
+
+/* Bytes of pixel data in a frame */
+#define FRAME_BYTES(f) (((double) (f)->width) * (f)->height * sizeof(float))
+
+typedef struct { /* Something being timed */
+  char name[PROFILE_NAME_LEN];
+  double seconds;   /* Total wall time */
+  long frames;      /* Number of times run */
+  double bytes;     /* Pixel data read and written */
+}TProfile;
+
+/********* PROTOTYPES ************/
+
+void profile_start();
+int profile_entry(char *name);
+double profile_clock();
+void profile_add(int entry, double start, double bytes);
+int profile_report(char *json);
+
+/************ GLOBAL VARIABLES **************/
+
+#ifndef PROFILEGLOBALORIGIN
+#define GLOBAL extern
+#else
+#define GLOBAL
+#endif
+
+GLOBAL int profiling;  /* Set if the run is being profiled */
+
+#undef GLOBAL
+
+#endif
@@ -32,14 +32,394 @@
 #include <stdlib.h>
 #include "spiceweasel.h"
 
+#ifndef SINGLE_THREAD
+#include <pthread.h>
+#endif
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 #define IPXGLOBALORIGIN
 #include "io_ipx.h"
 
-TRawFrame readraw;  /* Temporary storage for reading */
+#define NPYGLOBALORIGIN
+#include "io_npy.h"
+
+#include "io_stream.h"
+
+#define TIFFGLOBALORIGIN
+#include "io_tiff.h"
+
+#define MRAWGLOBALORIGIN
+#include "io_mraw.h"
+
+#include "profile.h"
+
+static STREAM_status stream_read_status;
+
+/* Gets the region of a width x height image to convert into a frame.
+   This is the whole image unless a region of interest has been set.
+   Returns non-zero if the region of interest doesn't fit in the image */
+int read_region(int width, int height, int *x0, int *y0, int *w, int *h)
+{
+  if(roi_width <= 0) {
+    /* No region set - use the whole image */
+    *x0 = 0;
+    *y0 = 0;
+    *w = width;
+    *h = height;
+    return(0);
+  }
+
+  if((roi_x < 0) || (roi_y < 0) || (roi_height <= 0) ||
+     (roi_x + roi_width > width) || (roi_y + roi_height > height)) {
+    return(IO_ERROR_REGION);
+  }
+
+  *x0 = roi_x;
+  *y0 = roi_y;
+  *w = roi_width;
+  *h = roi_height;
+  return(0);
+}
+
+/********************** PIXEL CONVERSION *************************
+ * Decoders produce images stored in rows, but frames are stored in
+ * columns. Conversion is done in CONVERT_TILE square tiles: each tile
+ * is first converted to floats row-by-row (contiguous, so vectorises),
+ * then transposed into the frame columns while still in cache.
+ *****************************************************************/
+
+/* Convert one row of up to CONVERT_TILE pixels to floats divided by factor */
+static void convert_tile_row(const unsigned char *src, int type, int stride,
+			     int n, float factor, float *out)
+{
+  int i;
+  const unsigned short *s16;
+  const int *s32;
+  const float *f32;
+
+  switch(type) {
+  case CONVERT_UINT8: {
+    for(i=0;i<n;i++)
+      out[i] = ((float) src[i*stride]) / factor;
+    break;
+  }
+  case CONVERT_UINT16: {
+    s16 = (const unsigned short*) src;
+    for(i=0;i<n;i++)
+      out[i] = ((float) s16[i*stride]) / factor;
+    break;
+  }
+  case CONVERT_INT: {
+    s32 = (const int*) src;
+    for(i=0;i<n;i++)
+      out[i] = ((float) s32[i*stride]) / factor;
+    break;
+  }
+  case CONVERT_FLOAT: {
+    f32 = (const float*) src;
+    for(i=0;i<n;i++)
+      out[i] = f32[i*stride] / factor;
+    break;
+  }
+  }
+}
+
+/* Transpose a tile of nrows x ncols into frame columns starting at (x, y) */
+static void transpose_tile(float tile[CONVERT_TILE][CONVERT_TILE], int nrows, int ncols,
+			   float **col, int x, int y)
+{
+  int i, j;
+
+#ifdef __SSE__
+  /* Transpose 4x4 blocks using SSE registers */
+  __m128 r0, r1, r2, r3;
+  int n4, m4;
+
+  n4 = ncols & ~3;
+  m4 = nrows & ~3;
+  for(i=0;i<n4;i+=4) {
+    for(j=0;j<m4;j+=4) {
+      r0 = _mm_loadu_ps(&(tile[j][i]));
+      r1 = _mm_loadu_ps(&(tile[j+1][i]));
+      r2 = _mm_loadu_ps(&(tile[j+2][i]));
+      r3 = _mm_loadu_ps(&(tile[j+3][i]));
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(&(col[x+i][y+j]), r0);
+      _mm_storeu_ps(&(col[x+i+1][y+j]), r1);
+      _mm_storeu_ps(&(col[x+i+2][y+j]), r2);
+      _mm_storeu_ps(&(col[x+i+3][y+j]), r3);
+    }
+    /* Remaining rows */
+    for(j=m4;j<nrows;j++) {
+      col[x+i][y+j]   = tile[j][i];
+      col[x+i+1][y+j] = tile[j][i+1];
+      col[x+i+2][y+j] = tile[j][i+2];
+      col[x+i+3][y+j] = tile[j][i+3];
+    }
+  }
+  /* Remaining columns */
+  for(i=n4;i<ncols;i++) {
+    for(j=0;j<nrows;j++)
+      col[x+i][y+j] = tile[j][i];
+  }
+#else
+  for(i=0;i<ncols;i++) {
+    for(j=0;j<nrows;j++)
+      col[x+i][y+j] = tile[j][i];
+  }
+#endif
+}
+
+/* Convert nrows x ncols pixels stored in rows into frame columns,
+   starting at frame row y. src points to the first pixel, rows are pitch
+   bytes apart (may be negative for bottom-up images), and pixels are
+   stride samples apart. Values are divided by factor (not multiplied by
+   1/factor, which doesn't always give the same result) */
+void convert_rows(const void *src, long pitch, int type, int stride,
+		  int nrows, int ncols, TFrame *frame, int y, float factor)
+{
+  float tile[CONVERT_TILE][CONVERT_TILE];
+  const unsigned char *row;
+  int size, i, j, jj, n, m;
+
+  size = 1;
+  if(type == CONVERT_UINT16)
+    size = 2;
+  if(type == CONVERT_INT)
+    size = sizeof(int);
+  if(type == CONVERT_FLOAT)
+    size = sizeof(float);
+
+  for(j=0;j<nrows;j+=CONVERT_TILE) {
+    m = nrows - j;
+    if(m > CONVERT_TILE)
+      m = CONVERT_TILE;
+    for(i=0;i<ncols;i+=CONVERT_TILE) {
+      n = ncols - i;
+      if(n > CONVERT_TILE)
+	n = CONVERT_TILE;
+
+      /* Convert into tile */
+      for(jj=0;jj<m;jj++) {
+	row = ((const unsigned char*) src) + (j+jj)*pitch + i*stride*size;
+	convert_tile_row(row, type, stride, n, factor, tile[jj]);
+      }
+
+      /* Transpose into the frame */
+      transpose_tile(tile, m, n, frame->data, i, y+j);
+    }
+  }
+}
+
+/* Make sure a buffer has at least size bytes. Old contents are lost */
+void *reserve_buffer(TBuffer *buffer, size_t size)
+{
+  if(size > buffer->size) {
+    free(buffer->data);
+    buffer->data = malloc(size);
+    buffer->size = size;
+  }
+  return(buffer->data);
+}
+
+/* Read one still image file into a frame. Returns an IO_ERROR code */
+static int read_still(char *filename, TFrame *frame, TBuffer *buffer)
+{
+  switch(input_format) {
+  case FORMAT_BMP:
+    return(read_bmp(filename, frame));
+  case FORMAT_PNG:
+    return(read_png(filename, frame, buffer));
+  case FORMAT_PNM:
+    return(read_pnm(filename, frame));
+  case FORMAT_JPEG:
+    return(read_jpeg(filename, frame, buffer));
+  }
+  return(IO_ERROR_FORMAT);
+}
+
+static TBuffer read_buffer; /* Used by read_frame */
+
+/**************** READ-AHEAD OF STILL IMAGES *********************
+ * A small pool of threads reads and converts the next few files
+ * while earlier frames are being processed. Each slot holds one
+ * frame; when it is asked for, its data is swapped into the
+ * caller's frame so nothing is copied.
+ *****************************************************************/
+
+#ifndef SINGLE_THREAD
+
+#define SLOT_EMPTY  0
+#define SLOT_QUEUED 1  /* Waiting for a thread */
+#define SLOT_BUSY   2  /* Being read */
+#define SLOT_DONE   3
+
+typedef struct {
+  int number;  /* Frame number */
+  int state;
+  int errcode; /* Result of read_still */
+  TFrame frame;
+}TReadSlot;
+
+static TReadSlot *slots;
+static int nslots = 0;
+static pthread_t *ahead_threads;
+static pthread_mutex_t ahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ahead_cond = PTHREAD_COND_INITIALIZER;
+static int ahead_last, ahead_step; /* Last frame and step between frames */
+static int ahead_finished;
+
+static void* read_ahead_routine(void *args)
+{
+  char filename[MAX_NAME_LEN];
+  TBuffer buffer = {NULL, 0};
+  TReadSlot *slot;
+  int i, errcode;
+
+  pthread_mutex_lock(&ahead_mutex);
+  while(!ahead_finished) {
+    /* Take the earliest frame waiting to be read */
+    slot = NULL;
+    for(i=0;i<nslots;i++) {
+      if((slots[i].state == SLOT_QUEUED) && 
+	 ((slot == NULL) || (slots[i].number < slot->number)))
+	slot = &slots[i];
+    }
+    if(slot == NULL) {
+      pthread_cond_wait(&ahead_cond, &ahead_mutex);
+      continue;
+    }
+    slot->state = SLOT_BUSY;
+    pthread_mutex_unlock(&ahead_mutex);
+
+    sprintf(filename, input_template, slot->number);
+    errcode = read_still(filename, &(slot->frame), &buffer);
+
+    pthread_mutex_lock(&ahead_mutex);
+    slot->errcode = errcode;
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&ahead_cond);
+  }
+  pthread_mutex_unlock(&ahead_mutex);
+
+  free(buffer.data);
+  return(NULL);
+}
+
+static TReadSlot *find_slot(int number)
+{
+  int i;
+  for(i=0;i<nslots;i++) {
+    if((slots[i].state != SLOT_EMPTY) && (slots[i].number == number))
+      return(&slots[i]);
+  }
+  return(NULL);
+}
+
+/* Get a frame from the read-ahead slots, and queue the frames after it.
+   Returns -1 if the frame wasn't read ahead */
+static int read_ahead_frame(int number, TFrame *frame)
+{
+  TReadSlot *slot;
+  float **data;
+  int i, k, n, errcode;
+
+  pthread_mutex_lock(&ahead_mutex);
+
+  errcode = -1;
+  if((slot = find_slot(number)) != NULL) {
+    while(slot->state != SLOT_DONE)
+      pthread_cond_wait(&ahead_cond, &ahead_mutex);
+    
+    errcode = slot->errcode;
+    if(!errcode && frame->allocated && 
+       ((frame->width != slot->frame.width) || (frame->height != slot->frame.height)))
+      errcode = IO_ERROR_SIZE;
+
+    if(!errcode) {
+      /* Swap data into the frame. The slot gets the old data to re-use */
+      data = frame->data;
+      frame->data = slot->frame.data;
+      slot->frame.data = data;
+      slot->frame.allocated = frame->allocated;
+      frame->width = slot->frame.width;
+      frame->height = slot->frame.height;
+      frame->allocated = 1;
+    }
+    slot->state = SLOT_EMPTY;
+  }
+
+  /* Frames are read in order, so discard any which have been passed.
+     Ones being read are discarded next time */
+  for(i=0;i<nslots;i++) {
+    if(((slots[i].state == SLOT_QUEUED) || (slots[i].state == SLOT_DONE)) &&
+       (slots[i].number <= number))
+      slots[i].state = SLOT_EMPTY;
+  }
+
+  /* Queue up the following frames */
+  for(k=1;k<=nslots;k++) {
+    n = number + k*ahead_step;
+    if(n > ahead_last)
+      break;
+    if(find_slot(n) != NULL)
+      continue;
+    for(i=0;(i<nslots) && (slots[i].state != SLOT_EMPTY);i++);
+    if(i == nslots)
+      break; /* All slots in use */
+    slots[i].number = n;
+    slots[i].state = SLOT_QUEUED;
+  }
+  pthread_cond_broadcast(&ahead_cond);
+
+  pthread_mutex_unlock(&ahead_mutex);
+
+  return(errcode);
+}
+
+#endif /* SINGLE_THREAD */
+
+/***************** BACKGROUND READING OF BYTES *******************
+ * The bytes of the frames after the current one are read by
+ * read_prefetch.c, so decoding never waits for the disk.
+ *****************************************************************/
+
+static int prefetch_window = 0; /* Number of frames to read ahead. 0 if off */
+static int seq_last, seq_step;
+
+/* Queue reads of the frames following number */
+static void prefetch_following(int number)
+{
+  char filename[MAX_NAME_LEN];
+  int k, n;
+
+  if(prefetch_window <= 0)
+    return;
+
+  prefetch_discard(number);
+  for(k=1;k<=prefetch_window;k++) {
+    n = number + k*seq_step;
+    if(n > seq_last)
+      break;
+    if(input_format == FORMAT_IPX) {
+      if(IPX_prefetch(n, &ipx_read_status))
+	break;
+    }else {
+      sprintf(filename, input_template, n);
+      if(prefetch_file(n, filename))
+	break; /* All slots in use */
+    }
+  }
+}
+
+/*****************************************************************/
 
 void read_init()
 {
-  readraw.allocated = 0;
+  int x0, y0, w, h;
 
   if(input_format == FORMAT_IPX) {
     /* IPX - one file containing all images */
@@ -50,53 +430,249 @@ void read_init()
       exit(1);
     }
     printf("done\n");
+
+    /* Check the region of interest against the frame size */
+    if(read_region(ipx_read_status.header.width, ipx_read_status.header.height,
+		   &x0, &y0, &w, &h)) {
+      printf("Error: Region of interest %d,%d,%d,%d outside %dx%d frame\n",
+	     roi_x, roi_y, roi_width, roi_height,
+	     ipx_read_status.header.width, ipx_read_status.header.height);
+      exit(1);
+    }
+  }else if(input_format == FORMAT_NPY) {
+    /* Frame cube - one file, memory mapped */
+    printf("Reading frame cube %s...", input_template);
+    fflush(stdout);
+    if(NPY_read_open(input_template, &npy_read_status)) {
+      printf("failed!\n");
+      exit(1);
+    }
+    printf("done (%d frames)\n", npy_read_status.count);
+
+    if(read_region(npy_read_status.width, npy_read_status.height,
+		   &x0, &y0, &w, &h)) {
+      printf("Error: Region of interest %d,%d,%d,%d outside %dx%d frame\n",
+	     roi_x, roi_y, roi_width, roi_height,
+	     npy_read_status.width, npy_read_status.height);
+      exit(1);
+    }
+  }else if(input_format == FORMAT_MRAW) {
+    /* Photron MRAW - one file, memory mapped */
+    printf("Reading MRAW file %s...", input_template);
+    fflush(stdout);
+    if(MRAW_read_open(input_template, &mraw_read_status)) {
+      printf("failed!\n");
+      exit(1);
+    }
+    printf("done (%d frames, %d-bit)\n", mraw_read_status.count, mraw_read_status.depth);
+
+    if(read_region(mraw_read_status.width, mraw_read_status.height,
+		   &x0, &y0, &w, &h)) {
+      printf("Error: Region of interest %d,%d,%d,%d outside %dx%d frame\n",
+	     roi_x, roi_y, roi_width, roi_height,
+	     mraw_read_status.width, mraw_read_status.height);
+      exit(1);
+    }
+  }else if(input_format == FORMAT_TIFF) {
+    /* TIFF stack - one page per frame */
+    printf("Reading TIFF stack %s...", input_template);
+    fflush(stdout);
+    if(TIFF_read_open(input_template, &tiff_read_status)) {
+      printf("failed!\n");
+      exit(1);
+    }
+    printf("done (%d frames)\n", tiff_read_status.count);
+
+    if(read_region(tiff_read_status.width, tiff_read_status.height,
+		   &x0, &y0, &w, &h)) {
+      printf("Error: Region of interest %d,%d,%d,%d outside %dx%d frame\n",
+	     roi_x, roi_y, roi_width, roi_height,
+	     tiff_read_status.width, tiff_read_status.height);
+      exit(1);
+    }
+  }else if(input_format == FORMAT_STREAM) {
+    /* Frames from standard input */
+    if(STREAM_read_open(stdin, &stream_read_status)) {
+      printf("Error: Input stream not recognised\n");
+      exit(1);
+    }
+    printf("Reading %dx%d %d-bit frames from input stream\n",
+	   stream_read_status.width, stream_read_status.height, stream_read_status.depth);
   }
 }
 
+/* Called once the frames to read are known: they will be read in
+   order up to last, step frames apart. Starts reading still images
+   ahead */
+void read_sequence(int last, int step)
+{
+#ifndef SINGLE_THREAD
+  int i;
+#endif
+
+  if(input_format == FORMAT_STREAM)
+    stream_read_status.step = step;
+  if(input_format == FORMAT_IPX)
+    ipx_read_status.step = step;
+
+  /* Read the bytes of upcoming frames in the background. Still images
+     being decoded ahead also need their bytes first */
+  seq_last = last;
+  seq_step = step;
+  prefetch_window = 0;
+  if((prefetch_frames > 0) && (step > 0)) {
+    if(input_format == FORMAT_IPX) {
+      prefetch_window = prefetch_frames;
+    }else if((input_format == FORMAT_PNG) || (input_format == FORMAT_BMP) ||
+	     (input_format == FORMAT_PNM) || (input_format == FORMAT_JPEG)) {
+      prefetch_window = prefetch_frames;
+#ifndef SINGLE_THREAD
+      if(read_ahead > 0)
+	prefetch_window += read_ahead;
+#endif
+    }
+    if((prefetch_window > 0) && prefetch_start(prefetch_window))
+      prefetch_window = 0; /* Not available in this build */
+  }
+
+#ifndef SINGLE_THREAD
+  if(((input_format != FORMAT_PNG) && (input_format != FORMAT_BMP) &&
+      (input_format != FORMAT_PNM) && (input_format != FORMAT_JPEG)) ||
+     (read_ahead <= 0))
+    return;
+
+  ahead_last = last;
+  ahead_step = step;
+  ahead_finished = 0;
+
+  /* Slots for frames read ahead */
+  slots = (TReadSlot*) malloc(sizeof(TReadSlot)*read_ahead);
+  for(i=0;i<read_ahead;i++) {
+    slots[i].state = SLOT_EMPTY;
+    slots[i].frame.allocated = 0;
+  }
+  nslots = read_ahead;
+
+  /* One thread per slot */
+  ahead_threads = (pthread_t*) malloc(sizeof(pthread_t)*nslots);
+  for(i=0;i<nslots;i++)
+    pthread_create(&ahead_threads[i], NULL, read_ahead_routine, NULL);
+#endif
+}
+
 void read_finish()
 {
+#ifndef SINGLE_THREAD
+  int i, x;
+#endif
+
+  /* Finish reads before their files are closed */
+  if(prefetch_window > 0) {
+    prefetch_stop();
+    prefetch_window = 0;
+  }
+
   if(input_format == FORMAT_IPX) {
     IPX_read_close(&ipx_read_status);
+  }else if(input_format == FORMAT_NPY) {
+    NPY_read_close(&npy_read_status);
+  }else if(input_format == FORMAT_MRAW) {
+    MRAW_read_close(&mraw_read_status);
+  }else if(input_format == FORMAT_TIFF) {
+    TIFF_read_close(&tiff_read_status);
+  }else if(input_format == FORMAT_STREAM) {
+    STREAM_read_close(&stream_read_status);
+  }
+
+#ifndef SINGLE_THREAD
+  if(nslots > 0) {
+    pthread_mutex_lock(&ahead_mutex);
+    ahead_finished = 1;
+    pthread_cond_broadcast(&ahead_cond);
+    pthread_mutex_unlock(&ahead_mutex);
+
+    for(i=0;i<nslots;i++)
+      pthread_join(ahead_threads[i], NULL);
+
+    for(i=0;i<nslots;i++) {
+      if(slots[i].frame.allocated) {
+	for(x=0;x<slots[i].frame.width;x++)
+	  free(slots[i].frame.data[x]);
+	free(slots[i].frame.data);
+      }
+    }
+    free(slots);
+    free(ahead_threads);
+    nslots = 0;
   }
+#endif
+  free(read_buffer.data);
+  read_buffer.data = NULL;
+  read_buffer.size = 0;
 }
 
 int read_frame(int number, TFrame *frame)
 {
   char filename[MAX_NAME_LEN];
   int errcode;
-  int i, j;
-  float factor;
+  double start;
 
+  start = profile_clock();
   frame->time = 0.0;
 
   if(input_format == FORMAT_IPX) { /* IPX VIDEO FORMAT */
     /* IPX code reads in a single frame and converts to floats */
+    prefetch_following(number);
     if(IPX_read_frame(number, frame, &ipx_read_status)) {
       printf("Error: Could not read frame %d from IPX file %s\n", number, input_template);
       exit(1);
     }
     
+  }else if(input_format == FORMAT_NPY) { /* FRAME CUBE */
+    if(NPY_read_frame(number, frame, &npy_read_status)) {
+      printf("Error: Could not read frame %d from %s\n", number, input_template);
+      exit(1);
+    }
+
+  }else if(input_format == FORMAT_MRAW) { /* PHOTRON MRAW */
+    if(MRAW_read_frame(number, frame, &mraw_read_status)) {
+      printf("Error: Could not read frame %d from %s\n", number, input_template);
+      exit(1);
+    }
+
+  }else if(input_format == FORMAT_TIFF) { /* TIFF STACK */
+    if(TIFF_read_frame(number, frame, &tiff_read_status)) {
+      printf("Error: Could not read frame %d from %s\n", number, input_template);
+      exit(1);
+    }
+
+  }else if(input_format == FORMAT_STREAM) { /* STANDARD INPUT */
+    errcode = STREAM_read_frame(number, frame, &stream_read_status);
+    if(errcode == IO_ERROR_SIZE) {
+      printf("Error: Size of frame %d in input stream different to previous frames\n", number);
+      exit(1);
+    }else if(errcode) {
+      printf("Error: Could not read frame %d from input stream\n", number);
+      exit(1);
+    }
+
   }else { /* A SET OF FRAME STILLS */
 
     /* Get the filename */
     sprintf(filename, input_template, number);
 
-    /* Read the data in raw format */
+    /* Read and convert straight into the frame, unless it has
+       already been read ahead */
 
-    errcode = 0;
-    switch(input_format) {
-    case FORMAT_BMP: {
-      errcode = read_bmp(filename, &readraw);
-      break;
-    }
-    case FORMAT_PNG: {
-      errcode = read_png(filename, &readraw);
-      break;
-    }
-    default: {
-      errcode = IO_ERROR_FORMAT;
-    }
-    }
+    prefetch_following(number);
+
+    errcode = -1;
+#ifndef SINGLE_THREAD
+    if(nslots > 0)
+      errcode = read_ahead_frame(number, frame);
+#endif
+    if(errcode < 0)
+      errcode = read_still(filename, frame, &read_buffer);
     
     /* Check error code */
     
@@ -114,6 +690,11 @@ int read_frame(int number, TFrame *frame)
 	printf("Error: Size of frame %s different to previous frames\n", filename);
 	break;
       }
+      case IO_ERROR_REGION: {
+	printf("Error: Region of interest %d,%d,%d,%d outside frame %s\n",
+	       roi_x, roi_y, roi_width, roi_height, filename);
+	break;
+      }
       case IO_ERROR_OTHER: {
 	printf("Error: Could not read input file %s\n", filename);
 	break;
@@ -121,70 +702,10 @@ int read_frame(int number, TFrame *frame)
       }
       exit(1);
     }
-    
-    /* Check/Allocate the frame */
-
-    /* Check if the frame has been allocated */
-    if(frame->allocated) {
-      /* Data already allocated - check same size */
-      if((frame->width != readraw.width) || (frame->height != readraw.height)) {
-	/* This should never happen - checked already */
-	printf("\n====== OUT OF CHEESE ERROR =========\n");
-	exit(1);
-      }
-      
-    }else {
-      /* Allocate memory. Note organised in COLUMNS */
-      frame->data = (float**) malloc(sizeof(float*)*readraw.width);
-      for(i=0;i!=readraw.width;i++)
-	frame->data[i] = (float*) malloc(sizeof(float)*readraw.height);
-      frame->width = readraw.width;
-      frame->height = readraw.height;
-      frame->allocated =  1;
-    }
-
-    /* Change the data to be floating point between 0 and 1 */
-    
-    factor = (float) ((1 << readraw.bpp) - 1) ;
-  
-    if(readraw.channels != 1) {
-      /* Input frame is in color */
-      if(readraw.bpp > 8) {
-	printf("\nSorry: Cannot read color images with bpp > 8 yet\n");
-	exit(1);
-      }else {
-	/* Convert red channel */
-	for(i=0;i<frame->width;i++) {
-	  for(j=0;j<frame->height;j++) {
-	    frame->data[i][j] = ((float) readraw.data[j][readraw.channels*i]) / factor;
-	  }
-	}
-      }
-    }else {
-      /* Greyscale image */
-      if(readraw.bpp > 16) {
-	printf("\nSorry: Cannot read greyscale images > 16bpp yet\n");
-	exit(1);
-      }else if(readraw.bpp > 8) {
-	/* Data has 2 bytes per pixel */
-	for(i=0;i<frame->width;i++) {
-	  for(j=0;j<frame->height;j++) {
-	    frame->data[i][j] = ( 256.0*((float) readraw.data[j][2*i]) + 
-				  ((float) readraw.data[j][2*i+1]) ) / factor;
-	  }
-	}
-      }else {
-	/* if less than 8 bit, data must be unpacked into one byte per pixel */
-	for(i=0;i<frame->width;i++) {
-	  for(j=0;j<frame->height;j++) {
-	    frame->data[i][j] = ((float) readraw.data[j][i]) / factor;
-	  }
-	}
-      }
-    }
   }
 
   frame->number = number;
-  
+
+  profile_add(PROFILE_READ, start, FRAME_BYTES(frame));
   return(0);
 }
@@ -0,0 +1,698 @@
+/**************************************************************
+ *  BACKGROUND READING OF INPUT BYTES
+ *
+ *  The bytes of the next few input frames (whole image files, or
+ *  the data of a frame in an IPX file) are read while earlier frames
+ *  are decoded and processed, so that slow (e.g. network) file
+ *  systems don't stall the pipeline. Decoders then only see bytes
+ *  which are already in memory.
+ *
+ *  On Linux, reads are submitted to the kernel with io_uring, so many
+ *  can be in flight without any extra threads. Otherwise (or if the
+ *  kernel doesn't allow io_uring, or is older than 5.6) a pool of I/O
+ *  threads is used.
+ *
+ *  Requests are identified by the frame number. Image files are
+ *  opened by the decoders with input_open(), which gives a stream
+ *  reading the bytes from memory if the file has been read already.
+ **************************************************************/
+
+#define _GNU_SOURCE /* For fopencookie */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef SINGLE_THREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "spiceweasel.h"
+
+#define PF_FREE    0
+#define PF_QUEUED  1  /* Waiting for an I/O thread */
+#define PF_OPENING 2  /* Open submitted to io_uring */
+#define PF_READING 3
+#define PF_DONE    4
+#define PF_FAILED  5
+
+#define PF_FIRST_READ 65536 /* First guess at the size of a whole file */
+
+typedef struct {
+  int state;
+  int key;          /* Frame number */
+  char name[MAX_NAME_LEN]; /* File to read, or empty for part of an open file */
+  int fd;
+  int ownfd;        /* Set if fd was opened here */
+  off_t offset;     /* Position of the bytes in the file */
+  size_t size;      /* Number of bytes wanted. 0 for the whole file */
+  unsigned char *data;
+  size_t alloc;     /* Allocated size of data */
+  size_t length;    /* Bytes read so far */
+  size_t request;   /* Size of the read in flight */
+  int discard;      /* Not wanted any more: free when finished */
+}TPrefetch;
+
+static TPrefetch *pf = NULL;
+static int npf = 0;
+
+#ifdef HAVE_LINUX_IO_URING_H
+static int pf_uring = 0;            /* Using io_uring, not threads */
+#endif
+
+#ifndef SINGLE_THREAD
+static pthread_mutex_t pf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *pf_threads;
+static int pf_nthreads = 0;
+static int pf_finished;
+#endif
+
+static void pf_lock()
+{
+#ifndef SINGLE_THREAD
+  pthread_mutex_lock(&pf_mutex);
+#endif
+}
+
+static void pf_unlock()
+{
+#ifndef SINGLE_THREAD
+  pthread_mutex_unlock(&pf_mutex);
+#endif
+}
+
+static void pf_signal()
+{
+#ifndef SINGLE_THREAD
+  pthread_cond_broadcast(&pf_cond);
+#endif
+}
+
+/* Reads only happen in the background with io_uring or I/O threads */
+#if defined(HAVE_LINUX_IO_URING_H) || !defined(SINGLE_THREAD)
+static size_t pf_guess = PF_FIRST_READ; /* Size of the last whole file + 1 */
+
+/* Make room for n bytes after those already read */
+static void pf_reserve(TPrefetch *p, size_t n)
+{
+  if(p->length + n > p->alloc) {
+    p->alloc = p->length + n;
+    p->data = (unsigned char*) realloc(p->data, p->alloc);
+  }
+}
+
+/* A request has finished. Slot data is kept for re-use */
+static void pf_finish(TPrefetch *p, int state)
+{
+  if(p->ownfd)
+    close(p->fd);
+  p->ownfd = 0;
+  p->state = state;
+  if((state == PF_DONE) && (p->size == 0))
+    pf_guess = p->length + 1;
+  if(p->discard) {
+    p->state = PF_FREE;
+    p->discard = 0;
+  }
+  pf_signal();
+}
+#endif
+
+/************************* IO_URING *****************************/
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+static struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+  unsigned pending; /* Queued but not submitted */
+}ring;
+
+/* Check that the kernel has the operations used here. Opening and
+   reading files came in Linux 5.6, after io_uring itself (5.1), as
+   did probing, so older kernels fail the probe */
+static int uring_probe()
+{
+  struct io_uring_probe *probe;
+  int ok;
+
+  probe = (struct io_uring_probe*) calloc(1, sizeof(struct io_uring_probe) +
+					  256*sizeof(struct io_uring_probe_op));
+  ok = (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0) &&
+    (probe->last_op >= IORING_OP_READ) &&
+    (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return(ok ? 0 : 1);
+}
+
+static int uring_setup(unsigned entries)
+{
+  struct io_uring_params params;
+  unsigned char *sq, *cq;
+
+  memset(&params, 0, sizeof(params));
+  if((ring.fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+    return(1); /* Not supported or not allowed */
+  if(uring_probe()) {
+    close(ring.fd);
+    return(1); /* Use I/O threads instead */
+  }
+
+  ring.entries = params.sq_entries;
+  ring.sq_map_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  ring.cq_map_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  ring.sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+
+  ring.sq_map = mmap(NULL, ring.sq_map_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.cq_map = mmap(NULL, ring.cq_map_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = (struct io_uring_sqe*) mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if((ring.sq_map == MAP_FAILED) || (ring.cq_map == MAP_FAILED) ||
+     (ring.sqes == MAP_FAILED)) {
+    close(ring.fd);
+    return(1);
+  }
+
+  sq = (unsigned char*) ring.sq_map;
+  ring.sq_head = (unsigned*) (sq + params.sq_off.head);
+  ring.sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned*) (sq + params.sq_off.array);
+
+  cq = (unsigned char*) ring.cq_map;
+  ring.cq_head = (unsigned*) (cq + params.cq_off.head);
+  ring.cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  ring.pending = 0;
+  return(0);
+}
+
+static void uring_close()
+{
+  munmap(ring.sqes, ring.sqes_size);
+  munmap(ring.cq_map, ring.cq_map_size);
+  munmap(ring.sq_map, ring.sq_map_size);
+  close(ring.fd);
+}
+
+/* Add a request to the submission queue. Returns non-zero if full */
+static int uring_queue(int opcode, int fd, void *addr, unsigned len, off_t offset, int slot)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+
+  tail = *ring.sq_tail;
+  if(tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.entries)
+    return(1);
+
+  index = tail & *ring.sq_mask;
+  sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) addr;
+  sqe->len = len;
+  sqe->off = offset;
+  if(opcode == IORING_OP_OPENAT)
+    sqe->open_flags = O_RDONLY;
+  sqe->user_data = slot;
+  ring.sq_array[index] = index;
+
+  /* Kernel sees the entry once the tail moves */
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.pending++;
+  return(0);
+}
+
+/* Submit queued requests, optionally waiting for one to complete */
+static void uring_enter(int wait)
+{
+  int n;
+
+  n = syscall(__NR_io_uring_enter, ring.fd, ring.pending, wait ? 1 : 0,
+	      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if(n > 0)
+    ring.pending -= n;
+}
+
+/* Read the next part of a slot */
+static void uring_read(TPrefetch *p)
+{
+  if(p->size > 0) {
+    p->request = p->size - p->length;
+  }else {
+    /* Whole file: start with the size of the last one, then double */
+    p->request = (p->length == 0) ? pf_guess : p->length;
+  }
+  pf_reserve(p, p->request);
+  if(uring_queue(IORING_OP_READ, p->fd, p->data + p->length, p->request,
+		 p->offset + p->length, p - pf))
+    pf_finish(p, PF_FAILED);
+}
+
+/* Handle a completed request */
+static void uring_complete(TPrefetch *p, int res)
+{
+  if(res < 0) {
+    pf_finish(p, PF_FAILED);
+    return;
+  }
+
+  if(p->state == PF_OPENING) {
+    p->fd = res;
+    p->ownfd = 1;
+    p->state = PF_READING;
+    uring_read(p);
+    return;
+  }
+
+  p->length += res;
+  if(p->size > 0) {
+    if(p->length == p->size)
+      pf_finish(p, PF_DONE);
+    else if(res == 0)
+      pf_finish(p, PF_FAILED); /* File is truncated */
+    else
+      uring_read(p);
+  }else {
+    /* A short read means the end of the file */
+    if(res < p->request)
+      pf_finish(p, PF_DONE);
+    else
+      uring_read(p);
+  }
+}
+
+/* Handle all completed requests, then submit any new ones */
+static void uring_reap()
+{
+  struct io_uring_cqe *cqe;
+  unsigned head;
+
+  head = *ring.cq_head;
+  while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &ring.cqes[head & *ring.cq_mask];
+    uring_complete(&pf[cqe->user_data], cqe->res);
+    head++;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+  if(ring.pending > 0)
+    uring_enter(0);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/************************* I/O THREADS **************************/
+
+#ifndef SINGLE_THREAD
+/* Read the bytes for a slot with ordinary system calls.
+   Called without the lock: the slot belongs to this thread */
+static int pf_read_slot(TPrefetch *p)
+{
+  struct stat st;
+  ssize_t n;
+  size_t want;
+
+  want = p->size;
+  if(p->name[0]) {
+    if((p->fd = open(p->name, O_RDONLY)) < 0)
+      return(1);
+    p->ownfd = 1;
+    if(fstat(p->fd, &st))
+      return(1);
+    want = st.st_size;
+  }
+  pf_reserve(p, want + 1);
+
+  while(p->length < want) {
+    n = pread(p->fd, p->data + p->length, want - p->length, p->offset + p->length);
+    if(n <= 0)
+      return(1);
+    p->length += n;
+  }
+  return(0);
+}
+
+static void *pf_thread(void *args)
+{
+  TPrefetch *p;
+  int i, failed;
+
+  pthread_mutex_lock(&pf_mutex);
+  while(!pf_finished) {
+    /* Earliest frame waiting */
+    p = NULL;
+    for(i=0;i<npf;i++) {
+      if((pf[i].state == PF_QUEUED) && ((p == NULL) || (pf[i].key < p->key)))
+	p = &pf[i];
+    }
+    if(p == NULL) {
+      pthread_cond_wait(&pf_cond, &pf_mutex);
+      continue;
+    }
+    p->state = PF_READING;
+    pthread_mutex_unlock(&pf_mutex);
+
+    failed = pf_read_slot(p);
+
+    pthread_mutex_lock(&pf_mutex);
+    pf_finish(p, failed ? PF_FAILED : PF_DONE);
+  }
+  pthread_mutex_unlock(&pf_mutex);
+  return(NULL);
+}
+#endif
+
+/* Wait for a slot to finish. Called with the lock held */
+static void pf_wait(TPrefetch *p)
+{
+  while((p->state != PF_DONE) && (p->state != PF_FAILED)) {
+#ifdef HAVE_LINUX_IO_URING_H
+    if(pf_uring) {
+      uring_enter(1);
+      uring_reap();
+      continue;
+    }
+#endif
+#ifndef SINGLE_THREAD
+    pthread_cond_wait(&pf_cond, &pf_mutex);
+#endif
+  }
+}
+
+/* Find the slot for a frame. Returns NULL if not queued */
+static TPrefetch *pf_find(int key)
+{
+  int i;
+  for(i=0;i<npf;i++) {
+    if((pf[i].state != PF_FREE) && !pf[i].discard && (pf[i].key == key))
+      return(&pf[i]);
+  }
+  return(NULL);
+}
+
+/************************* INTERFACE ****************************/
+
+/* Start reading in the background, with up to n frames read ahead.
+   Returns non-zero if this isn't possible */
+int prefetch_start(int n)
+{
+  if(n <= 0)
+    return(1);
+
+  pf = (TPrefetch*) calloc(n, sizeof(TPrefetch));
+  npf = n;
+
+#ifdef HAVE_LINUX_IO_URING_H
+  if(uring_setup(2*n) == 0) {
+    pf_uring = 1;
+    return(0);
+  }
+#endif
+
+#ifndef SINGLE_THREAD
+  /* I/O threads spend most of their time waiting */
+  pf_finished = 0;
+  pf_threads = (pthread_t*) malloc(sizeof(pthread_t)*n);
+  for(pf_nthreads=0;pf_nthreads<n;pf_nthreads++)
+    pthread_create(&pf_threads[pf_nthreads], NULL, pf_thread, NULL);
+  return(0);
+#else
+  free(pf);
+  pf = NULL;
+  npf = 0;
+  return(1);
+#endif
+}
+
+/* Queue a request. Returns 0 if queued (or already queued),
+   1 if there are no free slots */
+static int pf_queue(int key, char *name, int fd, off_t offset, size_t size)
+{
+  TPrefetch *p;
+  int i;
+
+  pf_lock();
+  if(npf == 0) {
+    pf_unlock();
+    return(1);
+  }
+#ifdef HAVE_LINUX_IO_URING_H
+  if(pf_uring)
+    uring_reap(); /* Keep opened files moving */
+#endif
+
+  if(pf_find(key) != NULL) {
+    pf_unlock();
+    return(0);
+  }
+  for(i=0;(i<npf) && (pf[i].state != PF_FREE);i++);
+  if(i == npf) {
+    pf_unlock();
+    return(1);
+  }
+
+  p = &pf[i];
+  p->key = key;
+  p->name[0] = 0;
+  if(name != NULL)
+    strcpy(p->name, name);
+  p->fd = fd;
+  p->ownfd = 0;
+  p->offset = offset;
+  p->size = size;
+  p->length = 0;
+  p->discard = 0;
+
+#ifdef HAVE_LINUX_IO_URING_H
+  if(pf_uring) {
+    if(name != NULL) {
+      p->state = PF_OPENING;
+      if(uring_queue(IORING_OP_OPENAT, AT_FDCWD, p->name, 0, 0, i))
+	pf_finish(p, PF_FAILED);
+    }else {
+      p->state = PF_READING;
+      uring_read(p);
+    }
+    uring_enter(0);
+    pf_unlock();
+    return(0);
+  }
+#endif
+
+  p->state = PF_QUEUED;
+  pf_signal();
+  pf_unlock();
+  return(0);
+}
+
+/* Read a whole image file for frame key */
+int prefetch_file(int key, char *filename)
+{
+  return(pf_queue(key, filename, -1, 0, 0));
+}
+
+/* Read size bytes at offset in an open file, for frame key */
+int prefetch_range(int key, int fd, off_t offset, size_t size)
+{
+  return(pf_queue(key, NULL, fd, offset, size));
+}
+
+/* Get the bytes read with prefetch_range, swapping them into buffer.
+   Returns 0 if read, -1 if not queued, IO_ERROR_OTHER if reading failed */
+int prefetch_take(int key, TBuffer *buffer)
+{
+  TPrefetch *p;
+  unsigned char *data;
+  size_t alloc;
+  int errcode;
+
+  pf_lock();
+  if((npf == 0) || ((p = pf_find(key)) == NULL) || p->name[0]) {
+    pf_unlock();
+    return(-1);
+  }
+  pf_wait(p);
+
+  errcode = IO_ERROR_OTHER;
+  if(p->state == PF_DONE) {
+    /* Slot gets the old buffer to re-use */
+    data = (unsigned char*) buffer->data;
+    alloc = buffer->size;
+    buffer->data = p->data;
+    buffer->size = p->alloc;
+    p->data = data;
+    p->alloc = alloc;
+    errcode = 0;
+  }
+  p->state = PF_FREE;
+  pf_unlock();
+  return(errcode);
+}
+
+/* Discard requests for frames before key, which won't be needed */
+void prefetch_discard(int key)
+{
+  int i;
+
+  pf_lock();
+  for(i=0;i<npf;i++) {
+    if((pf[i].state == PF_FREE) || (pf[i].key >= key))
+      continue;
+    if((pf[i].state == PF_QUEUED) || (pf[i].state == PF_DONE) || (pf[i].state == PF_FAILED))
+      pf[i].state = PF_FREE;
+    else
+      pf[i].discard = 1; /* Freed when finished */
+  }
+  pf_unlock();
+}
+
+/* Wait for everything in flight, then stop */
+void prefetch_stop()
+{
+  int i;
+
+  if(npf == 0)
+    return;
+
+#ifdef HAVE_LINUX_IO_URING_H
+  if(pf_uring) {
+    for(i=0;i<npf;i++) {
+      while((pf[i].state == PF_OPENING) || (pf[i].state == PF_READING)) {
+	uring_enter(1);
+	uring_reap();
+      }
+    }
+    uring_close();
+    pf_uring = 0;
+  }
+#endif
+#ifndef SINGLE_THREAD
+  if(pf_nthreads > 0) {
+    pthread_mutex_lock(&pf_mutex);
+    pf_finished = 1;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_mutex);
+    for(i=0;i<pf_nthreads;i++)
+      pthread_join(pf_threads[i], NULL);
+    free(pf_threads);
+    pf_nthreads = 0;
+  }
+#endif
+
+  for(i=0;i<npf;i++) {
+    if(pf[i].ownfd)
+      close(pf[i].fd);
+    free(pf[i].data);
+  }
+  free(pf);
+  pf = NULL;
+  npf = 0;
+}
+
+/********************** MEMORY STREAMS **************************/
+
+typedef struct {
+  unsigned char *data;
+  size_t size, pos;
+}TMemFile;
+
+static ssize_t mem_read(void *cookie, char *buf, size_t n)
+{
+  TMemFile *m = (TMemFile*) cookie;
+  if(n > m->size - m->pos)
+    n = m->size - m->pos;
+  memcpy(buf, m->data + m->pos, n);
+  m->pos += n;
+  return(n);
+}
+
+static int mem_seek(void *cookie, off64_t *offset, int whence)
+{
+  TMemFile *m = (TMemFile*) cookie;
+  off64_t pos;
+
+  pos = *offset;
+  if(whence == SEEK_CUR)
+    pos += m->pos;
+  else if(whence == SEEK_END)
+    pos += m->size;
+  if((pos < 0) || (pos > m->size))
+    return(-1);
+  m->pos = pos;
+  *offset = pos;
+  return(0);
+}
+
+static int mem_close(void *cookie)
+{
+  TMemFile *m = (TMemFile*) cookie;
+  free(m->data);
+  free(m);
+  return(0);
+}
+
+/* Open an input image file. If it has been read in the background,
+   the stream reads from memory (and frees it when closed) */
+FILE *input_open(char *filename)
+{
+  cookie_io_functions_t funcs = {mem_read, NULL, mem_seek, mem_close};
+  TPrefetch *p;
+  TMemFile *m;
+  int i;
+
+  pf_lock();
+  p = NULL;
+  for(i=0;i<npf;i++) {
+    if((pf[i].state != PF_FREE) && !pf[i].discard && pf[i].name[0] &&
+       (strcmp(pf[i].name, filename) == 0))
+      p = &pf[i];
+  }
+  if(p == NULL) {
+    pf_unlock();
+    return(fopen(filename, "rb"));
+  }
+
+  pf_wait(p);
+  if(p->state != PF_DONE) {
+    /* Let fopen report the problem */
+    p->state = PF_FREE;
+    pf_unlock();
+    return(fopen(filename, "rb"));
+  }
+
+  /* Hand the bytes over to the stream */
+  m = (TMemFile*) malloc(sizeof(TMemFile));
+  m->data = p->data;
+  m->size = p->length;
+  m->pos = 0;
+  p->data = NULL;
+  p->alloc = 0;
+  p->state = PF_FREE;
+  pf_unlock();
+
+  return(fopencookie(m, "rb", funcs));
+}
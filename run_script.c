@@ -32,17 +32,49 @@
 
 #include <stdlib.h>
 
+#ifndef SINGLE_THREAD
+#include <pthread.h>
+#endif
+
 #include "spiceweasel.h"
 #include "script.h"
+#include "profile.h"
 
 TFrame *tmp_frame; /* Array of intermediate frames */
-TFrame **frame_list; /* A list of frames for concatenation */
+TFrame ***frame_list; /* A list of frames for each concatenation step */
+TBuffer *background_state; /* Running sums or rescan flags of backgrounds */
+int background_started = 0;
+int profile_background, profile_step; /* First profiler entries */
+
+#ifndef SINGLE_THREAD
+/* Steps which don't depend on each other run at the same time on a
+   pool of threads. The processing thread runs steps too */
+#define STEP_WAITING 0
+#define STEP_RUNNING 1
+#define STEP_DONE    2
+
+static void *step_routine(void *args);
+
+static pthread_mutex_t step_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t step_cond = PTHREAD_COND_INITIALIZER;
+static int *step_state;
+static int steps_left = 0;  /* Steps not finished for the current frame */
+static int nstep_threads = 0;
+
+/* Frames for the steps being run */
+static TFrame **step_framebuffer;
+static int step_nframes, step_centreframe;
+static TFrame **step_output; /* One for each output */
+#endif
 
 /* Initialize variables needed to run script */
 void process_init()
 {
-  int i;
+  int i, j;
+#ifndef SINGLE_THREAD
   int maxc;
+#endif
+  char name[PROFILE_NAME_LEN];
 
   if(command.ntemp > 0) {
     /* Need intermediate frames */
@@ -52,127 +84,297 @@ void process_init()
     }
   }
 
-  /* Concatenate: Needs a separate array of vectors. Find largest concatenation */
-  maxc = 0;
-  for(i=0;i<command.nsteps;i++) {
-    if(command.step[i].method == PROC_CONCATENATE) {
-      if(command.step[i].nargs > maxc)
-	maxc = command.step[i].nargs;
+  /* Backgrounds are updated from one frame to the next */
+  if(command.nbackground > 0)
+    background_state = (TBuffer*) calloc(command.nbackground, sizeof(TBuffer));
+
+  /* Time the backgrounds and steps */
+  if(profiling) {
+    for(i=0;i<command.nbackground;i++) {
+      background_name(i, name, PROFILE_NAME_LEN);
+      j = profile_entry(name);
+      if(i == 0)
+	profile_background = j;
+    }
+    for(i=0;i<command.nsteps;i++) {
+      step_name(i, name, PROFILE_NAME_LEN);
+      j = profile_entry(name);
+      if(i == 0)
+	profile_step = j;
     }
   }
-  if(maxc > 0) {
-    frame_list = (TFrame**) malloc(sizeof(TFrame*) * maxc);
+
+  /* Concatenate and expressions: Need a separate array of vectors
+     for each step, as they may run at the same time */
+  frame_list = (TFrame***) malloc(sizeof(TFrame**) * (command.nsteps+1));
+  for(i=0;i<command.nsteps;i++) {
+    frame_list[i] = NULL;
+    if((command.step[i].method == PROC_CONCATENATE) || (command.step[i].method == PROC_EXPR))
+      frame_list[i] = (TFrame**) malloc(sizeof(TFrame*) * (command.step[i].nargs+1));
+  }
+
+#ifndef SINGLE_THREAD
+  /* Threads to run independent steps */
+  maxc = script_threads;
+  if(maxc > command.nsteps)
+    maxc = command.nsteps;
+  if(command.parallel && (maxc > 1)) {
+    step_state = (int*) malloc(sizeof(int)*command.nsteps);
+    for(i=1;i<maxc;i++) {
+      pthread_t thread;
+      if(pthread_create(&thread, NULL, step_routine, NULL))
+	break;
+      pthread_detach(thread);
+    }
+    nstep_threads = i;
+    printf("Running independent script steps on %d threads\n", nstep_threads);
   }
+#endif
 }
 
-TFrame *get_frame(int id, TFrame *input, TFrame *output)
+/* Get a frame from its ID. Input frames are read straight from the
+   circular buffer, offset from the centre frame */
+TFrame *get_frame(int id, TFrame **framebuffer, int nframes, int centreframe, TFrame **output)
 {
   if(id == UNKNOWN_FRAME) {
     printf("Error in compiled script: Unknown frame\n");
     exit(1);
-  }else if(id == OUTPUT_FRAME) {
-    return(output);
-  }else if(id == INPUT_FRAME) {
-    return(input);
+  }else if(IS_OUTPUT_FRAME(id)) {
+    return(output[OUTPUT_NUMBER(id)]);
+  }else if(IS_INPUT_FRAME(id)) {
+    return(framebuffer[(centreframe + INPUT_FRAME_OFFSET(id) + nframes) % nframes]);
   }
   return(&(tmp_frame[id]));
 }
 
-#define GETFRAME(id) get_frame(id, framebuffer[centreframe], output)
+#define GETFRAME(id) get_frame(id, framebuffer, nframes, centreframe, output)
 
 /******************* RUN SCRIPT *****************/
 
-int process_frames(TFrame **framebuffer, int nframes, int centreframe, TFrame *output)
+/* Run step i of the script */
+static void run_step(int i, TFrame **framebuffer, int nframes, int centreframe,
+		     TFrame **output)
 {
-  int i, j;
+  int j, nlist;
   TProcess *proc;
   TFrame *in, *out, *f;
+  double start, bytes;
+
+  start = profile_clock();
+  nlist = 0;
+  in = f = (TFrame*) NULL;
+  proc = &(command.step[i]);
 
-  if(command.minimum_frame != UNKNOWN_FRAME) {
-    /* Calculate the minimum background */
-    minimum_frames(framebuffer, nframes, &(tmp_frame[command.minimum_frame]), -1);
+  /* Get pointers to the input and outputs */
+  if(proc->method != PROC_CONCATENATE) { /* concatenate has no input */
+    in = GETFRAME(proc->input);
   }
-  if(command.average_frame != UNKNOWN_FRAME) {
-    /* Calculate average background */
-    average_frames(framebuffer, nframes, &(tmp_frame[command.average_frame]), -1);
+  out = GETFRAME(proc->result);
+
+  switch(proc->method) {
+  case PROC_SUBTRACT: {
+    /* Get pointer to the argument */
+    f = GETFRAME(proc->args[0].frame);
+    subtract_background(in, f, out);
+    break;
   }
-  /* Go through commands */
+  case PROC_NORMALIZE: {
+    normalize_frame(in, out);
+    break;
+  }
+  case PROC_AMPLIFY: {
+    amplify_frame(in, out, proc->args[0].fval);
+    break;
+  }
+  case PROC_GAMMA: {
+    gamma_correct_frame(in, out, proc->args[0].fval);
+    break;
+  }
+  case PROC_OFFSET: {
+    offset_frame(in, out, proc->args[0].fval);
+    break;
+  }
+  case PROC_DESPECKLE_MEDIAN: {
+    despeckle_median(in, out, proc->args[0].ival);
+    break;
+  }
+  case PROC_KUWAHARA: {
+    kuwahara_filter(in, out, proc->args[0].ival);
+    break;
+  }
+  case PROC_SHARPEN: {
+    sharpen_simple(in, out, proc->args[0].fval);
+    break;
+  }
+  case PROC_UNSHARP_MASK: {
+    sharpen_unsharp(in, out, proc->args[0].fval, proc->args[1].fval);
+    break;
+  }
+  case PROC_CONCATENATE: {
+    /* Build an array of frames */
+    for(j=0;j<proc->nargs;j++) {
+      frame_list[i][j] = GETFRAME(proc->args[j].frame);
+    }
+    concat_frames(out, proc->nargs, frame_list[i]);
+    nlist = proc->nargs;
+    break;
+  }
+  case PROC_EXPR: {
+    /* The input, then the frames used in the expression. These are
+       the arguments which have names, before the operations */
+    frame_list[i][0] = in;
+    for(j=0;(j<proc->nargs) && (proc->args[j].name != NULL);j++) {
+      frame_list[i][j+1] = GETFRAME(proc->args[j].frame);
+    }
+    expr_frame(frame_list[i], j, proc->args + j, proc->nargs - j, out);
+    nlist = j+1;
+    break;
+  }
+  case PROC_COPY: {
+    copy_frame(in, out);
+    break;
+  }
+  case PROC_GAUSSBLUR: {
+    gauss_blur(in, out, proc->args[0].fval);
+    break;
+  }
+  case PROC_CROP: {
+    crop_frame(in, out, proc->args[0].ival, proc->args[1].ival,
+	       proc->args[2].ival, proc->args[3].ival);
+    break;
+  }
+  case PROC_BIN: {
+    bin_frame(in, out, proc->args[0].ival, proc->args[1].ival);
+    break;
+  }
+  default: {
+    printf("Error in compiled script: Unknown function %d\n", proc->method);
+    exit(1);
+  }
+  }
+
+  if(profiling) {
+    /* Frames read and written once */
+    bytes = FRAME_BYTES(out);
+    if(proc->method != PROC_CONCATENATE)
+      bytes += FRAME_BYTES(in);
+    if(proc->method == PROC_SUBTRACT)
+      bytes += FRAME_BYTES(f);
+    for(j=(proc->method == PROC_EXPR) ? 1 : 0;j<nlist;j++)
+      bytes += FRAME_BYTES(frame_list[i][j]);
+    profile_add(profile_step + i, start, bytes);
+  }
+}
+
+#ifndef SINGLE_THREAD
+/* Find a step which is ready to run. Called with step_mutex locked.
+   Returns -1 if there are none */
+static int next_step()
+{
+  int i, j;
+  TProcess *proc;
+
   for(i=0;i<command.nsteps;i++) {
+    if(step_state[i] != STEP_WAITING)
+      continue;
     proc = &(command.step[i]);
+    for(j=0;(j<proc->ndep) && (step_state[proc->dep[j]] == STEP_DONE);j++);
+    if(j == proc->ndep)
+      return(i);
+  }
+  return(-1);
+}
 
-    /* Get pointers to the input and outputs */
-    if(proc->method != PROC_CONCATENATE) { /* concatenate has no input */
-      in = GETFRAME(proc->input);
-    }
-    out = GETFRAME(proc->result);
-
-    switch(proc->method) {
-    case PROC_SUBTRACT: {
-      /* Get pointer to the argument */
-      f = GETFRAME(proc->args[0].frame);
-      subtract_background(in, f, out);
-      break;
-    }
-    case PROC_NORMALIZE: {
-      normalize_frame(in, out);
-      break;
-    }
-    case PROC_AMPLIFY: {
-      amplify_frame(in, out, proc->args[0].fval);
-      break;
-    }
-    case PROC_GAMMA: {
-      gamma_correct_frame(in, out, proc->args[0].fval);
-      break;
-    }
-    case PROC_OFFSET: {
-      offset_frame(in, out, proc->args[0].fval);
-      break;
-    }
-    case PROC_DESPECKLE_MEDIAN: {
-      despeckle_median(in, out, proc->args[0].ival);
-      break;
-    }
-    case PROC_KUWAHARA: {
-      kuwahara_filter(in, out, proc->args[0].ival);
-      break;
-    }
-    case PROC_SHARPEN: {
-      sharpen_simple(in, out, proc->args[0].fval);
-      break;
-    }
-    case PROC_UNSHARP_MASK: {
-      sharpen_unsharp(in, out, proc->args[0].fval, proc->args[1].fval);
-      break;
-    }
-    case PROC_CONCATENATE: {
-      /* Build an array of frames */
-      for(j=0;j<proc->nargs;j++) {
-	frame_list[j] = GETFRAME(proc->args[j].frame);
-      }
-      concat_frames(out, proc->nargs, frame_list);
-      break;
-    }
-    case PROC_COPY: {
-      copy_frame(in, out);
-      break;
-    }
-    case PROC_GAUSSBLUR: {
-      gauss_blur(in, out, proc->args[0].fval);
-      break;
+/* Run steps until all are finished for this frame.
+   Called with step_mutex locked */
+static void run_steps()
+{
+  int i;
+
+  while(steps_left > 0) {
+    if((i = next_step()) < 0) {
+      pthread_cond_wait(&step_cond, &step_mutex);
+      continue;
     }
-    default: {
-      printf("Error in compiled script: Unknown function %d\n", proc->method);
-      exit(1);
+    step_state[i] = STEP_RUNNING;
+    pthread_mutex_unlock(&step_mutex);
+
+    run_step(i, step_framebuffer, step_nframes, step_centreframe, step_output);
+
+    pthread_mutex_lock(&step_mutex);
+    step_state[i] = STEP_DONE;
+    steps_left--;
+    pthread_cond_broadcast(&step_cond);
+  }
+}
+
+static void *step_routine(void *args)
+{
+  pthread_mutex_lock(&step_mutex);
+  while(1) {
+    if(steps_left == 0) {
+      /* Wait for the next frame */
+      pthread_cond_wait(&step_cond, &step_mutex);
+      continue;
     }
+    run_steps();
+  }
+  return(NULL);
+}
+#endif
+
+int process_frames(TFrame **framebuffer, int nframes, int centreframe, TFrame **output)
+{
+  int i, half, size;
+  TBackground *bg;
+  void *state;
+  double start;
+
+  /* Calculate backgrounds, moving each window on by one frame */
+  for(i=0;i<command.nbackground;i++) {
+    start = profile_clock();
+    bg = &(command.background[i]);
+    half = (((bg->width > 0) ? bg->width : nframes) - 1)/2;
+    size = framebuffer[centreframe]->width * framebuffer[centreframe]->height;
+    if(bg->method == BG_MINIMUM) {
+      state = reserve_buffer(&(background_state[i]), size);
+      window_minimum(framebuffer, nframes, centreframe, half, bg->x, bg->y, bg->w, bg->h,
+		     (char*) state, !background_started, &(tmp_frame[bg->frame]));
+    }else {
+      state = reserve_buffer(&(background_state[i]), size*sizeof(double));
+      window_average(framebuffer, nframes, centreframe, half, bg->x, bg->y, bg->w, bg->h,
+		     (double*) state, !background_started, &(tmp_frame[bg->frame]));
     }
-    
+    /* The region of the frames entering and leaving the window, and the result */
+    profile_add(profile_background + i, start, 3*FRAME_BYTES(&(tmp_frame[bg->frame])));
   }
-  /* Set number of output frame */
-  output->number = framebuffer[centreframe]->number;
+  background_started = 1;
+
+#ifndef SINGLE_THREAD
+  if(nstep_threads > 1) {
+    /* Start the steps on all threads, then help run them */
+    pthread_mutex_lock(&step_mutex);
+    step_framebuffer = framebuffer;
+    step_nframes = nframes;
+    step_centreframe = centreframe;
+    step_output = output;
+    for(i=0;i<command.nsteps;i++)
+      step_state[i] = STEP_WAITING;
+    steps_left = command.nsteps;
+    pthread_cond_broadcast(&step_cond);
+    run_steps();
+    pthread_mutex_unlock(&step_mutex);
+  }else
+#endif
+  /* Go through commands */
+  for(i=0;i<command.nsteps;i++)
+    run_step(i, framebuffer, nframes, centreframe, output);
 
-  /* Set time of output frame */
-  output->time = framebuffer[centreframe]->time;
+  /* Set number and time of output frames */
+  for(i=0;i<command.noutputs;i++) {
+    output[i]->number = framebuffer[centreframe]->number;
+    output[i]->time = framebuffer[centreframe]->time;
+  }
 
   return(0);
 }
@@ -20,6 +20,19 @@
 #define OUTPUT_FRAME   -2
 #define INPUT_FRAME    -3
 
+/* Neighbouring input frames INPUT[k], k frames after the centre of
+   the buffer (before if negative), have IDs below INPUT_FRAME */
+#define MAX_INPUT_OFFSET 4096
+#define INPUT_OFFSET_FRAME(k) (((k) == 0) ? INPUT_FRAME : INPUT_FRAME - MAX_INPUT_OFFSET - 1 + (k))
+#define IS_INPUT_FRAME(id) (((id) <= INPUT_FRAME) && ((id) >= INPUT_FRAME - 2*MAX_INPUT_OFFSET - 1))
+#define INPUT_FRAME_OFFSET(id) (((id) == INPUT_FRAME) ? 0 : (id) - INPUT_FRAME + MAX_INPUT_OFFSET + 1)
+
+/* Output k of the script. OUTPUT is output 0, and named outputs
+   (OUTPUT.name) have IDs below the input frames */
+#define OUTPUT_ID(k) (((k) == 0) ? OUTPUT_FRAME : INPUT_FRAME - 2*MAX_INPUT_OFFSET - 1 - (k))
+#define IS_OUTPUT_FRAME(id) (((id) == OUTPUT_FRAME) || ((id) < INPUT_FRAME - 2*MAX_INPUT_OFFSET - 1))
+#define OUTPUT_NUMBER(id) (((id) == OUTPUT_FRAME) ? 0 : INPUT_FRAME - 2*MAX_INPUT_OFFSET - 1 - (id))
+
 /* Processing methods */
 #define PROC_NULL            -1
 #define PROC_SUBTRACT         0
@@ -34,14 +47,39 @@
 #define PROC_CONCATENATE      9
 #define PROC_COPY            10
 #define PROC_GAUSSBLUR       11
+#define PROC_EXPR            12
+#define PROC_CROP            13
+#define PROC_BIN             14
+
+/* Operations in a compiled expression (EXPR). The arguments of the
+   step are the frames used, then one operation each, applied to a
+   stack of values: ival is the operation, fval the value of a
+   constant and frame the number of the frame argument to read */
+#define EXPR_CONST  0  /* Push fval */
+#define EXPR_INPUT  1  /* Push the input of the step (X) */
+#define EXPR_FRAME  2  /* Push frame argument number frame */
+#define EXPR_NEG    3
+#define EXPR_ABS    4
+#define EXPR_LOG    5
+#define EXPR_EXP    6
+#define EXPR_ADD    7  /* Binary operations pop two values */
+#define EXPR_SUB    8
+#define EXPR_MUL    9
+#define EXPR_DIV   10
+#define EXPR_MIN   11
+#define EXPR_MAX   12
+#define EXPR_POW   13
+#define EXPR_CLAMP 14  /* Pops three values: clamp(a, low, high) */
+
+#define EXPR_STACK 16  /* Deepest stack an expression can use */
 
 /* Some processing methods cannot have the same input as output.
    List these in the following array, end array with PROC_NULL */
 
 #ifdef SPSORIGIN
-int proc_noio[6] = {PROC_DESPECKLE_MEDIAN, PROC_KUWAHARA, 
+int proc_noio[8] = {PROC_DESPECKLE_MEDIAN, PROC_KUWAHARA, 
 		    PROC_SHARPEN, PROC_UNSHARP_MASK, 
-		    PROC_GAUSSBLUR, PROC_NULL};
+		    PROC_GAUSSBLUR, PROC_CROP, PROC_BIN, PROC_NULL};
 #else
 extern int *proc_noio;
 #endif
@@ -56,6 +94,7 @@ typedef struct { /* An argument to a processing step */
   float fval;
   int ival;
   int frame; /* ID of frame */
+  int sweep; /* Index of the list of values this is taken from, or -1 */
 }TProcArg;
 
 typedef struct {  /* Define a processing step */
@@ -64,16 +103,49 @@ typedef struct {  /* Define a processing step */
   int input;        /* Input frame */
   TProcArg *args;   /* Array of arguments */
   int result;       /* Result frame */
+  int ndep;         /* Number of earlier steps which must finish first */
+  int *dep;         /* Indices of those steps */
 }TProcess;
 
+/* Background frames, calculated over a window of frames centred on
+   the input before the steps are run */
+#define BG_MINIMUM 0
+#define BG_AVERAGE 1
+
+typedef struct { /* A background frame */
+  int method;       /* BG_MINIMUM or BG_AVERAGE */
+  int width;        /* Number of frames (odd). 0 for the buffer size given */
+  int frame;        /* ID of the result */
+  int x, y, w, h;   /* Region of the input used. w, h = 0 to the edge */
+}TBackground;
+
+/* Set if a background only uses part of the input */
+#define BACKGROUND_REGION(bg) ((bg)->x || (bg)->y || (bg)->w || (bg)->h)
+
+typedef struct { /* A frame written out by the script */
+  char *name;       /* Name after "OUTPUT.", or NULL for OUTPUT */
+  char *file;       /* File given in the script (WRITE), or NULL */
+  int depth;        /* Bits per pixel given in the script, or 0 */
+  char *suffix;     /* Added to the file name for each variant, or NULL */
+}TOutput;
+
 typedef struct { /* Set of sequential commands for processing frames */
   int ntemp; /* Number of intermediate frames needed */
-  int minimum_frame; /* The ID of the minimum frame */
-  int average_frame; /* ID of average frame */
+  int nlogical; /* Number of intermediate frames before sharing buffers */
+  int nmerged;  /* Steps removed because they repeat earlier ones */
+  int nunused;  /* Steps removed because OUTPUT doesn't need them */
+  int parallel; /* Set if some steps can run at the same time */
+  int nbackground;   /* Number of background frames */
+  TBackground *background;
+  int noutputs;     /* Number of outputs, including OUTPUT */
+  TOutput *output;
   int nsteps;  /* Number of processing steps */
   TProcess *step; /* List of processing steps */
 }TCommands;
 
+/* Evaluate a compiled expression, in process_frames.c */
+int expr_frame(TFrame **list, int nframes, TProcArg *code, int ncode, TFrame *output);
+
 /********* GLOBAL VARIABLES ***********/
 #ifdef SPSORIGIN
 #define GLOBAL
@@ -45,6 +45,71 @@ for thread in "--enable-threads" ""; do
 	done
 done
 
+### Regression checks on generated frames
+TESTDIR=${SWPATH}/testframes
+rm -rf $TESTDIR
+mkdir -p $TESTDIR
+for f in $(seq 1 20); do
+	LC_ALL=C awk -v seed=$f 'BEGIN{srand(seed); printf "P5\n32 24\n255\n";
+		for(i=0;i<32*24;i++) printf "%c", int(rand()*256)}' > $TESTDIR/in_$(printf %04d $f).pgm
+done
+
+# Plain MINIMUM keeps the buffer size given, even if AVERAGE(9) needs a bigger buffer
+printf 'OUTPUT: MINIMUM\n' > $TESTDIR/min.sps
+printf 'OUTPUT: MINIMUM\nOUTPUT.wide: AVERAGE(9)\n' > $TESTDIR/minwide.sps
+score=0
+./spiceweasel 1 20 7 -i $TESTDIR/in_%04d.pgm -p $TESTDIR/min.sps --depth 16 \
+	-o $TESTDIR/a_%04d.png && \
+./spiceweasel 1 20 7 -i $TESTDIR/in_%04d.pgm -p $TESTDIR/minwide.sps --depth 16 \
+	-o $TESTDIR/b_%04d.png --output wide=$TESTDIR/w_%04d.png && score=1
+for f in $TESTDIR/b_*.png; do
+	cmp -s $f $TESTDIR/a_${f#$TESTDIR/b_} || score=0
+done
+echo "minimum-with-average9 $score" >> test.txt
+
+# Targets whose names only start with MINIMUM or AVERAGE are ordinary targets
+printf 'OUTPUT: minimum_bg\nminimum_bg: averaged\naveraged: MINIMUM\n' > $TESTDIR/minname.sps
+score=0
+./spiceweasel 1 20 7 -i $TESTDIR/in_%04d.pgm -p $TESTDIR/minname.sps --depth 16 \
+	-o $TESTDIR/n_%04d.png && score=1
+for f in $TESTDIR/a_*.png; do
+	cmp -s $f $TESTDIR/n_${f#$TESTDIR/a_} || score=0
+done
+echo "target-named-minimum $score" >> test.txt
+
+# Every 16-bit value comes back unchanged from the lossless IPX codecs
+LC_ALL=C awk 'BEGIN{printf "P5\n256 256\n65535\n";
+	for(v=0;v<65536;v++) printf "%c%c", int(v/256), v%256}' > $TESTDIR/all_0001.pgm
+./spiceweasel 1 1 1 -i $TESTDIR/all_%04d.pgm -p scripts/pass.sps --depth 16 \
+	-o $TESTDIR/all_%04d.png
+for codec in RAW ZSTD; do
+	score=0
+	./spiceweasel 1 1 1 -i $TESTDIR/all_%04d.pgm -p scripts/pass.sps --depth 16 \
+		--codec $codec -o $TESTDIR/all.ipx > $TESTDIR/codec.log
+	if grep -q "not supported" $TESTDIR/codec.log; then
+		continue # Built without this codec
+	fi
+	./spiceweasel 0 0 1 -i $TESTDIR/all.ipx -p scripts/pass.sps --depth 16 \
+		-o $TESTDIR/back_%04d.png && \
+	cmp -s $TESTDIR/all_0001.png $TESTDIR/back_0000.png && score=1
+	echo "ipx-$codec-16bit-roundtrip $score" >> test.txt
+done
+
+# PNG pixels are read as value/maxval, as float. Every 8-bit and 16-bit value
+# must give the same floats as the original reader
+LC_ALL=C awk 'BEGIN{printf "P5\n16 16\n255\n";
+	for(v=0;v<256;v++) printf "%c", v}' > $TESTDIR/ramp_0001.pgm
+./spiceweasel 1 1 1 -i $TESTDIR/ramp_%04d.pgm -p scripts/pass.sps --depth 8 \
+	-o $TESTDIR/ramp_%04d.png
+for png in "ramp 6e0bb277e18a213f87fca7b9abf8da34" "all d69937ce341a722f83f4138d3164a7ab"; do
+	set -- $png
+	score=0
+	./spiceweasel 1 1 1 -i $TESTDIR/$1_%04d.png -p scripts/pass.sps --depth 32 \
+		-o $TESTDIR/$1.npy && \
+	test "$(md5sum < $TESTDIR/$1.npy | cut -d' ' -f1)" = "$2" && score=1
+	echo "png-$1-values $score" >> test.txt
+done
+
 npass=$(grep '1$' test.txt | wc -l)
 ntotal=$(cat test.txt | wc -l)
 echo ""
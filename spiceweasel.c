@@ -37,11 +37,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define GLOBALORIGIN
 #include "spiceweasel.h"
 
 #include "io_ipx.h"
+#include "io_npy.h"
+#include "io_stream.h"
+#include "io_tiff.h"
+#include "io_mraw.h"
+#include "profile.h"
 
 /************** GLOBAL DATA ***********/
 
@@ -55,10 +65,21 @@ TFrame *input_frame[2];
 int frame_read;  /* Frame number last read */
 
 /* Output data */
-TFrame *output_frame[2];
+TFrame **output_frame[2]; /* One frame for each output of the script */
 int frame_written; /* Frame number last written */
 
 int startframe, endframe; /* Frame numbers to process */
+int stride = 1;           /* Step between frames */
+
+int output_depth = 0;             /* Bits per pixel of output. 0 for default */
+int output_codec = IPX_CODEC_JP2; /* Codec for IPX output */
+int output_stream = STREAM_RAW;   /* Format of frames written to stdout */
+FILE *stream_out;                 /* Original stdout, for frames */
+IPX_jp2_options jp2_options; /* JPEG 2000 settings for IPX output */
+int jpeg_quality = 90;       /* Quality of JPEG output, 1 to 100 */
+int ipx_commit = 50;         /* Frames between IPX output header updates */
+double ipx_follow = 0.0;     /* Seconds to wait for frames added to IPX input */
+TIFF_options tiff_options;   /* Compression and tiling of TIFF output */
 
 
 /************** ACTUAL PROCESSING ROUTINES ***************/
@@ -68,6 +89,11 @@ int check_format(char *template) /* Check file extension of template */
   int n;
   int format;
 
+  if(strcmp(template, "-") == 0) {
+    /* Standard input or output */
+    return(FORMAT_STREAM);
+  }
+
   n = strlen(template);
   if(n < 4) {
     return(FORMAT_UNKNOWN);
@@ -79,6 +105,22 @@ int check_format(char *template) /* Check file extension of template */
     format = FORMAT_PNG;
   }else if(strncasecmp(&(template[n-4]), ".ipx", 4) == 0) {
     format = FORMAT_IPX;
+  }else if((strncasecmp(&(template[n-4]), ".pgm", 4) == 0) ||
+	   (strncasecmp(&(template[n-4]), ".ppm", 4) == 0) ||
+	   (strncasecmp(&(template[n-4]), ".pnm", 4) == 0)) {
+    format = FORMAT_PNM;
+  }else if(strncasecmp(&(template[n-4]), ".npy", 4) == 0) {
+    format = FORMAT_NPY;
+  }else if((strncasecmp(&(template[n-4]), ".jpg", 4) == 0) ||
+	   ((n > 4) && (strncasecmp(&(template[n-5]), ".jpeg", 5) == 0))) {
+    format = FORMAT_JPEG;
+  }else if((strncasecmp(&(template[n-4]), ".tif", 4) == 0) ||
+	   ((n > 4) && (strncasecmp(&(template[n-5]), ".tiff", 5) == 0))) {
+    format = FORMAT_TIFF;
+  }else if((strncasecmp(&(template[n-4]), ".cih", 4) == 0) ||
+	   ((n > 4) && ((strncasecmp(&(template[n-5]), ".cihx", 5) == 0) ||
+			(strncasecmp(&(template[n-5]), ".mraw", 5) == 0)))) {
+    format = FORMAT_MRAW;
   }else {
     format = FORMAT_UNKNOWN;
   }
@@ -119,15 +161,74 @@ void read_colormap()
   colormap.value[3] = 1.00; colormap.red[3] = 255.0; colormap.green[3] = 255.0; colormap.blue[3] = 255.0;
 }
 
-TRawFrame writeraw;
-IPX_status ipx_write_status;
+/* Where an output of the script is written */
+typedef struct {
+  char *name;        /* Name of a named output, or NULL for OUTPUT */
+  char template[MAX_NAME_LEN];
+  int format;
+  int depth;         /* Bits per pixel */
+  TRawFrame raw;     /* Packed frame for image files */
+  IPX_status ipx;
+  NPY_status npy;
+  STREAM_status stream;
+  TIFF_status tiff;
+  int profile;       /* Profiler entry */
+}TSink;
+
+TSink *sink;  /* OUTPUT (-o), then the named outputs */
+int nsinks;
+
+/* Default bits per pixel for a format, and check the format can be
+   written at this depth. Returns 0 on error */
+int sink_depth(int format, int depth)
+{
+  if(depth == 0) {
+    /* Frame cubes and raw streams default to float, TIFF stacks to
+       16-bit and images to 8-bit */
+    depth = 8;
+    if((format == FORMAT_NPY) || 
+       ((format == FORMAT_STREAM) && (output_stream == STREAM_RAW)))
+      depth = 32;
+    if(format == FORMAT_TIFF)
+      depth = 16;
+  }
+  if((depth == 32) && (format != FORMAT_NPY) && (format != FORMAT_TIFF) &&
+     ((format != FORMAT_STREAM) || (output_stream != STREAM_RAW))) {
+    printf("Error: 32-bit (float) output needs a .npy or .tif file or raw output stream\n");
+    return(0);
+  }
+  if((depth != 8) && (format == FORMAT_JPEG)) {
+    printf("Error: JPEG output is 8-bit only\n");
+    return(0);
+  }
+  return(depth);
+}
+
+/* Copy a file name, adding a suffix before the extension */
+void add_suffix(char *template, char *file, char *suffix)
+{
+  char *ext;
+  int n;
+
+  strncpy(template, file, MAX_NAME_LEN-1);
+  template[MAX_NAME_LEN-1] = 0;
+  if(suffix == NULL)
+    return;
+  n = strlen(suffix);
+  if(strlen(template) + n >= MAX_NAME_LEN)
+    return;
+  if(((ext = strrchr(template, '.')) == NULL) || (strchr(ext, '/') != NULL))
+    ext = template + strlen(template);
+  memmove(ext + n, ext, strlen(ext)+1);
+  memcpy(ext, suffix, n);
+}
 
-void write_init()
+void write_init(TSink *s)
 {
-  int depth;
-  writeraw.allocated = 0;
+  int depth, left, top, bin;
+  s->raw.allocated = 0;
 
-  if(output_format == FORMAT_IPX) {
+  if(s->format == FORMAT_IPX) {
     
     depth = 16;
     /* Setup output header */
@@ -135,33 +236,205 @@ void write_init()
       depth = ipx_read_status.header.depth;
       
       /* Copy header from input */
-      memcpy(&(ipx_write_status.header), &(ipx_read_status.header), sizeof(IPX_header));
+      memcpy(&(s->ipx.header), &(ipx_read_status.header), sizeof(IPX_header));
+
+      /* Positions are in sensor pixels, so offsets in frame pixels
+	 are scaled by any binning of the input */
+      if(roi_width > 0) {
+	/* Only a region of the sensor is written */
+	s->ipx.header.left += roi_x*((s->ipx.header.hBin > 1) ? s->ipx.header.hBin : 1);
+	s->ipx.header.top += roi_y*((s->ipx.header.vBin > 1) ? s->ipx.header.vBin : 1);
+      }
+
+      /* The script may crop and bin the frames */
+      if(script_geometry(s - sink, &left, &top, &bin) && (left || top || (bin > 1))) {
+	if(s->ipx.header.hBin < 1)
+	  s->ipx.header.hBin = 1;
+	if(s->ipx.header.vBin < 1)
+	  s->ipx.header.vBin = 1;
+	s->ipx.header.left += left*s->ipx.header.hBin;
+	s->ipx.header.top += top*s->ipx.header.vBin;
+	s->ipx.header.hBin *= bin;
+	s->ipx.header.vBin *= bin;
+      }
     }else {
       /* Clear header */
-      memset(&(ipx_write_status.header), 0, sizeof(IPX_header));
+      memset(&(s->ipx.header), 0, sizeof(IPX_header));
     }
 
+    s->ipx.jp2 = jp2_options;
+    s->ipx.commit = ipx_commit;
+
     /* Open output file */
-    printf("Opening IPX output file %s...", output_template);
-    if(IPX_write_open(output_template, depth, &ipx_write_status)) {
+    printf("Opening IPX output file %s...", s->template);
+    if(IPX_write_open(s->template, depth, output_codec, &(s->ipx))) {
       printf("failed!\n");
       exit(1);
     }
     printf("done\n");
     
+  }else if(s->format == FORMAT_STREAM) {
+    if(STREAM_write_open(stream_out, output_stream, s->depth, &(s->stream))) {
+      printf("Error: Can't write %d-bit frames to this output stream\n", s->depth);
+      exit(1);
+    }
+  }else if(s->format == FORMAT_NPY) {
+    printf("Opening frame cube output file %s...", s->template);
+    if(NPY_write_open(s->template, s->depth, &(s->npy))) {
+      printf("failed!\n");
+      exit(1);
+    }
+    printf("done\n");
+  }else if(s->format == FORMAT_TIFF) {
+    printf("Opening TIFF stack output file %s...", s->template);
+    if(TIFF_write_open(s->template, s->depth, &tiff_options, &(s->tiff))) {
+      printf("failed!\n");
+      exit(1);
+    }
+    printf("done\n");
   }
+}
 
-  read_colormap();
+void write_finish(TSink *s)
+{
+  if(s->format == FORMAT_IPX) {
+    if(IPX_write_close(&(s->ipx)))
+      printf("Error: Could not finish writing %s\n", s->template);
+  }else if(s->format == FORMAT_STREAM) {
+    STREAM_write_close(&(s->stream));
+  }else if(s->format == FORMAT_NPY) {
+    if(NPY_write_close(&(s->npy)))
+      printf("Error: Could not finish writing %s\n", s->template);
+  }else if(s->format == FORMAT_TIFF) {
+    if(TIFF_write_close(&(s->tiff)))
+      printf("Error: Could not finish writing %s\n", s->template);
+  }
+}
+
+/* Allocate a raw frame with rows in one block */
+void allocate_raw(int width, int height, int bpp, int channels, TRawFrame *raw)
+{
+  int i;
+
+  raw->width = width;
+  raw->height = height;
+  raw->bpp = bpp;
+  raw->channels = channels;
+  raw->rowbytes = width * channels * bpp / 8;
+      
+  raw->data = (unsigned char**) malloc(sizeof(unsigned char*)*height);
+  raw->data[0] = (unsigned char*) malloc(((size_t) raw->rowbytes)*height);
+  for(i=1;i<height;i++)
+    raw->data[i] = raw->data[i-1] + raw->rowbytes;
+  raw->allocated = 1;
 }
 
-void write_finish()
+void free_raw(TRawFrame *raw)
 {
-  if(output_format == FORMAT_IPX) {
-    IPX_write_close(&ipx_write_status);
+  if(raw->allocated) {
+    free(raw->data[0]);
+    free(raw->data);
+  }
+  raw->allocated = 0;
+}
+
+/* Copy a frame into rows of floats, transposing in tiles to stay in cache */
+void pack_float(TFrame *frame, float *rows)
+{
+  int i, j, i0, j0, i1, j1;
+
+  for(j0=0;j0<frame->height;j0+=CONVERT_TILE) {
+    j1 = (j0 + CONVERT_TILE < frame->height) ? j0 + CONVERT_TILE : frame->height;
+    for(i0=0;i0<frame->width;i0+=CONVERT_TILE) {
+      i1 = (i0 + CONVERT_TILE < frame->width) ? i0 + CONVERT_TILE : frame->width;
+      for(i=i0;i<i1;i++)
+	for(j=j0;j<j1;j++)
+	  rows[((size_t) j)*frame->width + i] = frame->data[i][j];
+    }
+  }
+}
+
+/* Pack a greyscale frame (columns of floats) into rows of 8 or 16-bit
+   pixels, clamping to [0,1] and rounding. 16-bit values are stored
+   big-endian (as needed by PNG and PGM) if bigendian is set, otherwise
+   little-endian. */
+void pack_grey(TFrame *frame, TRawFrame *raw, int bigendian)
+{
+  int i, j, k, w4, h4;
+  float v;
+  double maxval;
+  unsigned int p;
+  unsigned char *out;
+#ifdef __SSE2__
+  __m128 c0, c1, c2, c3, r[4], lo, hi, vmax, half;
+  __m128i q, offset;
+#endif
+
+  maxval = (raw->bpp > 8) ? 65535.0 : 255.0;
+  w4 = h4 = 0;
+
+#ifdef __SSE2__
+  /* Work in 4x4 blocks: load four columns, transpose into four rows */
+  lo = _mm_setzero_ps();
+  hi = _mm_set1_ps(1.0);
+  vmax = _mm_set1_ps(maxval);
+  half = _mm_set1_ps(0.5);
+  offset = _mm_set1_epi32(32768);
+
+  w4 = frame->width & ~3;
+  h4 = frame->height & ~3;
+  for(j=0;j<h4;j+=4) {
+    for(i=0;i<w4;i+=4) {
+      c0 = _mm_loadu_ps(&(frame->data[i][j]));
+      c1 = _mm_loadu_ps(&(frame->data[i+1][j]));
+      c2 = _mm_loadu_ps(&(frame->data[i+2][j]));
+      c3 = _mm_loadu_ps(&(frame->data[i+3][j]));
+      _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+      r[0] = c0; r[1] = c1; r[2] = c2; r[3] = c3;
+      
+      for(k=0;k<4;k++) {
+	/* Clamp, scale and round. Values are positive so truncation works */
+	r[k] = _mm_min_ps(_mm_max_ps(r[k], lo), hi);
+	q = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r[k], vmax), half));
+	if(raw->bpp > 8) {
+	  /* No unsigned 32->16 bit pack in SSE2, so offset to signed */
+	  q = _mm_sub_epi32(q, offset);
+	  q = _mm_packs_epi32(q, q);
+	  q = _mm_xor_si128(q, _mm_set1_epi16((short) 0x8000));
+	  /* SSE2 is little-endian, so swap bytes for big-endian */
+	  if(bigendian)
+	    q = _mm_or_si128(_mm_slli_epi16(q, 8), _mm_srli_epi16(q, 8));
+	  _mm_storel_epi64((__m128i*) (raw->data[j+k] + 2*i), q);
+	}else {
+	  q = _mm_packs_epi32(q, q);
+	  q = _mm_packus_epi16(q, q);
+	  *((int*) (raw->data[j+k] + i)) = _mm_cvtsi128_si32(q);
+	}
+      }
+    }
+  }
+#endif
+
+  /* Anything not done in blocks above */
+  for(j=0;j<frame->height;j++) {
+    out = raw->data[j];
+    for(i=(j < h4) ? w4 : 0;i<frame->width;i++) {
+      v = frame->data[i][j];
+      if(v > 1.0)
+	v = 1.0;
+      if(v < 0.0)
+	v = 0.0;
+      p = (unsigned int) (0.5 + v * maxval);
+      if(raw->bpp > 8) {
+	out[2*i]   = bigendian ? (p >> 8) : (p & 0xFF);
+	out[2*i+1] = bigendian ? (p & 0xFF) : (p >> 8);
+      }else
+	out[i] = p;
+    }
   }
 }
 
-int write_frame(TFrame *frame)
+int write_frame(TSink *s, TFrame *frame)
 {
   char filename[MAX_NAME_LEN];
   int errcode;
@@ -169,43 +442,53 @@ int write_frame(TFrame *frame)
   int i, j, k, p, n;
   float val, v1, v2, vd;
 
-  if(output_format == FORMAT_IPX) {
+  if(s->format == FORMAT_IPX) {
     /* Write frames to an IPX file */
-    if(IPX_write_frame(frame, &ipx_write_status)) {
+    if(IPX_write_frame(frame, &(s->ipx))) {
       printf("Error writing frame\n");
       exit(1);
     }
+  }else if(s->format == FORMAT_STREAM) {
+    /* Send to stdout */
+    if(STREAM_write_frame(frame, &(s->stream))) {
+      fprintf(stderr, "Error writing frame %d to output stream\n", frame->number);
+      exit(1);
+    }
+  }else if(s->format == FORMAT_NPY) {
+    /* Append to a frame cube */
+    if(NPY_write_frame(frame, &(s->npy))) {
+      printf("Error writing frame %d to %s\n", frame->number, s->template);
+      exit(1);
+    }
+  }else if(s->format == FORMAT_TIFF) {
+    /* Append a page to a TIFF stack */
+    if(TIFF_write_frame(frame, &(s->tiff))) {
+      printf("Error writing frame %d to %s\n", frame->number, s->template);
+      exit(1);
+    }
   }else {
     /* Write a series of files, one per frame */
     //printf("***Writing output frame %d\n", frame->number);
-    sprintf(filename, output_template, frame->number);
+    sprintf(filename, s->template, frame->number);
 
-    rowbytes = frame->width * OUTPUT_BYTEDEPTH;
+    /* Colour uses 8 bits per channel */
+    rowbytes = frame->width * s->depth / 8;
     if(OUTPUT_COLOR) 
-      rowbytes *= 3; /* 3 channel */
+      rowbytes = frame->width * 3; /* 3 channel */
 
-    if(writeraw.allocated) {
+    if(s->raw.allocated) {
       /* Data already allocated - check same size */
-      if((writeraw.width != frame->width) || 
-	 (writeraw.height != frame->height) ||
-	 (writeraw.rowbytes != rowbytes)) {
+      if((s->raw.width != frame->width) || 
+	 (s->raw.height != frame->height) ||
+	 (s->raw.rowbytes != rowbytes)) {
 	return(IO_ERROR_SIZE);
       }  
     }else {
       /* Allocate memory */
-      
-      writeraw.bpp = 8*OUTPUT_BYTEDEPTH;
-      writeraw.channels = 1;
       if(OUTPUT_COLOR)
-	writeraw.channels = 3;
-      writeraw.rowbytes = rowbytes;
-      
-      writeraw.data = (unsigned char**) malloc(sizeof(unsigned char*)*frame->height);
-      for(i=0;i!=frame->height;i++)
-	writeraw.data[i] = (unsigned char*) malloc(rowbytes*sizeof(unsigned char));
-      writeraw.width = frame->width;
-      writeraw.height = frame->height;
-      writeraw.allocated =  1;
+	allocate_raw(frame->width, frame->height, 8, 3, &(s->raw));
+      else
+	allocate_raw(frame->width, frame->height, s->depth, 1, &(s->raw));
     }
 
     /* Convert frame to output format */
@@ -216,13 +499,13 @@ int write_frame(TFrame *frame)
 	for(j=0;j<frame->height;j++) {
 	  val = frame->data[i][j];
 	  if(val <= colormap.value[0]) {
-	    writeraw.data[j][3*i] = colormap.red[0];
-	    writeraw.data[j][3*i + 1] = colormap.green[0];
-	    writeraw.data[j][3*i + 2] = colormap.blue[0];
+	    s->raw.data[j][3*i] = colormap.red[0];
+	    s->raw.data[j][3*i + 1] = colormap.green[0];
+	    s->raw.data[j][3*i + 2] = colormap.blue[0];
 	  }else if(val >= colormap.value[n]) {
-	    writeraw.data[j][3*i] = colormap.red[n];
-	    writeraw.data[j][3*i + 1] = colormap.green[n];
-	    writeraw.data[j][3*i + 2] = colormap.blue[n];
+	    s->raw.data[j][3*i] = colormap.red[n];
+	    s->raw.data[j][3*i + 1] = colormap.green[n];
+	    s->raw.data[j][3*i + 2] = colormap.blue[n];
 	  }else {
 	    /* Interpolate */
 	    p = 1;
@@ -240,47 +523,37 @@ int write_frame(TFrame *frame)
 	    //printf("%d, %d -> %d, %f, %f\n", j, i, p, v1, v2);
 	    
 	    /* red channel */
-	    writeraw.data[j][3*i] = (unsigned char) (0.5 + colormap.red[p]*v1 + colormap.red[p-1]*v2);
+	    s->raw.data[j][3*i] = (unsigned char) (0.5 + colormap.red[p]*v1 + colormap.red[p-1]*v2);
 	    /* green channel */
-	    writeraw.data[j][3*i+1] = (unsigned char) (0.5 + colormap.green[p]*v1 + colormap.green[p-1]*v2);
+	    s->raw.data[j][3*i+1] = (unsigned char) (0.5 + colormap.green[p]*v1 + colormap.green[p-1]*v2);
 	    /* blue channel */
-	    writeraw.data[j][3*i+2] = (unsigned char) (0.5 + colormap.blue[p]*v1 + colormap.blue[p-1]*v2);
+	    s->raw.data[j][3*i+2] = (unsigned char) (0.5 + colormap.blue[p]*v1 + colormap.blue[p-1]*v2);
 	  }
 	}
       }
     }else {
-      /* Greyscale */
-      if(writeraw.bpp > 16) {
-	printf("\nSorry: Cannot write greyscale images > 16bpp\n");
-	exit(1);
-      }else if(writeraw.bpp > 8) {
-	/* Put into 2 bytes per pixel */
-	printf("\nSorry: Cannor write greyscale images > 8bpp yet\n");
-	exit(1);
-      }else {
-	/* One byte per pixel */
-	for(i=0;i<frame->width;i++) {
-	  for(j=0;j<frame->height;j++) {
-	    if(frame->data[i][j] > 1.0)
-	      frame->data[i][j] = 1.0;
-	    if(frame->data[i][j] < 0.0)
-	      frame->data[i][j] = 0.0;
-	    writeraw.data[j][i] = (unsigned char) (0.5 + frame->data[i][j] * 255.0);
-	  }
-	}
-      }
+      /* Greyscale, 8 or 16 bits */
+      pack_grey(frame, &(s->raw), 1);
     }
     
     /* Write the data in a format */
     
     errcode = 0;
-    switch(output_format) {
+    switch(s->format) {
     case FORMAT_BMP: {
-      //errcode =  write_bmp(filename, frame);
+      errcode =  write_bmp(filename, &(s->raw));
+      break;
+    }
+    case FORMAT_PNM: {
+      errcode =  write_pnm(filename, &(s->raw));
       break;
     }
     case FORMAT_PNG: {
-      errcode =  write_png(filename, &writeraw);
+      errcode =  write_png(filename, &(s->raw));
+      break;
+    }
+    case FORMAT_JPEG: {
+      errcode =  write_jpeg(filename, &(s->raw), jpeg_quality);
       break;
     }
     default: {
@@ -349,13 +622,13 @@ void* input_routine(void *args)
     /* Read routine may already have set this as last frame.
        If this is the last requested frame, mark and finish */
     //input_frame[cycle]->last = 0;
-    if(frame == endframe)
+    if(frame + stride > endframe)
       input_frame[cycle]->last = 1;
     if(input_frame[cycle]->last == 1)
       finished = 1;
 
     cycle ^= 1; /* Flip between frames */
-    frame++;
+    frame += stride;
   }while(!finished);
   //printf("Input terminating\n");
   
@@ -374,6 +647,8 @@ void* output_routine(void *args)
 {
   int finished;
   int cycle;
+  int k;
+  double start;
 
   cycle = 1; /* Opposite to processing thread */
   finished = 0;
@@ -392,17 +667,21 @@ void* output_routine(void *args)
     }
     pthread_mutex_unlock(&process_ready_mutex);
 
-    if(output_frame[cycle]->allocated) { /* If valid data present */
+    if(output_frame[cycle][0]->allocated) { /* If valid data present */
       /* Output data in output_frame[cycle] */
-      write_frame(output_frame[cycle]);
+      for(k=0;k<nsinks;k++) {
+	start = profile_clock();
+	write_frame(&(sink[k]), output_frame[cycle][k]);
+	profile_add(sink[k].profile, start, FRAME_BYTES(output_frame[cycle][k]));
+      }
 
       /* Check if this is the last frame */
-      if(output_frame[cycle]->last) {
+      if(output_frame[cycle][0]->last) {
 	//printf("Output reached last frame\n");
 	finished = 1;  
       }
 
-      frame_written = output_frame[cycle]->number; 
+      frame_written = output_frame[cycle][0]->number; 
     }
 
     cycle ^= 1; /* Flip between frames */
@@ -424,14 +703,26 @@ int main(int argc, char **argv)
   
   int cycle;  /* Keeps track of which buffer to use */
   int finished, status;
-  int i, n;
+  int i, k, n;
+  int nseq; /* Number of frames in the sequence to read */
+  double tmin, tmax;
+  int use_tmin, use_tmax;
 
   char *script;
+  char **output_name; /* --output name=template */
+  int noutput_name;
+  char *file, *suffix;
 
   /* Status information */
   int last_read, last_written;
   float progress, total;
+  int nout;
   time_t start_time, end_time;
+  int profile;
+  char *profile_json, name[PROFILE_NAME_LEN];
+#ifdef SINGLE_THREAD
+  double start; /* Writes are timed here, not in output_routine */
+#endif
 
   /* Start timing */
   start_time = time(NULL);
@@ -440,6 +731,18 @@ int main(int argc, char **argv)
   input_template[MAX_NAME_LEN-1] = 0;
   strncpy(output_template, DEFAULT_OUTPUT_NAME, MAX_NAME_LEN-1);
   output_template[MAX_NAME_LEN-1] = 0;
+
+  IPX_jp2_defaults(&jp2_options);
+  TIFF_defaults(&tiff_options);
+
+#ifndef SINGLE_THREAD
+  read_ahead = 2;
+  if((script_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    script_threads = 1;
+#else
+  script_threads = 1;
+#endif
+  prefetch_frames = 4;
   
   /******** CHECK COMMAND-LINE ARGUMENTS ********/
 
@@ -450,6 +753,24 @@ int main(int argc, char **argv)
     printf("    -i <input template>  Set input file template\n");
     printf("    -o <output template> Set output file template\n");
     printf("    -p <SPS file>        Set processing script\n");
+    printf("    --output <name>=<template> Set where script output OUTPUT.<name> goes\n");
+    printf("    --roi x,y,w,h        Only read a region of each input frame\n");
+    printf("    --depth <8|16|32>    Bits per pixel of output images (32 is float)\n");
+    printf("    --codec <codec>      IPX output codec: JP2 (default), RAW or ZSTD\n");
+    printf("    --stream <format>    Format for -o -: raw (default) or y4m\n");
+    printf("    --stride <N>         Only read every N'th frame\n");
+    printf("    --tmin <t>, --tmax <t> Select frames by time (IPX input)\n");
+    printf("    --follow <t>         Wait up to t seconds for frames added to IPX input\n");
+    printf("    --commit <N>         Update IPX output header every N frames (default 50)\n");
+    printf("    --read-ahead <N>     Read the next N image files on other threads\n");
+    printf("    --prefetch <N>       Read the bytes of the next N frames in the background\n");
+    printf("    --threads <N>        Run independent script steps on N threads\n");
+    printf("    --profile            Print the time taken by each step at the end\n");
+    printf("    --profile-json <file> Also write the times to a JSON file\n");
+    printf("    --quality <1-100>    Quality of JPEG output (default 90)\n");
+    printf("    --jp2-<option> <val> JPEG 2000 settings: rate, psnr, levels,\n");
+    printf("                         cblk, tile or order\n");
+    printf("    --tiff-<option> <val> TIFF output settings: compress or tile\n");
     printf("  See README.txt for more details\n\n");
     return(1);
   }
@@ -471,17 +792,184 @@ int main(int argc, char **argv)
     printf("---Frame buffer size must be odd: changing to %d\n", nframes);
   }
 
-  if(startframe + nframes > (endframe+1)) {
-    printf("***Not enough frames to fill buffer\n");
-    return(1);
-  }
-
   /* Go through options */
 
   script = (char*) NULL;
+  use_tmin = use_tmax = 0;
+  profile = 0;
+  profile_json = (char*) NULL;
+  output_name = (char**) malloc(sizeof(char*)*argc);
+  noutput_name = 0;
 
   for(i=4; i<argc;i++) {
-    if(strncasecmp(argv[i], "-i", 2) == 0) {
+    if(strcasecmp(argv[i], "--roi") == 0) {
+      /* Set region of interest */
+      i++;
+      if(i == argc) {
+	printf("Option useage is --roi <x>,<y>,<width>,<height>\n");
+	return(1);
+      }
+      if((sscanf(argv[i], "%d,%d,%d,%d", &roi_x, &roi_y, &roi_width, &roi_height) != 4) ||
+	 (roi_x < 0) || (roi_y < 0) || (roi_width < 1) || (roi_height < 1)) {
+	printf("Region of interest (--roi option) must be x,y,width,height\n");
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--depth") == 0) {
+      /* Set output bit depth */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%d", &output_depth) != 1) ||
+	 ((output_depth != 8) && (output_depth != 16) && (output_depth != 32))) {
+	printf("Option useage is --depth <8|16|32>\n");
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--output") == 0) {
+      /* Set where a named output of the script is written */
+      i++;
+      if((i == argc) || (strchr(argv[i], '=') == NULL)) {
+	printf("Option useage is --output <name>=<template>\n");
+	return(1);
+      }
+      output_name[noutput_name++] = argv[i];
+    }else if(strcasecmp(argv[i], "--stream") == 0) {
+      /* Set format of frames written to stdout */
+      i++;
+      if(i == argc) {
+	printf("Option useage is --stream <raw|y4m>\n");
+	return(1);
+      }
+      if(strcasecmp(argv[i], "raw") == 0) {
+	output_stream = STREAM_RAW;
+      }else if(strcasecmp(argv[i], "y4m") == 0) {
+	output_stream = STREAM_Y4M;
+      }else {
+	printf("Output stream format must be raw or y4m\n");
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--codec") == 0) {
+      /* Set IPX output codec */
+      i++;
+      if(i == argc) {
+	printf("Option useage is --codec <JP2|RAW|ZSTD>\n");
+	return(1);
+      }
+      if((output_codec = IPX_codec(argv[i])) == IPX_CODEC_UNKNOWN) {
+	printf("IPX codec %s not recognised or not supported by this build\n", argv[i]);
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--read-ahead") == 0) {
+      /* Number of input files to read ahead */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%d", &read_ahead) != 1) || (read_ahead < 0)) {
+	printf("Option useage is --read-ahead <N>\n");
+	return(1);
+      }
+#ifdef SINGLE_THREAD
+      if(read_ahead > 0)
+	printf("---Multi-threading disabled: ignoring --read-ahead\n");
+      read_ahead = 0;
+#endif
+    }else if(strcasecmp(argv[i], "--prefetch") == 0) {
+      /* Number of input frames to read in the background */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%d", &prefetch_frames) != 1) || (prefetch_frames < 0)) {
+	printf("Option useage is --prefetch <N>\n");
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--threads") == 0) {
+      /* Number of threads running script steps */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%d", &script_threads) != 1) || (script_threads < 1)) {
+	printf("Option useage is --threads <N>\n");
+	return(1);
+      }
+#ifdef SINGLE_THREAD
+      if(script_threads > 1)
+	printf("---Multi-threading disabled: ignoring --threads\n");
+      script_threads = 1;
+#endif
+    }else if(strcasecmp(argv[i], "--profile") == 0) {
+      /* Time each part of the processing */
+      profile = 1;
+    }else if(strcasecmp(argv[i], "--profile-json") == 0) {
+      i++;
+      if(i == argc) {
+	printf("Option useage is --profile-json <file>\n");
+	return(1);
+      }
+      profile = 1;
+      profile_json = argv[i];
+    }else if(strcasecmp(argv[i], "--stride") == 0) {
+      /* Only read every stride'th frame */
+      i++;
+      if(i == argc) {
+	printf("Option useage is --stride <N>\n");
+	return(1);
+      }
+      if((sscanf(argv[i], "%d", &stride) != 1) || (stride < 1)) {
+	printf("Frame stride (--stride option) must be a positive integer\n");
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--tmin") == 0) {
+      /* Start at a time rather than frame number */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%lf", &tmin) != 1)) {
+	printf("Option useage is --tmin <time>\n");
+	return(1);
+      }
+      use_tmin = 1;
+    }else if(strcasecmp(argv[i], "--tmax") == 0) {
+      /* End at a time rather than frame number */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%lf", &tmax) != 1)) {
+	printf("Option useage is --tmax <time>\n");
+	return(1);
+      }
+      use_tmax = 1;
+    }else if(strcasecmp(argv[i], "--follow") == 0) {
+      /* Keep reading an IPX file as it is written */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%lf", &ipx_follow) != 1) || (ipx_follow < 0.0)) {
+	printf("Option useage is --follow <seconds>\n");
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--commit") == 0) {
+      /* How often IPX output is made readable */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%d", &ipx_commit) != 1) || (ipx_commit < 0)) {
+	printf("Option useage is --commit <N>\n");
+	return(1);
+      }
+    }else if(strcasecmp(argv[i], "--quality") == 0) {
+      /* Set JPEG output quality */
+      i++;
+      if((i == argc) || (sscanf(argv[i], "%d", &jpeg_quality) != 1) ||
+	 (jpeg_quality < 1) || (jpeg_quality > 100)) {
+	printf("Option useage is --quality <1-100>\n");
+	return(1);
+      }
+    }else if(strncasecmp(argv[i], "--tiff-", 7) == 0) {
+      /* Set a TIFF output option */
+      i++;
+      if(i == argc) {
+	printf("Option useage is %s <value>\n", argv[i-1]);
+	return(1);
+      }
+      if(TIFF_set(&tiff_options, argv[i-1]+7, argv[i])) {
+	printf("Invalid TIFF option %s %s\n", argv[i-1], argv[i]);
+	return(1);
+      }
+    }else if(strncasecmp(argv[i], "--jp2-", 6) == 0) {
+      /* Set a JPEG 2000 encoding option */
+      i++;
+      if(i == argc) {
+	printf("Option useage is %s <value>\n", argv[i-1]);
+	return(1);
+      }
+      if(IPX_jp2_set(&jp2_options, argv[i-1]+6, argv[i])) {
+	printf("Invalid JPEG 2000 option %s %s\n", argv[i-1], argv[i]);
+	return(1);
+      }
+    }else if(strncasecmp(argv[i], "-i", 2) == 0) {
       /* Set input name */
       i++;
       if(i == argc) {
@@ -533,6 +1021,39 @@ int main(int argc, char **argv)
     printf("Error: Unrecognised output format\n");
     return(1);
   }
+  if(output_format == FORMAT_MRAW) {
+    printf("Error: MRAW files can only be read\n");
+    return(1);
+  }
+  if(output_format == FORMAT_STREAM) {
+    /* Frames go to stdout, so send all messages to stderr */
+    stream_out = fdopen(dup(fileno(stdout)), "wb");
+    fflush(stdout);
+    dup2(fileno(stderr), fileno(stdout));
+  }
+  if((output_depth = sink_depth(output_format, output_depth)) == 0)
+    return(1);
+#ifndef HAVE_LIBJPEG
+  if((input_format == FORMAT_JPEG) || (output_format == FORMAT_JPEG)) {
+    printf("Error: JPEG files not supported (no jpeg library)\n");
+    return(1);
+  }
+#endif
+#ifndef HAVE_LIBTIFF
+  if((input_format == FORMAT_TIFF) || (output_format == FORMAT_TIFF)) {
+    printf("Error: TIFF files not supported (no tiff library)\n");
+    return(1);
+  }
+#endif
+  if((use_tmin || use_tmax) && (input_format != FORMAT_IPX)) {
+    printf("Error: --tmin and --tmax need an IPX input file\n");
+    return(1);
+  }
+  if((ipx_follow > 0.0) && (input_format != FORMAT_IPX)) {
+    printf("Error: --follow needs an IPX input file\n");
+    return(1);
+  }
+  ipx_read_status.follow = ipx_follow;
 
   /******** PRINT INTRO PUFF *********/
 
@@ -548,13 +1069,116 @@ int main(int argc, char **argv)
     /* Some error compiling script */
     return(1);
   }
+  script_buffer(nframes);
+  if(2*script_window()+1 > nframes) {
+    /* Buffer must hold the frames the script reads around the centre */
+    nframes = 2*script_window()+1;
+    printf("---Script reads frames %d either side of INPUT: changing frame buffer size to %d\n",
+	   script_window(), nframes);
+  }
+
+  /* Where each output of the script goes: OUTPUT to -o, and named
+     outputs to the file given by --output or WRITE in the script.
+     Each variant of a script with several argument values adds a
+     suffix to the file names */
+  nsinks = script_outputs();
+  sink = (TSink*) malloc(sizeof(TSink)*nsinks);
+  for(i=0;i<nsinks;i++) {
+    sink[i].name = script_output(i, &file, &(sink[i].depth), &suffix);
+    if(sink[i].name == NULL) {
+      /* OUTPUT */
+      if((suffix != NULL) && (output_format == FORMAT_STREAM)) {
+	printf("Error: Can't write variants of the script to the output stream\n");
+	return(1);
+      }
+      add_suffix(sink[i].template, output_template, suffix);
+      sink[i].format = output_format;
+      sink[i].depth = output_depth;
+      continue;
+    }
+    n = strlen(sink[i].name);
+    for(k=0;k<noutput_name;k++) {
+      if((strncasecmp(output_name[k], sink[i].name, n) == 0) && (output_name[k][n] == '=')) {
+	file = output_name[k] + n + 1;
+	sink[i].depth = 0; /* Default for the format */
+      }
+    }
+    if(file == NULL) {
+      printf("Error: No file for script output OUTPUT.%s: use --output %s=<template>\n",
+	     sink[i].name, sink[i].name);
+      return(1);
+    }
+    add_suffix(sink[i].template, file, suffix);
+    sink[i].format = check_format(sink[i].template);
+    if((sink[i].format == FORMAT_UNKNOWN) || (sink[i].format == FORMAT_STREAM) ||
+       (sink[i].format == FORMAT_MRAW)) {
+      printf("Error: Can't write script output OUTPUT.%s to %s\n", sink[i].name, sink[i].template);
+      return(1);
+    }
+#ifndef HAVE_LIBJPEG
+    if(sink[i].format == FORMAT_JPEG) {
+      printf("Error: JPEG files not supported (no jpeg library)\n");
+      return(1);
+    }
+#endif
+#ifndef HAVE_LIBTIFF
+    if(sink[i].format == FORMAT_TIFF) {
+      printf("Error: TIFF files not supported (no tiff library)\n");
+      return(1);
+    }
+#endif
+    if((sink[i].depth = sink_depth(sink[i].format, sink[i].depth)) == 0)
+      return(1);
+  }
 
   /******** INITIALIZE FRAME BUFFER **********/
 
   /* Initialize processing variables */
   read_init(); /* Note: read MUST init before write */
+
+  if(input_format == FORMAT_IPX) {
+    /* Frame times are in the IPX index */
+    if(use_tmin)
+      startframe = IPX_find_time(&ipx_read_status, tmin, 0);
+    if(use_tmax)
+      endframe = IPX_find_time(&ipx_read_status, tmax, 1) - 1;
+    if((endframe >= (int) ipx_read_status.header.numFrames) && (ipx_follow <= 0.0))
+      endframe = ipx_read_status.header.numFrames - 1; /* Otherwise more may come */
+    if(use_tmin || use_tmax)
+      printf("Time range selects frames %d to %d\n", startframe, endframe);
+  }else if(input_format == FORMAT_NPY) {
+    if(endframe >= npy_read_status.count)
+      endframe = npy_read_status.count - 1;
+  }else if(input_format == FORMAT_TIFF) {
+    if(endframe >= tiff_read_status.count)
+      endframe = tiff_read_status.count - 1;
+  }else if(input_format == FORMAT_MRAW) {
+    if(endframe >= mraw_read_status.count)
+      endframe = mraw_read_status.count - 1;
+  }
+
+  /* Only read startframe, startframe + stride, ... up to endframe */
+  nseq = 0;
+  if(endframe >= startframe)
+    nseq = (endframe - startframe) / stride + 1;
+  endframe = startframe + (nseq - 1)*stride;
+
+  if(nseq < nframes) {
+    printf("***Not enough frames to fill buffer\n");
+    return(1);
+  }
+
+  read_sequence(endframe, stride);
+
+  if(profile)
+    profile_start();
   process_init();
-  write_init();
+  read_colormap();
+  for(i=0;i<nsinks;i++) {
+    write_init(&(sink[i]));
+    snprintf(name, PROFILE_NAME_LEN, "Write %s", sink[i].template);
+    sink[i].profile = profile_entry(name);
+  }
 
   printf("Initializing frame buffer...");
   fflush(stdout);
@@ -568,26 +1192,41 @@ int main(int argc, char **argv)
       printf("\n***Error reading input frame %d\n", startframe);
       exit(1);
     }
-    startframe++;
+    if(framebuffer[i]->last) {
+      /* Input stream ended */
+      if(i != nframes-1) {
+	printf("\n***Not enough frames to fill buffer\n");
+	exit(1);
+      }
+      framebuffer[i]->last = 0;
+      endframe = startframe;
+    }
+    startframe += stride;
   }
   centreframe = (nframes-1)/2; /* The frame in the middle of the buffer */
   framereplace = 0;
 
   input_frame[0]  = (TFrame*) malloc(sizeof(TFrame));   input_frame[0]->allocated  = 0;
   input_frame[1]  = (TFrame*) malloc(sizeof(TFrame));   input_frame[1]->allocated  = 0;
-  output_frame[0] = (TFrame*) malloc(sizeof(TFrame));   output_frame[0]->allocated = 0;
-  output_frame[1] = (TFrame*) malloc(sizeof(TFrame));   output_frame[1]->allocated = 0;
 
   input_frame[0]->last = 0;
   input_frame[1]->last = 0;
-  output_frame[0]->last = 0;
-  output_frame[1]->last = 0;
 
-  frame_read = startframe-1;
+  for(cycle=0;cycle<2;cycle++) {
+    output_frame[cycle] = (TFrame**) malloc(sizeof(TFrame*)*nsinks);
+    for(i=0;i<nsinks;i++) {
+      output_frame[cycle][i] = (TFrame*) malloc(sizeof(TFrame));
+      output_frame[cycle][i]->allocated = 0;
+      output_frame[cycle][i]->last = 0;
+    }
+  }
+
+  frame_read = startframe-stride;
   frame_written = 0;
 
-  total = (float) (endframe - startframe + 2);
+  total = (float) (nseq - nframes + 1);
   progress = 0.0;
+  nout = 0; /* Frames processed. Input streams may end early */
  
   printf("done\n");
 
@@ -623,7 +1262,7 @@ int main(int argc, char **argv)
     
   }else {
     /* Exit after one frame */
-    output_frame[cycle]->last = 1;
+    output_frame[cycle][0]->last = 1;
     finished = 1;
   }
   
@@ -636,6 +1275,11 @@ int main(int argc, char **argv)
   printf("done\n");
 #else
   printf("Single-threaded version\n");
+  if(startframe > endframe) {
+    /* Exit after one frame */
+    output_frame[cycle][0]->last = 1;
+    finished = 1;
+  }
 #endif // SINGLE_THREAD
 
   /*********** START PROCESSING LOOP *********/
@@ -676,6 +1320,7 @@ int main(int argc, char **argv)
 	   last_read, last_written, progress / total);
     fflush(stdout);
     progress += 100.0;
+    nout++;
 
     if(status == -1) {
       /* This just skips reading first time around - all data in buffer */
@@ -684,7 +1329,7 @@ int main(int argc, char **argv)
 
 #ifdef SINGLE_THREAD
       /* Need to read in the next frame */
-      frame_read++;
+      frame_read += stride;
       read_frame(frame_read, input_frame[cycle]);
       if(frame_read == endframe)
 	input_frame[cycle]->last = 1;
@@ -693,7 +1338,7 @@ int main(int argc, char **argv)
       /* Check if this is the last frame */
       if(input_frame[cycle]->last == 1) {
 	//printf("Processing reached last frame: %d\n", input_frame[cycle]->number);
-	output_frame[cycle]->last = 1;
+	output_frame[cycle][0]->last = 1;
 	finished = 1;
       }
 
@@ -720,9 +1365,13 @@ int main(int argc, char **argv)
     /******************************************/
 
 #ifdef SINGLE_THREAD
-    /* Write out frame */
-    write_frame(output_frame[cycle]);
-    frame_written = output_frame[cycle]->number; 
+    /* Write out frames */
+    for(i=0;i<nsinks;i++) {
+      start = profile_clock();
+      write_frame(&(sink[i]), output_frame[cycle][i]);
+      profile_add(sink[i].profile, start, FRAME_BYTES(output_frame[cycle][i]));
+    }
+    frame_written = output_frame[cycle][0]->number; 
 #else
     /* Mult-threaded */
     cycle ^= 1; /* Flip between 0 and 1 */
@@ -751,12 +1400,16 @@ int main(int argc, char **argv)
 
   /* Clean up */
   read_finish();
-  write_finish();
+  for(i=0;i<nsinks;i++)
+    write_finish(&(sink[i]));
 
   end_time = time(NULL);
 
   printf("\nGot %d blasts from the spice-weasel in %d seconds. Bam!!!\n",
-	 endframe - startframe + 2, (int) (end_time - start_time));
+	 nout, (int) (end_time - start_time));
+
+  if(profile_report(profile_json))
+    return(1);
   return(0);
 }
 
@@ -2,6 +2,7 @@
 #define __SPICEWEASEL_H__ 1
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #ifndef VERSION
 #define VERSION "1.0"
@@ -24,8 +25,6 @@
 /* Name of file when only a shot number is specified */
 #define SHOT_NAME "/net/fuslsa/data/MAST_IMAGES/rbb/rbb%06d.ipx"
 
-#define OUTPUT_BYTEDEPTH 1
-
 #define OUTPUT_COLOR 0
 
 #define MAX_NAME_LEN 255
@@ -51,9 +50,16 @@ typedef struct {
 
   int width, height;
 
-  unsigned char **data; /* Raw data. Stored in rows. */
+  unsigned char **data; /* Raw data. Stored in rows. 16-bit samples
+			   are big-endian, as in PNG and PGM */
 }TRawFrame;
 
+/* Scratch memory which grows as needed and is reused between calls */
+typedef struct {
+  void *data;
+  size_t size;
+}TBuffer;
+
 /* Color map definition */
 typedef struct {
   int n;
@@ -75,6 +81,12 @@ typedef struct {
 #define FORMAT_BMP      0
 #define FORMAT_PNG      1
 #define FORMAT_IPX      2
+#define FORMAT_PNM      3    /* Binary PGM or PPM */
+#define FORMAT_NPY      4    /* Frame cube, NumPy .npy format */
+#define FORMAT_STREAM   5    /* Frames on stdin or stdout ("-") */
+#define FORMAT_JPEG     6
+#define FORMAT_TIFF     7    /* Multi-page TIFF stack */
+#define FORMAT_MRAW     8    /* Photron MRAW with CIH file (input only) */
 
 /* File I/O error types */
 
@@ -83,6 +95,16 @@ typedef struct {
 #define IO_ERROR_SIZE     3    /* Input frame size has changed */
 #define IO_ERROR_WRITE    4
 #define IO_ERROR_OTHER    5    
+#define IO_ERROR_REGION   6    /* Region of interest outside frame */
+
+/* Pixel types for conversion into frames (convert_rows) */
+
+#define CONVERT_UINT8     0
+#define CONVERT_UINT16    1    /* Native byte order */
+#define CONVERT_INT       2
+#define CONVERT_FLOAT     3
+
+#define CONVERT_TILE     32    /* Size of square tiles used in conversion */
 
 #define PI 3.1415926535897932384626433832795028841971693993751058209
 
@@ -100,16 +122,46 @@ GLOBAL int input_format, output_format; /* File format for input and output */
 
 GLOBAL TColorMap colormap; /* Color map for output */
 
+/* Region of interest to read from each input frame (--roi option).
+   A width of zero means use the whole frame */
+GLOBAL int roi_x, roi_y, roi_width, roi_height;
+
+/* Number of still image files to read ahead on other threads
+   (--read-ahead option). Zero reads each file when needed */
+GLOBAL int read_ahead;
+
+/* Number of threads running independent script steps on each
+   frame (--threads option) */
+GLOBAL int script_threads;
+
+/* Number of upcoming input frames whose bytes are read in the
+   background (--prefetch option). Zero reads them when needed */
+GLOBAL int prefetch_frames;
+
 #undef GLOBAL
 /*************** PROTOTYPES *****************/
 
+/* spiceweasel.c */
+void allocate_raw(int width, int height, int bpp, int channels, TRawFrame *raw);
+void free_raw(TRawFrame *raw);
+void pack_float(TFrame *frame, float *rows);
+void pack_grey(TFrame *frame, TRawFrame *raw, int bigendian);
+
 /* io_png.c */
-int read_png(char *filename, TRawFrame *frame);
+int read_png(char *filename, TFrame *frame, TBuffer *buffer);
 int write_png(char *filename, TRawFrame *frame);
 
 /* io_bmp.c */
-int read_bmp(char *filename, TRawFrame *frame);
-int write_bmp(char *filename, TFrame *frame);
+int read_bmp(char *filename, TFrame *frame);
+int write_bmp(char *filename, TRawFrame *frame);
+
+/* io_pnm.c */
+int read_pnm(char *filename, TFrame *frame);
+int write_pnm(char *filename, TRawFrame *frame);
+
+/* io_jpeg.c */
+int read_jpeg(char *filename, TFrame *frame, TBuffer *buffer);
+int write_jpeg(char *filename, TRawFrame *frame, int quality);
 
 /* process_frames.c */
 
@@ -117,6 +169,12 @@ int allocate_output(int width, int height, TFrame *output);
 
 int average_frames(TFrame **framebuffer, int nframes, TFrame *output, int width);
 int minimum_frames(TFrame **framebuffer, int nframes, TFrame *output, int width);
+int window_average(TFrame **framebuffer, int nframes, int centreframe, int half,
+		   int x0, int y0, int width, int height,
+		   double *sum, int start, TFrame *output);
+int window_minimum(TFrame **framebuffer, int nframes, int centreframe, int half,
+		   int x0, int y0, int width, int height,
+		   char *rescan, int start, TFrame *output);
 int subtract_background(TFrame *orig, TFrame *background, TFrame *output);
 int concatenate_frames(TFrame *output, int n, TFrame *first, ...);
 int concat_frames(TFrame *output, int n, TFrame **list);
@@ -125,6 +183,9 @@ int normalize_frame(TFrame *input, TFrame *output);
 int amplify_frame(TFrame *input, TFrame *output, float factor);
 int gamma_correct_frame(TFrame *input, TFrame *output, float gamma);
 int offset_frame(TFrame *input, TFrame *output, float midpoint);
+void clip_region(int width, int height, int *x, int *y, int *w, int *h);
+int crop_frame(TFrame *input, TFrame *output, int x, int y, int w, int h);
+int bin_frame(TFrame *input, TFrame *output, int n, int sum);
 
 int despeckle_median(TFrame *input, TFrame *output, int radius);
 int kuwahara_filter(TFrame *input, TFrame *output, int L);
@@ -143,16 +204,37 @@ void free_filter(FILTER *filter);
 int apply_filter(TFrame *input, FILTER *filter, TFrame *output);
 
 /* read_main.c */
+int read_region(int width, int height, int *x0, int *y0, int *w, int *h);
+void convert_rows(const void *src, long pitch, int type, int stride,
+		  int nrows, int ncols, TFrame *frame, int y, float factor);
+void *reserve_buffer(TBuffer *buffer, size_t size);
 void read_init();
+void read_sequence(int last, int step);
 void read_finish();
 int read_frame(int number, TFrame *frame);
 
+/* read_prefetch.c */
+int prefetch_start(int n);
+int prefetch_file(int key, char *filename);
+int prefetch_range(int key, int fd, off_t offset, size_t size);
+int prefetch_take(int key, TBuffer *buffer);
+void prefetch_discard(int key);
+void prefetch_stop();
+FILE *input_open(char *filename);
+
 /* process_main.c */
 void process_init();
-int process_frames(TFrame **framebuffer, int nframes, int centreframe, TFrame *output);
+int process_frames(TFrame **framebuffer, int nframes, int centreframe, TFrame **output);
 
 /* process_script.c */
 int process_script(char *exe_cmd, char *file);
+int script_window();
+void script_buffer(int nframes);
+int script_outputs();
+char *script_output(int k, char **file, int *depth, char **suffix);
+int script_geometry(int k, int *left, int *top, int *bin);
+void step_name(int i, char *name, int n);
+void background_name(int i, char *name, int n);
 
 #endif /* __SPICEWEASEL_H__ */
 